@@ -0,0 +1,603 @@
+//
+//  Benchmark.cpp
+//  Neural network
+//
+
+// Micro and end-to-end benchmarks on synthetic MNIST shaped data. Every measurement is printed
+// to stdout as one JSON object per line, so runs can be diffed or loaded straight into a script:
+//
+//   nn_benchmark --layers 784,100,100,10 --batch 32,100 --threads 1,0 --samples 10000
+//
+// --convergence <epochs> also trains the network synchronously and with trainAsync from the same
+// initial weights and prints the test() accuracy and loss after every epoch of both.
+//
+// --stages <n> adds train_pipelined, an epoch of trainPipelined with n stages and --micro-batches micro-batches.
+//
+// batch is 0 where the benchmark has no mini-batch. Set NN_KERNELS=scalar|sse|avx2|avx512 to compare instruction sets.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <thread>
+#include <cstdlib>
+
+#include <unistd.h>
+
+#include "Activation.hpp"
+#include "Kernels.hpp"
+#include "Layer.hpp"
+#include "NeuralNetwork.hpp"
+#include "SparseLayer.hpp"
+
+namespace
+{
+    constexpr int kActivationSize = 1 << 16; // elements per activation call
+    constexpr float kPruneSparsity = 0.9f; // weights pruned for the compressed layer and network measurements
+    
+    struct Options
+    {
+        std::vector<int> layerSizes = {784, 100, 100, 10};
+        std::vector<int> batchSizes = {100};
+        std::vector<int> threadCounts = {0}; // 0 is every hardware thread
+        int numSamples = 10000;
+        double minTime = 0.5; // seconds every measurement repeats for at least
+        ActivationType activationType = ActivationType::Sigmoid;
+        std::string filter; // only run benchmarks whose name contains this
+        
+        int convergenceEpochs = 0;
+        int maxStaleness = 16;
+        
+        int pipelineStages = 0; // train_pipelined is skipped unless set
+        int microBatches = 4;
+    };
+    
+    struct Measurement
+    {
+        std::string name;
+        std::vector<int> layers;
+        int batchSize = 1;
+        int numThreads = 1;
+        
+        // per iteration
+        double flops = 0;
+        double items = 0;
+        const char* itemName = "samples";
+        
+        int iterations = 0;
+        double seconds = 0;
+    };
+    
+    std::vector<int> parseList(const std::string& text)
+    {
+        std::vector<int> values;
+        std::stringstream stream(text);
+        std::string item;
+        while (std::getline(stream, item, ','))
+        {
+            values.push_back(std::stoi(item));
+        }
+        return values;
+    }
+    
+    bool parseActivation(const std::string& name, ActivationType& type)
+    {
+        const std::pair<const char*, ActivationType> names[] = {
+            {"sigmoid", ActivationType::Sigmoid},
+            {"tanh", ActivationType::TanH},
+            {"relu", ActivationType::ReLU},
+            {"silu", ActivationType::SiLU},
+        };
+        
+        for (const auto& [candidate, candidateType] : names)
+        {
+            if (name == candidate)
+            {
+                type = candidateType;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    void printUsage()
+    {
+        std::cerr << "usage: nn_benchmark [--layers 784,100,100,10] [--batch 100,...] [--threads 0,...]" << std::endl;
+        std::cerr << "                    [--samples 10000] [--min-time 0.5] [--activation sigmoid|tanh|relu|silu] [--filter name]" << std::endl;
+        std::cerr << "                    [--convergence epochs] [--staleness 16] [--stages n] [--micro-batches 4]" << std::endl;
+    }
+    
+    bool parseOptions(int argc, const char* argv[], Options& options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string option = argv[i];
+            if (i + 1 >= argc)
+            {
+                return false;
+            }
+            std::string value = argv[++i];
+            
+            if (option == "--layers") options.layerSizes = parseList(value);
+            else if (option == "--batch") options.batchSizes = parseList(value);
+            else if (option == "--threads") options.threadCounts = parseList(value);
+            else if (option == "--samples") options.numSamples = std::stoi(value);
+            else if (option == "--min-time") options.minTime = std::stod(value);
+            else if (option == "--filter") options.filter = value;
+            else if (option == "--convergence") options.convergenceEpochs = std::stoi(value);
+            else if (option == "--staleness") options.maxStaleness = std::stoi(value);
+            else if (option == "--stages") options.pipelineStages = std::stoi(value);
+            else if (option == "--micro-batches") options.microBatches = std::stoi(value);
+            else if (option == "--activation")
+            {
+                if (!parseActivation(value, options.activationType))
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                return false;
+            }
+        }
+        
+        return options.layerSizes.size() >= 2 && !options.batchSizes.empty() && !options.threadCounts.empty() && options.numSamples > 0;
+    }
+    
+    int resolveThreads(int numThreads)
+    {
+        return numThreads > 0 ? numThreads : std::max(1, (int) std::thread::hardware_concurrency());
+    }
+    
+    void print(const Measurement& m)
+    {
+        double secondsPerIteration = m.seconds / m.iterations;
+        
+        std::cout << "{\"benchmark\":\"" << m.name << "\",\"isa\":\"" << Kernels::isaName() << "\",\"layers\":[";
+        for (int i = 0; i < m.layers.size(); i++)
+        {
+            std::cout << (i ? "," : "") << m.layers[i];
+        }
+        std::cout << "],\"batch\":" << m.batchSize << ",\"threads\":" << m.numThreads;
+        std::cout << ",\"iterations\":" << m.iterations << ",\"seconds_per_iteration\":" << secondsPerIteration;
+        if (m.flops > 0)
+        {
+            std::cout << ",\"gflops\":" << m.flops / secondsPerIteration * 1e-9;
+        }
+        std::cout << ",\"" << m.itemName << "_per_second\":" << m.items / secondsPerIteration << "}" << std::endl;
+    }
+    
+    // Calls fn once to warm up, then until minTime has passed
+    template <typename Fn>
+    void measure(const Options& options, Measurement& m, Fn&& fn)
+    {
+        if (!options.filter.empty() && m.name.find(options.filter) == std::string::npos)
+        {
+            return;
+        }
+        
+        fn();
+        
+        auto start = std::chrono::steady_clock::now();
+        do
+        {
+            fn();
+            m.iterations++;
+            m.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        while (m.seconds < options.minTime);
+        
+        print(m);
+    }
+    
+    // CSV in the MNIST layout: a header line, then label,pixel,... with pixels 0-255. Each class is
+    // noise around its own random prototype, so training on it behaves like training on real data.
+    void writeSyntheticCsv(const std::string& filePath, int numInputs, int numClasses, int numSamples)
+    {
+        std::mt19937 rng(5489);
+        std::uniform_int_distribution<int> pixel(0, 255);
+        std::uniform_int_distribution<int> label(0, numClasses - 1);
+        std::normal_distribution<float> noise(0.0f, 40.0f);
+        
+        std::vector<std::vector<int>> prototypes(numClasses, std::vector<int>(numInputs));
+        for (std::vector<int>& prototype : prototypes)
+        {
+            for (int& value : prototype)
+            {
+                value = pixel(rng);
+            }
+        }
+        
+        std::ofstream file(filePath);
+        file << "label";
+        for (int i = 0; i < numInputs; i++)
+        {
+            file << ",pixel" << i;
+        }
+        file << "\n";
+        
+        std::string line;
+        for (int sample = 0; sample < numSamples; sample++)
+        {
+            int sampleLabel = label(rng);
+            
+            line = std::to_string(sampleLabel);
+            for (int value : prototypes[sampleLabel])
+            {
+                line += ',';
+                line += std::to_string(std::clamp((int) (value + noise(rng)), 0, 255));
+            }
+            line += '\n';
+            file << line;
+        }
+    }
+    
+    // One layer with its batch buffers and gradients bound to an arena, the way Network::reserveWorkspace does it
+    struct LayerSetup
+    {
+        Layer layer;
+        LayerBatchData batchData;
+        LayerGradients gradients;
+        AlignedVector<float> arena;
+        
+        LayerSetup(int numNodesIn, int numNodesOut, int capacity)
+        : layer(numNodesIn, numNodesOut)
+        {
+            layer.initRandomWeights();
+            arena.resize(layer.batchDataSize(capacity) + layer.gradientsSize());
+            layer.bindGradients(gradients, layer.bindBatchData(batchData, arena.data(), capacity));
+        }
+    };
+    
+    std::vector<float> randomValues(size_t count, float low, float high)
+    {
+        std::mt19937 rng(5489);
+        std::uniform_real_distribution<float> distribution(low, high);
+        
+        std::vector<float> values(count);
+        for (float& value : values)
+        {
+            value = distribution(rng);
+        }
+        return values;
+    }
+    
+    void benchmarkLayers(const Options& options)
+    {
+        const std::vector<int>& sizes = options.layerSizes;
+        int numLayers = (int) sizes.size() - 1;
+        
+        for (int index = 0; index < numLayers; index++)
+        {
+            int numIn = sizes[index];
+            int numOut = sizes[index + 1];
+            bool isOutput = index == numLayers - 1;
+            ActivationType activationType = isOutput ? ActivationType::Softmax : options.activationType;
+            
+            {
+                Layer layer(numIn, numOut);
+                layer.initRandomWeights();
+                std::vector<float> inputs = randomValues(numIn, 0.0f, 1.0f);
+                std::vector<float> outputs(numOut);
+                
+                Measurement m{"layer_forward_sample", {numIn, numOut}};
+                m.flops = 2.0 * numIn * numOut;
+                m.items = 1;
+                measure(options, m, [&] { layer.CalculateOutputs(inputs, outputs, activationType); });
+            }
+            
+            for (int batchSize : options.batchSizes)
+            {
+                std::vector<float> inputs = randomValues((size_t) batchSize * numIn, 0.0f, 1.0f);
+                LayerSetup setup(numIn, numOut, batchSize);
+                
+                Measurement forward{"layer_forward_batch", {numIn, numOut}, batchSize};
+                forward.flops = 2.0 * numIn * numOut * batchSize;
+                forward.items = batchSize;
+                measure(options, forward, [&] { setup.layer.CalculateOutputs(setup.batchData, inputs.data(), batchSize, activationType); });
+                
+                // Backward needs the forward pass' buffers, and hidden layers the node values of the layer after them
+                setup.layer.CalculateOutputs(setup.batchData, inputs.data(), batchSize, activationType);
+                
+                Measurement backward{"layer_backward_batch", {numIn, numOut}, batchSize};
+                backward.items = batchSize;
+                
+                if (isOutput)
+                {
+                    std::vector<float> expectedOutputs((size_t) batchSize * numOut, 0.0f);
+                    for (int i = 0; i < batchSize; i++)
+                    {
+                        expectedOutputs[(size_t) i * numOut + i % numOut] = 1.0f;
+                    }
+                    
+                    backward.flops = 2.0 * numIn * numOut * batchSize;
+                    measure(options, backward, [&]
+                    {
+                        setup.layer.CalculateOutputLayerNodeValues(setup.batchData, expectedOutputs.data(), CostType::CrossEntropy, activationType);
+                        setup.layer.updateGradients(setup.batchData, setup.gradients);
+                    });
+                }
+                else
+                {
+                    int numNext = sizes[index + 2];
+                    LayerSetup next(numOut, numNext, batchSize);
+                    next.layer.CalculateOutputs(next.batchData, setup.batchData.activations, batchSize, ActivationType::Sigmoid);
+                    std::vector<float> expectedOutputs((size_t) batchSize * numNext, 0.0f);
+                    next.layer.CalculateOutputLayerNodeValues(next.batchData, expectedOutputs.data(), CostType::MeanSquareError, ActivationType::Sigmoid);
+                    
+                    // node values from the next layer's weights, then the weight gradients
+                    backward.flops = 2.0 * numOut * numNext * batchSize + 2.0 * numIn * numOut * batchSize;
+                    measure(options, backward, [&]
+                    {
+                        setup.layer.CalculateLayerNodeValues(setup.batchData, next.layer, next.batchData, activationType);
+                        setup.layer.updateGradients(setup.batchData, setup.gradients);
+                    });
+                }
+                
+                // The first layer's sparse kernels on MNIST-like inputs, about 80% exact zeros. Only the
+                // nonzero inputs count as flops.
+                if (index == 0)
+                {
+                    std::vector<float> pixels = randomValues((size_t) batchSize * numIn, -4.0f, 1.0f);
+                    for (float& pixel : pixels)
+                    {
+                        pixel = std::max(pixel, 0.0f);
+                    }
+                    
+                    SparseRows sparseInputs;
+                    sparseInputs.assign(pixels.data(), batchSize, numIn);
+                    
+                    LayerSetup sparse(numIn, numOut, batchSize);
+                    sparse.layer.setSparseInputs(true);
+                    
+                    Measurement sparseForward{"layer_forward_batch_sparse", {numIn, numOut}, batchSize};
+                    sparseForward.flops = 2.0 * sparseInputs.values.size() * numOut;
+                    sparseForward.items = batchSize;
+                    measure(options, sparseForward, [&] { sparse.layer.CalculateOutputs(sparse.batchData, pixels.data(), sparseInputs, activationType); });
+                    
+                    Measurement sparseGradients{"layer_weight_gradients_batch_sparse", {numIn, numOut}, batchSize};
+                    sparseGradients.flops = sparseForward.flops;
+                    sparseGradients.items = batchSize;
+                    measure(options, sparseGradients, [&] { sparse.layer.updateGradients(sparse.batchData, sparse.gradients); });
+                }
+                
+                {
+                    // Compressed sparse rows of the layer pruned to kPruneSparsity, only kept weights count as flops
+                    setup.layer.prune(kPruneSparsity);
+                    SparseLayer pruned(setup.layer);
+                    
+                    Measurement compressed{"layer_forward_batch_compressed", {numIn, numOut}, batchSize};
+                    compressed.flops = 2.0 * pruned.numNonZeroWeights() * batchSize;
+                    compressed.items = batchSize;
+                    measure(options, compressed, [&] { pruned.CalculateOutputs(setup.batchData, inputs.data(), batchSize, activationType); });
+                }
+            }
+            
+            // flops per parameter: velocity, decay and add, plus the look-ahead for Nesterov and the two
+            // moments, square root and divide for the adaptive ones. Momentum keeps the plain name.
+            const std::pair<OptimizerType, double> optimizers[] = {
+                {OptimizerType::Momentum, 4},
+                {OptimizerType::Nesterov, 6},
+                {OptimizerType::Adam, 14},
+                {OptimizerType::AdamW, 14},
+                {OptimizerType::RMSProp, 14},
+            };
+            for (auto [type, flops] : optimizers)
+            {
+                Layer layer(numIn, numOut);
+                layer.initRandomWeights();
+                layer.setOptimizer(type);
+                
+                OptimizerSettings settings;
+                settings.type = type;
+                
+                // The gradients stay zero between repetitions, L2 would decay the moments into denormals
+                bool adaptive = OptimizerSettings::numStateBuffers(type) > 1;
+                OptimizerStep step(settings, 1, 0.001f, 1, adaptive ? 0.0f : 0.1f, 0.9f);
+                
+                std::string name = "apply_gradient";
+                Measurement m{type == OptimizerType::Momentum ? name : name + "_" + OptimizerSettings::name(type), {numIn, numOut}};
+                m.flops = flops * layer.numParameters();
+                m.items = layer.numParameters();
+                m.itemName = "parameters";
+                measure(options, m, [&] { layer.applyGradient(step); });
+            }
+        }
+    }
+    
+    void benchmarkActivations(const Options& options)
+    {
+        const std::pair<const char*, ActivationType> types[] = {
+            {"sigmoid", ActivationType::Sigmoid},
+            {"tanh", ActivationType::TanH},
+            {"relu", ActivationType::ReLU},
+            {"silu", ActivationType::SiLU},
+            {"softmax", ActivationType::Softmax},
+        };
+        
+        std::vector<float> inputs = randomValues(kActivationSize, -4.0f, 4.0f);
+        std::vector<float> values = inputs;
+        std::vector<float> derivatives(kActivationSize);
+        
+        for (const auto& [name, type] : types)
+        {
+            // in place, so values drift between calls but stay in range for every type
+            Measurement activate{std::string("activation_") + name, {kActivationSize}};
+            activate.items = kActivationSize;
+            activate.itemName = "elements";
+            measure(options, activate, [&, type = type] { Activation::activate(values, type); });
+            
+            Measurement derivative{std::string("activation_derivative_") + name, {kActivationSize}};
+            derivative.items = kActivationSize;
+            derivative.itemName = "elements";
+            measure(options, derivative, [&, type = type] { Activation::derivative(inputs, derivatives, type); });
+        }
+    }
+    
+    void benchmarkNetwork(const Options& options, const std::string& csvPath)
+    {
+        const std::vector<int>& sizes = options.layerSizes;
+        
+        double numWeights = 0;
+        for (int i = 0; i + 1 < sizes.size(); i++)
+        {
+            numWeights += (double) sizes[i] * sizes[i + 1];
+        }
+        
+        for (int numThreads : options.threadCounts)
+        {
+            Network network(sizes, options.activationType, CostType::CrossEntropy);
+            network.setNumThreads(numThreads);
+            network.initRandomWeights();
+            
+            Measurement load{"load_data", sizes, 0, resolveThreads(numThreads)};
+            load.items = options.numSamples;
+            measure(options, load, [&] { network.loadData(csvPath, sizes[0], options.numSamples); });
+            
+            network.loadData(csvPath, sizes[0], options.numSamples);
+            
+            for (int batchSize : options.batchSizes)
+            {
+                // forward 2 flops per weight per sample, backward 4 (node values and weight gradients)
+                Measurement train{"train_epoch", sizes, batchSize, resolveThreads(numThreads)};
+                train.flops = 6.0 * numWeights * options.numSamples;
+                train.items = options.numSamples;
+                
+                measure(options, train, [&]
+                {
+                    // train() reports every mini-batch on stdout, keep the JSON clean
+                    std::streambuf* stdoutBuffer = std::cout.rdbuf(nullptr);
+                    network.train(1, batchSize, 0.1f, 0.0f, 0.9f);
+                    std::cout.rdbuf(stdoutBuffer);
+                    std::cout.clear();
+                });
+                
+                if (options.pipelineStages > 0)
+                {
+                    // One thread per stage regardless of the pool
+                    Measurement pipelined{"train_pipelined", sizes, batchSize, options.pipelineStages};
+                    pipelined.flops = train.flops;
+                    pipelined.items = train.items;
+                    
+                    measure(options, pipelined, [&]
+                    {
+                        std::streambuf* stdoutBuffer = std::cout.rdbuf(nullptr);
+                        network.trainPipelined(options.pipelineStages, options.microBatches, 1, batchSize, 0.1f, 0.0f, 0.9f);
+                        std::cout.rdbuf(stdoutBuffer);
+                        std::cout.clear();
+                    });
+                }
+            }
+            
+            Measurement test{"test", sizes, 0, resolveThreads(numThreads)};
+            test.flops = 2.0 * numWeights * options.numSamples;
+            test.items = options.numSamples;
+            measure(options, test, [&] { network.test(); });
+            
+            // Pruned without fine-tuning, so only the speed means anything
+            network.prune(kPruneSparsity);
+            network.compress();
+            
+            Measurement compressed{"test_compressed", sizes, 0, resolveThreads(numThreads)};
+            compressed.flops = test.flops * (1.0 - kPruneSparsity);
+            compressed.items = options.numSamples;
+            measure(options, compressed, [&] { network.test(); });
+        }
+    }
+    
+    // Synchronous mini-batches of batchSize against Hogwild workers that each apply batchSize samples at a time
+    void benchmarkConvergence(const Options& options, const std::string& csvPath)
+    {
+        if (!options.filter.empty() && std::string("convergence").find(options.filter) == std::string::npos)
+        {
+            return;
+        }
+        
+        for (int numThreads : options.threadCounts)
+        {
+            for (int batchSize : options.batchSizes)
+            {
+                for (bool async : { false, true })
+                {
+                    Network network(options.layerSizes, options.activationType, CostType::CrossEntropy);
+                    network.setNumThreads(numThreads);
+                    network.initRandomWeights();
+                    network.loadData(csvPath, options.layerSizes.front(), options.numSamples);
+                    
+                    double seconds = 0;
+                    for (int epoch = 0; epoch < options.convergenceEpochs; epoch++)
+                    {
+                        std::streambuf* stdoutBuffer = std::cout.rdbuf(nullptr);
+                        auto start = std::chrono::steady_clock::now();
+                        
+                        AsyncTrainingStats stats;
+                        if (async)
+                        {
+                            stats = network.trainAsync(1, batchSize, 0.1f, 0.0f, 0.9f, options.maxStaleness);
+                        }
+                        else
+                        {
+                            network.train(1, batchSize, 0.1f, 0.0f, 0.9f);
+                        }
+                        
+                        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                        std::cout.rdbuf(stdoutBuffer);
+                        std::cout.clear();
+                        
+                        EvaluationResult result = network.test();
+                        
+                        std::cout << "{\"benchmark\":\"convergence\",\"mode\":\"" << (async ? "hogwild" : "sync") << "\",\"batch\":" << batchSize;
+                        std::cout << ",\"threads\":" << resolveThreads(numThreads) << ",\"epoch\":" << epoch << ",\"train_seconds\":" << seconds;
+                        std::cout << ",\"accuracy\":" << result.accuracy << ",\"loss\":" << result.loss;
+                        if (async)
+                        {
+                            std::cout << ",\"mean_staleness\":" << stats.meanStaleness << ",\"max_staleness\":" << stats.maxStaleness;
+                        }
+                        std::cout << "}" << std::endl;
+                    }
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, const char* argv[])
+{
+    Options options;
+    if (!parseOptions(argc, argv, options))
+    {
+        printUsage();
+        return 1;
+    }
+    
+    std::string csvPath = (std::filesystem::temp_directory_path() / ("nn_benchmark_" + std::to_string(getpid()) + ".csv")).string();
+    
+    try
+    {
+        benchmarkLayers(options);
+        benchmarkActivations(options);
+        
+        writeSyntheticCsv(csvPath, options.layerSizes.front(), options.layerSizes.back(), options.numSamples);
+        benchmarkNetwork(options, csvPath);
+        
+        if (options.convergenceEpochs > 0)
+        {
+            benchmarkConvergence(options, csvPath);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "[nn_benchmark] " << e.what() << std::endl;
+        std::filesystem::remove(csvPath);
+        return 1;
+    }
+    
+    std::filesystem::remove(csvPath);
+    
+    return 0;
+}
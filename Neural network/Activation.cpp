@@ -8,9 +8,10 @@
 #include "Activation.hpp"
 
 #include <cmath>
+#include <algorithm>
 
 
-float Activation::activate(std::vector<float> inputs, int index, ActivationType type)
+float Activation::activate(const std::vector<float>& inputs, int index, ActivationType type)
 {
     switch (type)
     {
@@ -46,7 +47,7 @@ float Activation::activate(std::vector<float> inputs, int index, ActivationType
     }
 }
 
-float Activation::derivative(std::vector<float> inputs, int index, ActivationType type)
+float Activation::derivative(const std::vector<float>& inputs, int index, ActivationType type)
 {
     switch (type)
     {
@@ -84,3 +85,119 @@ float Activation::derivative(std::vector<float> inputs, int index, ActivationTyp
         }
     }
 }
+
+void Activation::activate(std::span<float> values, ActivationType type)
+{
+    switch (type)
+    {
+        case ActivationType::Sigmoid:
+        {
+            for (float& x : values)
+            {
+                x = 1.0f / (1.0f + std::exp(-x));
+            }
+            break;
+        }
+        case ActivationType::TanH:
+        {
+            for (float& x : values)
+            {
+                x = std::tanh(x);
+            }
+            break;
+        }
+        case ActivationType::ReLU:
+        {
+            for (float& x : values)
+            {
+                x = std::max(0.0f, x);
+            }
+            break;
+        }
+        case ActivationType::SiLU:
+        {
+            for (float& x : values)
+            {
+                x = x / (1.0f + std::exp(-x));
+            }
+            break;
+        }
+        case ActivationType::Softmax:
+        {
+            if (values.empty())
+            {
+                break;
+            }
+            
+            // shifting by the max keeps exp from overflowing and doesn't change the result
+            float maxValue = *std::max_element(values.begin(), values.end());
+            
+            float expSum = 0;
+            for (float& x : values)
+            {
+                x = std::exp(x - maxValue);
+                expSum += x;
+            }
+            
+            float scale = 1.0f / expSum;
+            for (float& x : values)
+            {
+                x *= scale;
+            }
+            break;
+        }
+    }
+}
+
+void Activation::derivative(std::span<const float> inputs, std::span<float> derivatives, ActivationType type)
+{
+    switch (type)
+    {
+        case ActivationType::Sigmoid:
+        {
+            for (size_t i = 0; i < inputs.size(); i++)
+            {
+                float a = 1.0f / (1.0f + std::exp(-inputs[i]));
+                derivatives[i] = a * (1 - a);
+            }
+            break;
+        }
+        case ActivationType::TanH:
+        {
+            for (size_t i = 0; i < inputs.size(); i++)
+            {
+                float t = std::tanh(inputs[i]);
+                derivatives[i] = 1 - t * t;
+            }
+            break;
+        }
+        case ActivationType::ReLU:
+        {
+            for (size_t i = 0; i < inputs.size(); i++)
+            {
+                derivatives[i] = (inputs[i] > 0) ? 1 : 0;
+            }
+            break;
+        }
+        case ActivationType::SiLU:
+        {
+            for (size_t i = 0; i < inputs.size(); i++)
+            {
+                float sig = 1.0f / (1.0f + std::exp(-inputs[i]));
+                derivatives[i] = inputs[i] * sig * (1 - sig) + sig;
+            }
+            break;
+        }
+        case ActivationType::Softmax:
+        {
+            std::copy(inputs.begin(), inputs.end(), derivatives.begin());
+            activate(derivatives.first(inputs.size()), ActivationType::Softmax);
+            
+            for (float& s : derivatives.first(inputs.size()))
+            {
+                s = s * (1 - s);
+            }
+            break;
+        }
+    }
+}
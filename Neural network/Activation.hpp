@@ -8,6 +8,7 @@
 #pragma once
 
 #include <vector>
+#include <span>
 
 enum class ActivationType
 {
@@ -21,7 +22,14 @@ enum class ActivationType
 class Activation
 {
 public:
-    static float activate(std::vector<float> inputs, int index, ActivationType type = ActivationType::Sigmoid);
+    static float activate(const std::vector<float>& inputs, int index, ActivationType type = ActivationType::Sigmoid);
 
-    static float derivative(std::vector<float> inputs, int index, ActivationType type = ActivationType::Sigmoid);
+    static float derivative(const std::vector<float>& inputs, int index, ActivationType type = ActivationType::Sigmoid);
+    
+    // Whole layer at once, in place: values go in as weighted inputs and come out as activations.
+    // Softmax is computed with one max pass and one exp-sum pass.
+    static void activate(std::span<float> values, ActivationType type = ActivationType::Sigmoid);
+    
+    // derivatives[i] = d activation[i] / d inputs[i] for the whole layer (the Jacobian diagonal for Softmax)
+    static void derivative(std::span<const float> inputs, std::span<float> derivatives, ActivationType type = ActivationType::Sigmoid);
 };
@@ -0,0 +1,61 @@
+//
+//  AlignedAllocator.hpp
+//  Neural network
+//
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+constexpr std::size_t kCacheLineSize = 64;
+
+// Smallest whole number of cache lines of T holding count elements, used to carve one
+// aligned buffer into slices that each start on their own line
+template <typename T>
+constexpr std::size_t roundToCacheLine(std::size_t count)
+{
+    constexpr std::size_t perLine = kCacheLineSize / sizeof(T);
+    return (count + perLine - 1) / perLine * perLine;
+}
+
+// Allocator that starts every buffer on its own cache line, so buffers written
+// by different threads never share one and SIMD loads are aligned
+template <typename T, std::size_t Alignment = kCacheLineSize>
+struct AlignedAllocator
+{
+    using value_type = T;
+    
+    template <typename U>
+    struct rebind
+    {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+    
+    AlignedAllocator() = default;
+    
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+    
+    T* allocate(std::size_t count)
+    {
+        // round up so the buffer also ends on a cache line boundary
+        std::size_t bytes = (count * sizeof(T) + Alignment - 1) / Alignment * Alignment;
+        return static_cast<T*>(::operator new(bytes, std::align_val_t(Alignment)));
+    }
+    
+    void deallocate(T* pointer, std::size_t)
+    {
+        ::operator delete(pointer, std::align_val_t(Alignment));
+    }
+    
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+    
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
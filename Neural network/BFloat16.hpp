@@ -0,0 +1,37 @@
+//
+//  BFloat16.hpp
+//  Neural network
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// bfloat16 is the top half of a float32: same exponent range, 8 bits of mantissa.
+// Stored as raw bits, every computation converts back to float first.
+using bfloat16 = uint16_t;
+
+// Round to nearest even, NaNs stay NaN
+inline bfloat16 toBFloat16(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    
+    if ((bits & 0x7FFFFFFF) > 0x7F800000)
+    {
+        return (bfloat16) ((bits >> 16) | 0x40);
+    }
+    
+    bits += 0x7FFF + ((bits >> 16) & 1);
+    return (bfloat16) (bits >> 16);
+}
+
+inline float fromBFloat16(bfloat16 value)
+{
+    uint32_t bits = (uint32_t) value << 16;
+    
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
@@ -0,0 +1,121 @@
+//
+//  BatchPipeline.cpp
+//  Neural network
+//
+
+#include "BatchPipeline.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+
+BatchPipeline::BatchPipeline(const Dataset& data, int batchSize, int numEpochs, float noise, unsigned int seed, int sampleBegin, int sampleEnd, bool keepZeros)
+: m_data(data), m_batchSize(batchSize), m_numEpochs(numEpochs), m_noise(noise), m_seed(seed),
+  m_sampleBegin(sampleBegin), m_sampleEnd(sampleEnd < 0 ? data.size() : sampleEnd), m_keepZeros(keepZeros)
+{
+    for (TrainingBatch& slot : m_slots)
+    {
+        slot.inputs.resize((size_t) batchSize * data.numInputs());
+        slot.labels.resize(batchSize);
+    }
+    
+    m_producer = std::thread([this](){ this->produce(); });
+}
+
+BatchPipeline::~BatchPipeline()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_changed.notify_all();
+    m_producer.join();
+}
+
+const TrainingBatch* BatchPipeline::acquire()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_changed.wait(lock, [this](){ return m_ready[m_consumerSlot] || m_finished; });
+    
+    return m_ready[m_consumerSlot] ? &m_slots[m_consumerSlot] : nullptr;
+}
+
+void BatchPipeline::release()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_ready[m_consumerSlot] = false;
+        m_consumerSlot ^= 1;
+    }
+    m_changed.notify_all();
+}
+
+void BatchPipeline::produce()
+{
+    std::mt19937 generator(m_seed);
+    std::normal_distribution<float> distribution(0.0f, m_noise);
+    
+    int numSamples = m_sampleEnd - m_sampleBegin;
+    int numInputs = m_data.numInputs();
+    
+    std::vector<int> order(numSamples);
+    std::iota(order.begin(), order.end(), m_sampleBegin);
+    
+    int slot = 0;
+    
+    for (int epoch = 0; epoch < m_numEpochs; epoch++)
+    {
+        std::shuffle(order.begin(), order.end(), generator);
+        
+        for (int batchStart = 0; batchStart < numSamples; batchStart += m_batchSize)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_changed.wait(lock, [&](){ return !m_ready[slot] || m_stop; });
+                if (m_stop)
+                {
+                    return;
+                }
+            }
+            
+            TrainingBatch& batch = m_slots[slot];
+            batch.epoch = epoch;
+            batch.batchSize = std::min(m_batchSize, numSamples - batchStart);
+            batch.endOfEpoch = batchStart + m_batchSize >= numSamples;
+            
+            for (int i = 0; i < batch.batchSize; i++)
+            {
+                int sample = order[batchStart + i];
+                float* row = &batch.inputs[(size_t) i * numInputs];
+                
+                m_data.copyRows(sample, 1, row);
+                batch.labels[i] = m_data.label(sample);
+                
+                if (m_noise > 0)
+                {
+                    for (int input = 0; input < numInputs; input++)
+                    {
+                        if (!m_keepZeros || row[input] != 0.0f)
+                        {
+                            row[input] += distribution(generator);
+                        }
+                    }
+                }
+            }
+            
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_ready[slot] = true;
+            }
+            m_changed.notify_all();
+            
+            slot ^= 1;
+        }
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_finished = true;
+    }
+    m_changed.notify_all();
+}
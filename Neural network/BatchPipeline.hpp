@@ -0,0 +1,68 @@
+//
+//  BatchPipeline.hpp
+//  Neural network
+//
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "AlignedAllocator.hpp"
+#include "Dataset.hpp"
+
+// One shuffled, augmented mini-batch ready for training
+struct TrainingBatch
+{
+    int epoch = 0;
+    int batchSize = 0;
+    bool endOfEpoch = false; // last batch of its epoch
+    
+    AlignedVector<float> inputs; // batchSize x numInputs
+    std::vector<int> labels;
+};
+
+// Double buffered producer: a background thread shuffles the dataset every epoch and gathers the
+// next mini-batch, adding fresh Gaussian pixel noise, while the caller trains on the current one
+class BatchPipeline
+{
+public:
+    // Epochs run over samples [sampleBegin, sampleEnd) of data, the whole dataset when sampleEnd is negative.
+    // keepZeros only adds noise to nonzero inputs, so the batches stay as sparse as the dataset.
+    BatchPipeline(const Dataset& data, int batchSize, int numEpochs, float noise, unsigned int seed, int sampleBegin = 0, int sampleEnd = -1, bool keepZeros = false);
+    ~BatchPipeline();
+    
+    BatchPipeline(const BatchPipeline&) = delete;
+    BatchPipeline& operator=(const BatchPipeline&) = delete;
+    
+    // Blocks until the next batch is ready, nullptr once every epoch has been handed out
+    const TrainingBatch* acquire();
+    
+    // Gives the batch from the last acquire back to the producer
+    void release();
+    
+private:
+    void produce();
+    
+private:
+    const Dataset& m_data;
+    int m_batchSize;
+    int m_numEpochs;
+    float m_noise;
+    unsigned int m_seed;
+    int m_sampleBegin;
+    int m_sampleEnd;
+    bool m_keepZeros;
+    
+    TrainingBatch m_slots[2];
+    bool m_ready[2] = { false, false };
+    int m_consumerSlot = 0;
+    bool m_finished = false;
+    bool m_stop = false;
+    
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::thread m_producer;
+};
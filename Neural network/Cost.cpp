@@ -8,8 +8,10 @@
 #include "Cost.hpp"
 
 #include <cmath>
+#include <stdexcept>
+#include <algorithm>
 
-float Cost::getCost(std::vector<float> outputs, std::vector<float> expectedOutputs, CostType type)
+float Cost::getCost(std::span<const float> outputs, std::span<const float> weightedInputs, std::span<const float> expectedOutputs, CostType type, ActivationType activationType)
 {
     if (type == CostType::MeanSquareError)
     {
@@ -21,15 +23,20 @@ float Cost::getCost(std::vector<float> outputs, std::vector<float> expectedOutpu
         }
         return 0.5 * cost;
     }
+    else if (type == CostType::CrossEntropy && activationType == ActivationType::Softmax)
+    {
+        return softmaxCrossEntropy(weightedInputs, expectedOutputs);
+    }
     else if (type == CostType::CrossEntropy)
     {
+        // Outputs of exactly 0 or 1 are held just inside, where derivative gives up and returns 0
+        constexpr float kEpsilon = 1e-7f;
         float cost = 0;
         for (int i = 0; i < outputs.size(); i++)
         {
-            float x = outputs[i];
+            float x = std::clamp(outputs[i], kEpsilon, 1 - kEpsilon);
             float y = expectedOutputs[i];
-            float v = (y == 1) ? -log(x) : -log(1 - x);
-            cost += v ? 0 : v;
+            cost += -y * std::log(x) - (1 - y) * std::log(1 - x);
         }
         return cost;
     }
@@ -61,3 +68,31 @@ float Cost::derivative(float output, float expectedOutput, CostType type)
         throw std::runtime_error("Invalid cost function");
     }
 }
+
+float Cost::softmaxCrossEntropy(std::span<const float> weightedInputs, std::span<const float> expectedOutputs)
+{
+    float maxValue = *std::max_element(weightedInputs.begin(), weightedInputs.end());
+    
+    float expSum = 0;
+    for (float z : weightedInputs)
+    {
+        expSum += std::exp(z - maxValue);
+    }
+    float logSumExp = maxValue + std::log(expSum);
+    
+    // -sum(y * log(softmax(z))) = sum(y * (logSumExp - z))
+    float cost = 0;
+    for (size_t i = 0; i < weightedInputs.size(); i++)
+    {
+        cost += expectedOutputs[i] * (logSumExp - weightedInputs[i]);
+    }
+    return cost;
+}
+
+void Cost::softmaxCrossEntropyDerivative(std::span<const float> activations, std::span<const float> expectedOutputs, std::span<float> nodeValues)
+{
+    for (size_t i = 0; i < activations.size(); i++)
+    {
+        nodeValues[i] = activations[i] - expectedOutputs[i];
+    }
+}
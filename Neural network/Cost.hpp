@@ -8,6 +8,9 @@
 #pragma once
 
 #include <vector>
+#include <span>
+
+#include "Activation.hpp"
 
 enum class CostType
 {
@@ -18,8 +21,18 @@ enum class CostType
 class Cost
 {
 public:
-    static float getCost(std::vector<float> outputs, std::vector<float> expectedOutputs, CostType type = CostType::MeanSquareError);
+    // MeanSquareError compares the outputs. CrossEntropy of a softmax output layer is softmaxCrossEntropy of its
+    // weighted inputs, the loss whose gradient the fused softmax output layer computes; of any other output layer it
+    // is the per-output binary cross entropy of the outputs, the loss whose gradient derivative computes.
+    static float getCost(std::span<const float> outputs, std::span<const float> weightedInputs, std::span<const float> expectedOutputs, CostType type, ActivationType activationType);
     
     static float derivative(float output, float expectedOutput, CostType type = CostType::MeanSquareError);
     
+    // Cross entropy of softmax(weightedInputs), computed straight from the weighted inputs with log-sum-exp
+    // so it stays finite when the softmax saturates to 0 or 1
+    static float softmaxCrossEntropy(std::span<const float> weightedInputs, std::span<const float> expectedOutputs);
+    
+    // Gradient of softmaxCrossEntropy with respect to the weighted inputs: activations - expectedOutputs
+    static void softmaxCrossEntropyDerivative(std::span<const float> activations, std::span<const float> expectedOutputs, std::span<float> nodeValues);
+    
 };
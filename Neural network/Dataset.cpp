@@ -0,0 +1,384 @@
+//
+//  Dataset.cpp
+//  Neural network
+//
+
+#include "Dataset.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+    constexpr char kMagic[4] = { 'N', 'N', 'D', 'S' };
+    constexpr size_t kArrayAlignment = 64;
+    
+    size_t alignUp(size_t value, size_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+    
+    size_t pixelSize(PixelFormat format)
+    {
+        switch (format)
+        {
+            case PixelFormat::UInt8: return sizeof(uint8_t);
+            case PixelFormat::BFloat16: return sizeof(bfloat16);
+            default: return sizeof(float);
+        }
+    }
+}
+
+void Dataset::allocate(int numSamples, int numInputs, PixelFormat format)
+{
+    m_mappedFile.reset();
+    
+    size_t labelOffset = sizeof(DatasetFileHeader);
+    size_t featureOffset = alignUp(labelOffset + numSamples * sizeof(int32_t), kArrayAlignment);
+    size_t fileSize = featureOffset + (size_t) numSamples * numInputs * pixelSize(format);
+    
+    m_storage.assign(fileSize, 0);
+    
+    DatasetFileHeader header = {};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.pixelFormat = (uint32_t) format;
+    header.numInputs = (uint32_t) numInputs;
+    header.numSamples = (uint64_t) numSamples;
+    header.labelOffset = labelOffset;
+    header.featureOffset = featureOffset;
+    header.fileSize = fileSize;
+    std::memcpy(m_storage.data(), &header, sizeof(header));
+}
+
+void Dataset::loadCsv(const std::string& filePath, int numInputs, int numClasses, int dataSize, PixelFormat format, ThreadPool* threadPool)
+{
+    std::shared_ptr<MappedFile> file = MappedFile::open(filePath);
+    const char* begin = reinterpret_cast<const char*>(file->data());
+    const char* end = begin + file->size();
+    
+    // row 0 is the CSV header
+    const char* body = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+    body = body ? body + 1 : end;
+    
+    allocate(dataSize, numInputs, format);
+    
+    int32_t* labelData = reinterpret_cast<int32_t*>(data() + header().labelOffset);
+    unsigned char* featureData = data() + header().featureOffset;
+    
+    // Split the body into one byte range per worker, each starting at the beginning of a line
+    int numRanges = threadPool ? threadPool->size() : 1;
+    std::vector<const char*> rangeStarts(numRanges + 1, end);
+    rangeStarts[0] = body;
+    for (int range = 1; range < numRanges; range++)
+    {
+        const char* split = std::max(rangeStarts[range - 1], body + (end - body) * range / numRanges);
+        const char* newline = static_cast<const char*>(std::memchr(split, '\n', end - split));
+        rangeStarts[range] = newline ? newline + 1 : end;
+    }
+    
+    // Count the rows of every range first so each one knows where its rows go
+    std::vector<int> rangeRows(numRanges + 1, 0);
+    auto forEachRange = [&](const std::function<void(int)>& fn)
+    {
+        if (threadPool)
+            threadPool->parallelFor(numRanges, 1, [&](int first, int last, int) { for (int range = first; range < last; range++) fn(range); });
+        else
+            fn(0);
+    };
+    
+    forEachRange([&](int range)
+    {
+        int rows = 0;
+        forEachLine(rangeStarts[range], rangeStarts[range + 1], [&](const char*, const char*) { rows++; });
+        rangeRows[range + 1] = rows;
+    });
+    
+    for (int range = 0; range < numRanges; range++)
+    {
+        rangeRows[range + 1] += rangeRows[range];
+    }
+    
+    std::atomic<long> badRow { -1 };
+    
+    forEachRange([&](int range)
+    {
+        int row = rangeRows[range];
+        forEachLine(rangeStarts[range], rangeStarts[range + 1], [&](const char* line, const char* lineEnd)
+        {
+            if (row < dataSize && !parseRow(line, lineEnd, numInputs, numClasses, format, labelData + row, featureData, row))
+            {
+                badRow.store(row);
+            }
+            row++;
+        });
+    });
+    
+    if (badRow.load() >= 0)
+    {
+        clear();
+        throw std::runtime_error(filePath + ": malformed data on row " + std::to_string(badRow.load() + 1));
+    }
+    
+    // a short file only fills the first rows, repack so the arrays stay back to back
+    int numSamples = std::min(rangeRows[numRanges], dataSize);
+    if (numSamples < dataSize)
+    {
+        AlignedVector<unsigned char> parsed;
+        parsed.swap(m_storage);
+        const DatasetFileHeader& parsedHeader = *reinterpret_cast<const DatasetFileHeader*>(parsed.data());
+        
+        allocate(numSamples, numInputs, format);
+        std::memcpy(data() + header().labelOffset, parsed.data() + parsedHeader.labelOffset, numSamples * sizeof(int32_t));
+        std::memcpy(data() + header().featureOffset, parsed.data() + parsedHeader.featureOffset, (size_t) numSamples * numInputs * pixelSize(format));
+    }
+}
+
+template <typename Fn>
+void Dataset::forEachLine(const char* begin, const char* end, Fn&& fn)
+{
+    while (begin < end)
+    {
+        const char* newline = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+        const char* lineEnd = newline ? newline : end;
+        
+        // accept \r\n endings and skip blank lines
+        const char* contentEnd = lineEnd;
+        if (contentEnd > begin && contentEnd[-1] == '\r')
+        {
+            contentEnd--;
+        }
+        if (contentEnd > begin)
+        {
+            fn(begin, contentEnd);
+        }
+        
+        begin = newline ? newline + 1 : end;
+    }
+}
+
+bool Dataset::parseRow(const char* line, const char* end, int numInputs, int numClasses, PixelFormat format, int32_t* label, unsigned char* featureData, int row)
+{
+    float value;
+    if (!parseValue(line, end, value) || !(value >= 0.0f && value < numClasses) || value != (float) (int32_t) value)
+    {
+        return false;
+    }
+    *label = (int32_t) value;
+    
+    size_t offset = (size_t) row * numInputs;
+    for (int input = 0; input < numInputs; input++)
+    {
+        if (line >= end || *line != ',')
+        {
+            return false;
+        }
+        line++;
+        
+        if (!parseValue(line, end, value))
+        {
+            return false;
+        }
+        
+        if (format == PixelFormat::UInt8)
+            featureData[offset + input] = (uint8_t) std::clamp(value, 0.0f, 255.0f);
+        else if (format == PixelFormat::BFloat16)
+            reinterpret_cast<bfloat16*>(featureData)[offset + input] = toBFloat16(value / 255.0f);
+        else
+            reinterpret_cast<float*>(featureData)[offset + input] = value / 255.0f;
+    }
+    
+    // More columns than numInputs is a different image size, not a row to truncate
+    while (line < end && (*line == ' ' || *line == '\t'))
+    {
+        line++;
+    }
+    return line == end;
+}
+
+bool Dataset::parseValue(const char*& p, const char* end, float& value)
+{
+    while (p < end && *p == ' ')
+    {
+        p++;
+    }
+    
+    // Pixels and labels are small unsigned integers, parse those without any locale or float handling
+    const char* start = p;
+    unsigned int integer = 0;
+    while (p < end && *p >= '0' && *p <= '9' && p - start < 9)
+    {
+        integer = integer * 10 + (*p - '0');
+        p++;
+    }
+    if (p > start && (p == end || *p == ',' || *p == ' '))
+    {
+        value = (float) integer;
+    }
+    else
+    {
+        // Anything else (signs, decimals, exponents) goes through strtof on a terminated copy
+        const char* fieldEnd = static_cast<const char*>(std::memchr(start, ',', end - start));
+        fieldEnd = fieldEnd ? fieldEnd : end;
+        
+        char buffer[64];
+        size_t length = std::min<size_t>(fieldEnd - start, sizeof(buffer) - 1);
+        std::memcpy(buffer, start, length);
+        buffer[length] = 0;
+        
+        char* parsedEnd;
+        value = std::strtof(buffer, &parsedEnd);
+        if (parsedEnd == buffer)
+        {
+            return false;
+        }
+        p = start + (parsedEnd - buffer);
+    }
+    
+    while (p < end && *p == ' ')
+    {
+        p++;
+    }
+    return true;
+}
+
+void Dataset::load(const std::string& filePath, int numClasses)
+{
+    std::shared_ptr<MappedFile> file = MappedFile::open(filePath);
+    
+    DatasetFileHeader header;
+    if (file->size() < sizeof(header))
+    {
+        throw std::runtime_error(filePath + " is too small to be a dataset");
+    }
+    std::memcpy(&header, file->data(), sizeof(header));
+    
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0)
+    {
+        throw std::runtime_error(filePath + " is not a dataset file");
+    }
+    if (header.version != kVersion)
+    {
+        throw std::runtime_error(filePath + " has unsupported dataset version " + std::to_string(header.version));
+    }
+    
+    if (header.pixelFormat > (uint32_t) PixelFormat::BFloat16)
+    {
+        throw std::runtime_error(filePath + " has unknown pixel format " + std::to_string(header.pixelFormat));
+    }
+    
+    // Every size comes from the file, so the arrays are checked against the space left rather than by adding
+    // and multiplying sizes that could wrap around. Counts are read back as int, so they must fit one.
+    size_t fileSize = file->size();
+    size_t rowBytes = (size_t) header.numInputs * pixelSize((PixelFormat) header.pixelFormat);
+    bool valid = header.fileSize == fileSize
+        && header.numSamples <= (uint64_t) std::numeric_limits<int>::max()
+        && header.numInputs <= (uint32_t) std::numeric_limits<int>::max()
+        && header.labelOffset >= sizeof(header)
+        && header.labelOffset % alignof(int32_t) == 0
+        && header.labelOffset <= header.featureOffset
+        && header.featureOffset <= fileSize
+        && header.featureOffset % kArrayAlignment == 0
+        && header.numSamples * sizeof(int32_t) <= header.featureOffset - header.labelOffset
+        && (rowBytes == 0 || header.numSamples <= (fileSize - header.featureOffset) / rowBytes);
+    
+    if (!valid)
+    {
+        throw std::runtime_error(filePath + " is truncated or corrupt");
+    }
+    if (MappedFile::checksum(file->data() + sizeof(header), file->size() - sizeof(header)) != header.checksum)
+    {
+        throw std::runtime_error(filePath + " failed its checksum");
+    }
+    
+    // A matching checksum only means the file is intact, a label is used as an index into the outputs
+    const int32_t* labels = reinterpret_cast<const int32_t*>(file->data() + header.labelOffset);
+    for (uint64_t sample = 0; sample < header.numSamples; sample++)
+    {
+        if (labels[sample] < 0 || labels[sample] >= numClasses)
+        {
+            throw std::runtime_error(filePath + ": label " + std::to_string(labels[sample]) + " of sample " + std::to_string(sample + 1) + " is not one of the " + std::to_string(numClasses) + " classes");
+        }
+    }
+    
+    m_mappedFile = std::move(file);
+    AlignedVector<unsigned char>().swap(m_storage);
+}
+
+void Dataset::save(const std::string& filePath) const
+{
+    DatasetFileHeader fileHeader = header();
+    fileHeader.checksum = MappedFile::checksum(data() + sizeof(fileHeader), fileHeader.fileSize - sizeof(fileHeader));
+    
+    std::ofstream file(filePath, std::ios::out | std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&fileHeader), sizeof(fileHeader));
+    file.write(reinterpret_cast<const char*>(data() + sizeof(fileHeader)), fileHeader.fileSize - sizeof(fileHeader));
+    
+    if (!file)
+    {
+        throw std::runtime_error("Could not write dataset to " + filePath);
+    }
+}
+
+void Dataset::convert(const std::string& csvPath, const std::string& binaryPath, int numInputs, int numClasses, int dataSize, PixelFormat format)
+{
+    ThreadPool threadPool;
+    
+    Dataset dataset;
+    dataset.loadCsv(csvPath, numInputs, numClasses, dataSize, format, &threadPool);
+    dataset.save(binaryPath);
+}
+
+void Dataset::clear()
+{
+    m_mappedFile.reset();
+    m_storage.assign(sizeof(DatasetFileHeader), 0);
+}
+
+const float* Dataset::floatRows(int sample) const
+{
+    if (format() != PixelFormat::Float32)
+    {
+        return nullptr;
+    }
+    return reinterpret_cast<const float*>(features()) + (size_t) sample * numInputs();
+}
+
+float* Dataset::floatRows(int sample)
+{
+    return const_cast<float*>(static_cast<const Dataset*>(this)->floatRows(sample));
+}
+
+void Dataset::copyRows(int sample, int count, float* out) const
+{
+    size_t begin = (size_t) sample * numInputs();
+    size_t size = (size_t) count * numInputs();
+    
+    if (format() == PixelFormat::UInt8)
+    {
+        const uint8_t* pixels = features() + begin;
+        for (size_t i = 0; i < size; i++)
+        {
+            out[i] = pixels[i] * (1.0f / 255.0f);
+        }
+    }
+    else if (format() == PixelFormat::BFloat16)
+    {
+        const bfloat16* values = reinterpret_cast<const bfloat16*>(features()) + begin;
+        for (size_t i = 0; i < size; i++)
+        {
+            out[i] = fromBFloat16(values[i]);
+        }
+    }
+    else
+    {
+        std::memcpy(out, floatRows(sample), size * sizeof(float));
+    }
+}
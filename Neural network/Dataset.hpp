@@ -0,0 +1,101 @@
+//
+//  Dataset.hpp
+//  Neural network
+//
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "AlignedAllocator.hpp"
+#include "BFloat16.hpp"
+#include "MappedFile.hpp"
+#include "ThreadPool.hpp"
+
+enum class PixelFormat : uint32_t
+{
+    Float32, // features stored ready to use
+    UInt8,   // raw 0-255 pixels, normalized to [0, 1] as they are read
+    BFloat16 // normalized features rounded to bfloat16, half the size of Float32
+};
+
+// Binary dataset file, little endian. The in-memory image of a dataset is the file itself,
+// so a loaded dataset is just a mapping:
+//
+//   DatasetFileHeader                     64 bytes
+//   int32 labels[numSamples]              at labelOffset
+//   features[numSamples x numInputs]      at featureOffset, 64 byte aligned, rows back to back
+struct DatasetFileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t pixelFormat;
+    uint32_t numInputs;
+    uint64_t numSamples;
+    uint64_t labelOffset;
+    uint64_t featureOffset;
+    uint64_t fileSize;
+    uint64_t checksum; // of every byte after the header
+    uint8_t reserved[8];
+};
+
+static_assert(sizeof(DatasetFileHeader) == 64, "DatasetFileHeader must stay 64 bytes");
+
+// Labels and features in two contiguous arrays, either owned or memory mapped from a file
+class Dataset
+{
+public:
+    static constexpr uint32_t kVersion = 1;
+    
+    // Parses a CSV with a header line and rows of label,pixel,pixel,... (pixels 0-255), \n or \r\n line endings.
+    // The file is mapped and split into one range of lines per pool worker, parsed straight into place.
+    // Throws std::runtime_error on a missing file or a malformed row: a count of pixels other than numInputs
+    // or a label that is not an integer in [0, numClasses).
+    void loadCsv(const std::string& filePath, int numInputs, int numClasses, int dataSize, PixelFormat format = PixelFormat::Float32, ThreadPool* threadPool = nullptr);
+    
+    // Memory maps a file written by save, throws std::runtime_error if it is not a valid dataset or
+    // has a label outside [0, numClasses)
+    void load(const std::string& filePath, int numClasses);
+    void save(const std::string& filePath) const;
+    
+    // CSV to binary converter, UInt8 keeps the file at a quarter of the Float32 size
+    static void convert(const std::string& csvPath, const std::string& binaryPath, int numInputs, int numClasses, int dataSize, PixelFormat format = PixelFormat::UInt8);
+    
+    void clear();
+    
+    int size() const { return (int) header().numSamples; }
+    int numInputs() const { return (int) header().numInputs; }
+    PixelFormat format() const { return (PixelFormat) header().pixelFormat; }
+    bool empty() const { return size() == 0; }
+    
+    int label(int sample) const { return labels()[sample]; }
+    const int32_t* labels() const { return reinterpret_cast<const int32_t*>(data() + header().labelOffset); }
+    
+    // Float32 feature rows starting at sample, contiguous across samples; nullptr for other formats
+    const float* floatRows(int sample) const;
+    float* floatRows(int sample);
+    
+    // Writes count rows starting at sample to out as normalized floats
+    void copyRows(int sample, int count, float* out) const;
+    
+private:
+    void allocate(int numSamples, int numInputs, PixelFormat format);
+    
+    template <typename Fn>
+    static void forEachLine(const char* begin, const char* end, Fn&& fn);
+    static bool parseRow(const char* line, const char* end, int numInputs, int numClasses, PixelFormat format, int32_t* label, unsigned char* featureData, int row);
+    static bool parseValue(const char*& p, const char* end, float& value);
+    
+    const DatasetFileHeader& header() const { return *reinterpret_cast<const DatasetFileHeader*>(data()); }
+    
+    const unsigned char* data() const { return m_mappedFile ? m_mappedFile->data() : m_storage.data(); }
+    unsigned char* data() { return m_mappedFile ? m_mappedFile->data() : m_storage.data(); }
+    
+    const unsigned char* features() const { return data() + header().featureOffset; }
+    
+private:
+    AlignedVector<unsigned char> m_storage = AlignedVector<unsigned char>(sizeof(DatasetFileHeader), 0);
+    std::shared_ptr<MappedFile> m_mappedFile;
+};
@@ -0,0 +1,1155 @@
+//
+//  Kernels.cpp
+//  Neural network
+//
+
+#include "Kernels.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NN_KERNELS_X86 1
+#endif
+
+// The scalar kernels double as the tails of the SIMD ones. Inlining them there compiles the tails
+// with VEX encoding too, calling legacy SSE code with dirty upper registers stalls on AVX hardware.
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+namespace
+{
+    // Block sizes are picked so one block of each operand fits in L1/L2 for the
+    // 784-100-100-10 topology
+    constexpr int kBlockDepth = 256;  // K slice, keeps the A and B rows of a block in L1
+    constexpr int kBlockCols = 64;    // rows of B reused across a block of A rows (L2)
+    constexpr int kBlockWidth = 256;  // columns of C updated per axpy block
+    constexpr int kBlockRows = 16;    // rows of C kept hot during gemmTN
+    
+    // -- Scalar --
+    
+    ALWAYS_INLINE float dotScalar(const float* a, const float* b, int n)
+    {
+        float sum = 0;
+        for (int i = 0; i < n; i++)
+        {
+            sum += a[i] * b[i];
+        }
+        return sum;
+    }
+    
+    ALWAYS_INLINE void dot4Scalar(const float* a0, const float* a1, const float* a2, const float* a3, const float* b, int n, float* out)
+    {
+        float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+        for (int k = 0; k < n; k++)
+        {
+            float bk = b[k];
+            s0 += a0[k] * bk;
+            s1 += a1[k] * bk;
+            s2 += a2[k] * bk;
+            s3 += a3[k] * bk;
+        }
+        out[0] = s0;
+        out[1] = s1;
+        out[2] = s2;
+        out[3] = s3;
+    }
+    
+    ALWAYS_INLINE void axpyScalar(float alpha, const float* x, float* y, int n)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            y[i] += alpha * x[i];
+        }
+    }
+    
+    ALWAYS_INLINE void momentumUpdateScalar(float* values, float* velocities, float* gradients, int n, float learnRate, float weightDecay, float momentum, bool nesterov)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            float velocity = velocities[i] * momentum - gradients[i] * learnRate;
+            float step = nesterov ? velocity * momentum - gradients[i] * learnRate : velocity;
+            velocities[i] = velocity;
+            values[i] = values[i] * weightDecay + step;
+            gradients[i] = 0;
+        }
+    }
+    
+    ALWAYS_INLINE void adaptiveUpdateScalar(float* values, float* gradients, float* moments, float* squares, int n, const Kernels::AdaptiveUpdate& update)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            float gradient = gradients[i] * update.gradientScale + update.l2 * values[i];
+            float moment = moments[i] * update.beta1 + gradient * (1.0f - update.beta1);
+            float square = squares[i] * update.beta2 + gradient * gradient * (1.0f - update.beta2);
+            moments[i] = moment;
+            squares[i] = square;
+            values[i] = values[i] * update.weightDecay - update.stepSize * moment / (std::sqrt(square) + update.epsilon);
+            gradients[i] = 0;
+        }
+    }
+    
+    ALWAYS_INLINE float sparseDotScalar(const float* values, const uint16_t* columns, int n, const float* x)
+    {
+        float sum = 0;
+        for (int i = 0; i < n; i++)
+        {
+            sum += values[i] * x[columns[i]];
+        }
+        return sum;
+    }
+    
+    // c[N] += values[i] * row columns[i] of B[K x N] for every entry of one compressed sparse row
+    template <typename Index>
+    ALWAYS_INLINE void sparseRowScalar(const float* values, const Index* columns, int n, const float* B, int N, float* c)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            axpyScalar(values[i], B + (size_t) columns[i] * N, c, N);
+        }
+    }
+    
+    ALWAYS_INLINE int32_t dotInt8Scalar(const int8_t* a, const int8_t* b, int n)
+    {
+        int32_t sum = 0;
+        for (int i = 0; i < n; i++)
+        {
+            sum += (int32_t) a[i] * b[i];
+        }
+        return sum;
+    }
+    
+    // bf16 variants read the B operand as bfloat16 and accumulate in float
+    
+    ALWAYS_INLINE float dotBF16Scalar(const float* a, const bfloat16* b, int n)
+    {
+        float sum = 0;
+        for (int i = 0; i < n; i++)
+        {
+            sum += a[i] * fromBFloat16(b[i]);
+        }
+        return sum;
+    }
+    
+    ALWAYS_INLINE void dot4BF16Scalar(const float* a0, const float* a1, const float* a2, const float* a3, const bfloat16* b, int n, float* out)
+    {
+        float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+        for (int k = 0; k < n; k++)
+        {
+            float bk = fromBFloat16(b[k]);
+            s0 += a0[k] * bk;
+            s1 += a1[k] * bk;
+            s2 += a2[k] * bk;
+            s3 += a3[k] * bk;
+        }
+        out[0] = s0;
+        out[1] = s1;
+        out[2] = s2;
+        out[3] = s3;
+    }
+    
+    ALWAYS_INLINE void axpyBF16Scalar(float alpha, const bfloat16* x, float* y, int n)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            y[i] += alpha * fromBFloat16(x[i]);
+        }
+    }
+
+#ifdef NN_KERNELS_X86
+    // -- SSE --
+    
+    __attribute__((target("sse2"))) inline float hsum128(__m128 v)
+    {
+        __m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+        __m128 sums = _mm_add_ps(v, shuf);
+        shuf = _mm_movehl_ps(shuf, sums);
+        sums = _mm_add_ss(sums, shuf);
+        return _mm_cvtss_f32(sums);
+    }
+    
+    __attribute__((target("sse2"))) float dotSSE(const float* a, const float* b, int n)
+    {
+        __m128 acc0 = _mm_setzero_ps();
+        __m128 acc1 = _mm_setzero_ps();
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+        }
+        float sum = hsum128(_mm_add_ps(acc0, acc1));
+        for (; i < n; i++)
+        {
+            sum += a[i] * b[i];
+        }
+        return sum;
+    }
+    
+    __attribute__((target("sse2"))) void dot4SSE(const float* a0, const float* a1, const float* a2, const float* a3, const float* b, int n, float* out)
+    {
+        __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps(), s2 = _mm_setzero_ps(), s3 = _mm_setzero_ps();
+        int k = 0;
+        for (; k + 4 <= n; k += 4)
+        {
+            __m128 bk = _mm_loadu_ps(b + k);
+            s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a0 + k), bk));
+            s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a1 + k), bk));
+            s2 = _mm_add_ps(s2, _mm_mul_ps(_mm_loadu_ps(a2 + k), bk));
+            s3 = _mm_add_ps(s3, _mm_mul_ps(_mm_loadu_ps(a3 + k), bk));
+        }
+        dot4Scalar(a0 + k, a1 + k, a2 + k, a3 + k, b + k, n - k, out);
+        out[0] += hsum128(s0);
+        out[1] += hsum128(s1);
+        out[2] += hsum128(s2);
+        out[3] += hsum128(s3);
+    }
+    
+    __attribute__((target("sse2"))) void axpySSE(float alpha, const float* x, float* y, int n)
+    {
+        __m128 a = _mm_set1_ps(alpha);
+        int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(a, _mm_loadu_ps(x + i))));
+        }
+        axpyScalar(alpha, x + i, y + i, n - i);
+    }
+    
+    // No gather before AVX2, four independent sums at least hide the load latency
+    __attribute__((target("sse2"))) float sparseDotSSE(const float* values, const uint16_t* columns, int n, const float* x)
+    {
+        __m128 acc = _mm_setzero_ps();
+        int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128 gathered = _mm_setr_ps(x[columns[i]], x[columns[i + 1]], x[columns[i + 2]], x[columns[i + 3]]);
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(values + i), gathered));
+        }
+        return hsum128(acc) + sparseDotScalar(values + i, columns + i, n - i, x);
+    }
+    
+    // 16 columns of c stay in registers while every entry of the row is added
+    template <typename Index>
+    __attribute__((target("sse2"))) void sparseRowSSE(const float* values, const Index* columns, int n, const float* B, int N, float* c)
+    {
+        int j = 0;
+        for (; j + 16 <= N; j += 16)
+        {
+            __m128 c0 = _mm_loadu_ps(c + j), c1 = _mm_loadu_ps(c + j + 4), c2 = _mm_loadu_ps(c + j + 8), c3 = _mm_loadu_ps(c + j + 12);
+            for (int i = 0; i < n; i++)
+            {
+                const float* b = B + (size_t) columns[i] * N + j;
+                __m128 value = _mm_set1_ps(values[i]);
+                c0 = _mm_add_ps(c0, _mm_mul_ps(value, _mm_loadu_ps(b)));
+                c1 = _mm_add_ps(c1, _mm_mul_ps(value, _mm_loadu_ps(b + 4)));
+                c2 = _mm_add_ps(c2, _mm_mul_ps(value, _mm_loadu_ps(b + 8)));
+                c3 = _mm_add_ps(c3, _mm_mul_ps(value, _mm_loadu_ps(b + 12)));
+            }
+            _mm_storeu_ps(c + j, c0);
+            _mm_storeu_ps(c + j + 4, c1);
+            _mm_storeu_ps(c + j + 8, c2);
+            _mm_storeu_ps(c + j + 12, c3);
+        }
+        for (int i = 0; j < N && i < n; i++)
+        {
+            axpyScalar(values[i], B + (size_t) columns[i] * N + j, c + j, N - j);
+        }
+    }
+    
+    __attribute__((target("sse2"))) void momentumUpdateSSE(float* values, float* velocities, float* gradients, int n, float learnRate, float weightDecay, float momentum, bool nesterov)
+    {
+        __m128 lr = _mm_set1_ps(learnRate);
+        __m128 decay = _mm_set1_ps(weightDecay);
+        __m128 mom = _mm_set1_ps(momentum);
+        int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128 scaledGradient = _mm_mul_ps(_mm_loadu_ps(gradients + i), lr);
+            __m128 velocity = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(velocities + i), mom), scaledGradient);
+            __m128 step = nesterov ? _mm_sub_ps(_mm_mul_ps(velocity, mom), scaledGradient) : velocity;
+            _mm_storeu_ps(velocities + i, velocity);
+            _mm_storeu_ps(values + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(values + i), decay), step));
+            _mm_storeu_ps(gradients + i, _mm_setzero_ps());
+        }
+        momentumUpdateScalar(values + i, velocities + i, gradients + i, n - i, learnRate, weightDecay, momentum, nesterov);
+    }
+    
+    __attribute__((target("sse2"))) void adaptiveUpdateSSE(float* values, float* gradients, float* moments, float* squares, int n, const Kernels::AdaptiveUpdate& update)
+    {
+        __m128 scale = _mm_set1_ps(update.gradientScale);
+        __m128 l2 = _mm_set1_ps(update.l2);
+        __m128 beta1 = _mm_set1_ps(update.beta1);
+        __m128 beta2 = _mm_set1_ps(update.beta2);
+        __m128 oneMinusBeta1 = _mm_set1_ps(1.0f - update.beta1);
+        __m128 oneMinusBeta2 = _mm_set1_ps(1.0f - update.beta2);
+        __m128 stepSize = _mm_set1_ps(update.stepSize);
+        __m128 epsilon = _mm_set1_ps(update.epsilon);
+        __m128 decay = _mm_set1_ps(update.weightDecay);
+        int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128 value = _mm_loadu_ps(values + i);
+            __m128 gradient = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(gradients + i), scale), _mm_mul_ps(l2, value));
+            __m128 moment = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(moments + i), beta1), _mm_mul_ps(gradient, oneMinusBeta1));
+            __m128 square = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(squares + i), beta2), _mm_mul_ps(_mm_mul_ps(gradient, gradient), oneMinusBeta2));
+            __m128 step = _mm_div_ps(_mm_mul_ps(stepSize, moment), _mm_add_ps(_mm_sqrt_ps(square), epsilon));
+            _mm_storeu_ps(moments + i, moment);
+            _mm_storeu_ps(squares + i, square);
+            _mm_storeu_ps(values + i, _mm_sub_ps(_mm_mul_ps(value, decay), step));
+            _mm_storeu_ps(gradients + i, _mm_setzero_ps());
+        }
+        adaptiveUpdateScalar(values + i, gradients + i, moments + i, squares + i, n - i, update);
+    }
+    
+    // A bfloat16 is the high half of a float, so interleaving zeros below it widens it exactly
+    __attribute__((target("sse2"))) inline __m128 loadBF16SSE(const bfloat16* p)
+    {
+        return _mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), _mm_loadl_epi64((const __m128i*) p)));
+    }
+    
+    __attribute__((target("sse2"))) float dotBF16SSE(const float* a, const bfloat16* b, int n)
+    {
+        __m128 acc0 = _mm_setzero_ps();
+        __m128 acc1 = _mm_setzero_ps();
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), loadBF16SSE(b + i)));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), loadBF16SSE(b + i + 4)));
+        }
+        return hsum128(_mm_add_ps(acc0, acc1)) + dotBF16Scalar(a + i, b + i, n - i);
+    }
+    
+    __attribute__((target("sse2"))) void dot4BF16SSE(const float* a0, const float* a1, const float* a2, const float* a3, const bfloat16* b, int n, float* out)
+    {
+        __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps(), s2 = _mm_setzero_ps(), s3 = _mm_setzero_ps();
+        int k = 0;
+        for (; k + 4 <= n; k += 4)
+        {
+            __m128 bk = loadBF16SSE(b + k);
+            s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a0 + k), bk));
+            s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a1 + k), bk));
+            s2 = _mm_add_ps(s2, _mm_mul_ps(_mm_loadu_ps(a2 + k), bk));
+            s3 = _mm_add_ps(s3, _mm_mul_ps(_mm_loadu_ps(a3 + k), bk));
+        }
+        dot4BF16Scalar(a0 + k, a1 + k, a2 + k, a3 + k, b + k, n - k, out);
+        out[0] += hsum128(s0);
+        out[1] += hsum128(s1);
+        out[2] += hsum128(s2);
+        out[3] += hsum128(s3);
+    }
+    
+    __attribute__((target("sse2"))) void axpyBF16SSE(float alpha, const bfloat16* x, float* y, int n)
+    {
+        __m128 a = _mm_set1_ps(alpha);
+        int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(a, loadBF16SSE(x + i))));
+        }
+        axpyBF16Scalar(alpha, x + i, y + i, n - i);
+    }
+    
+    // SSE2 has no pmovsx, so bytes are sign extended by unpacking with themselves and shifting
+    __attribute__((target("sse2"))) int32_t dotInt8SSE(const int8_t* a, const int8_t* b, int n)
+    {
+        __m128i acc = _mm_setzero_si128();
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i va = _mm_loadu_si128((const __m128i*) (a + i));
+            __m128i vb = _mm_loadu_si128((const __m128i*) (b + i));
+            __m128i aLow = _mm_srai_epi16(_mm_unpacklo_epi8(va, va), 8);
+            __m128i aHigh = _mm_srai_epi16(_mm_unpackhi_epi8(va, va), 8);
+            __m128i bLow = _mm_srai_epi16(_mm_unpacklo_epi8(vb, vb), 8);
+            __m128i bHigh = _mm_srai_epi16(_mm_unpackhi_epi8(vb, vb), 8);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(aLow, bLow));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(aHigh, bHigh));
+        }
+        acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+        acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(acc) + dotInt8Scalar(a + i, b + i, n - i);
+    }
+    
+    // -- AVX2 + FMA --
+    
+    __attribute__((target("avx2,fma"))) inline float hsum256(__m256 v)
+    {
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        __m128 shuf = _mm_movehdup_ps(sum);
+        sum = _mm_add_ps(sum, shuf);
+        shuf = _mm_movehl_ps(shuf, sum);
+        return _mm_cvtss_f32(_mm_add_ss(sum, shuf));
+    }
+    
+    __attribute__((target("avx2,fma"))) float dotAVX2(const float* a, const float* b, int n)
+    {
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+            acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+        }
+        for (; i + 8 <= n; i += 8)
+        {
+            acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        }
+        float sum = hsum256(_mm256_add_ps(acc0, acc1));
+        for (; i < n; i++)
+        {
+            sum += a[i] * b[i];
+        }
+        return sum;
+    }
+    
+    __attribute__((target("avx2,fma"))) void dot4AVX2(const float* a0, const float* a1, const float* a2, const float* a3, const float* b, int n, float* out)
+    {
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps(), s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+        int k = 0;
+        for (; k + 8 <= n; k += 8)
+        {
+            __m256 bk = _mm256_loadu_ps(b + k);
+            s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a0 + k), bk, s0);
+            s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a1 + k), bk, s1);
+            s2 = _mm256_fmadd_ps(_mm256_loadu_ps(a2 + k), bk, s2);
+            s3 = _mm256_fmadd_ps(_mm256_loadu_ps(a3 + k), bk, s3);
+        }
+        dot4Scalar(a0 + k, a1 + k, a2 + k, a3 + k, b + k, n - k, out);
+        out[0] += hsum256(s0);
+        out[1] += hsum256(s1);
+        out[2] += hsum256(s2);
+        out[3] += hsum256(s3);
+    }
+    
+    __attribute__((target("avx2,fma"))) void axpyAVX2(float alpha, const float* x, float* y, int n)
+    {
+        __m256 a = _mm256_set1_ps(alpha);
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+        }
+        axpyScalar(alpha, x + i, y + i, n - i);
+    }
+    
+    __attribute__((target("avx2,fma"))) float sparseDotAVX2(const float* values, const uint16_t* columns, int n, const float* x)
+    {
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m256i index0 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) (columns + i)));
+            __m256i index1 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) (columns + i + 8)));
+            acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(values + i), _mm256_i32gather_ps(x, index0, 4), acc0);
+            acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(values + i + 8), _mm256_i32gather_ps(x, index1, 4), acc1);
+        }
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256i index = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) (columns + i)));
+            acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(values + i), _mm256_i32gather_ps(x, index, 4), acc0);
+        }
+        return hsum256(_mm256_add_ps(acc0, acc1)) + sparseDotScalar(values + i, columns + i, n - i, x);
+    }
+    
+    template <typename Index>
+    __attribute__((target("avx2,fma"))) void sparseRowAVX2(const float* values, const Index* columns, int n, const float* B, int N, float* c)
+    {
+        int j = 0;
+        for (; j + 32 <= N; j += 32)
+        {
+            __m256 c0 = _mm256_loadu_ps(c + j), c1 = _mm256_loadu_ps(c + j + 8), c2 = _mm256_loadu_ps(c + j + 16), c3 = _mm256_loadu_ps(c + j + 24);
+            for (int i = 0; i < n; i++)
+            {
+                const float* b = B + (size_t) columns[i] * N + j;
+                __m256 value = _mm256_set1_ps(values[i]);
+                c0 = _mm256_fmadd_ps(value, _mm256_loadu_ps(b), c0);
+                c1 = _mm256_fmadd_ps(value, _mm256_loadu_ps(b + 8), c1);
+                c2 = _mm256_fmadd_ps(value, _mm256_loadu_ps(b + 16), c2);
+                c3 = _mm256_fmadd_ps(value, _mm256_loadu_ps(b + 24), c3);
+            }
+            _mm256_storeu_ps(c + j, c0);
+            _mm256_storeu_ps(c + j + 8, c1);
+            _mm256_storeu_ps(c + j + 16, c2);
+            _mm256_storeu_ps(c + j + 24, c3);
+        }
+        for (int i = 0; j < N && i < n; i++)
+        {
+            axpyScalar(values[i], B + (size_t) columns[i] * N + j, c + j, N - j);
+        }
+    }
+    
+    __attribute__((target("avx2,fma"))) void momentumUpdateAVX2(float* values, float* velocities, float* gradients, int n, float learnRate, float weightDecay, float momentum, bool nesterov)
+    {
+        __m256 lr = _mm256_set1_ps(learnRate);
+        __m256 decay = _mm256_set1_ps(weightDecay);
+        __m256 mom = _mm256_set1_ps(momentum);
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 gradient = _mm256_loadu_ps(gradients + i);
+            __m256 velocity = _mm256_fnmadd_ps(gradient, lr, _mm256_mul_ps(_mm256_loadu_ps(velocities + i), mom));
+            __m256 step = nesterov ? _mm256_fnmadd_ps(gradient, lr, _mm256_mul_ps(velocity, mom)) : velocity;
+            _mm256_storeu_ps(velocities + i, velocity);
+            _mm256_storeu_ps(values + i, _mm256_fmadd_ps(_mm256_loadu_ps(values + i), decay, step));
+            _mm256_storeu_ps(gradients + i, _mm256_setzero_ps());
+        }
+        momentumUpdateScalar(values + i, velocities + i, gradients + i, n - i, learnRate, weightDecay, momentum, nesterov);
+    }
+    
+    __attribute__((target("avx2,fma"))) void adaptiveUpdateAVX2(float* values, float* gradients, float* moments, float* squares, int n, const Kernels::AdaptiveUpdate& update)
+    {
+        __m256 scale = _mm256_set1_ps(update.gradientScale);
+        __m256 l2 = _mm256_set1_ps(update.l2);
+        __m256 beta1 = _mm256_set1_ps(update.beta1);
+        __m256 beta2 = _mm256_set1_ps(update.beta2);
+        __m256 oneMinusBeta1 = _mm256_set1_ps(1.0f - update.beta1);
+        __m256 oneMinusBeta2 = _mm256_set1_ps(1.0f - update.beta2);
+        __m256 stepSize = _mm256_set1_ps(update.stepSize);
+        __m256 epsilon = _mm256_set1_ps(update.epsilon);
+        __m256 decay = _mm256_set1_ps(update.weightDecay);
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 value = _mm256_loadu_ps(values + i);
+            __m256 gradient = _mm256_fmadd_ps(l2, value, _mm256_mul_ps(_mm256_loadu_ps(gradients + i), scale));
+            __m256 moment = _mm256_fmadd_ps(_mm256_loadu_ps(moments + i), beta1, _mm256_mul_ps(gradient, oneMinusBeta1));
+            __m256 square = _mm256_fmadd_ps(_mm256_loadu_ps(squares + i), beta2, _mm256_mul_ps(_mm256_mul_ps(gradient, gradient), oneMinusBeta2));
+            __m256 step = _mm256_div_ps(_mm256_mul_ps(stepSize, moment), _mm256_add_ps(_mm256_sqrt_ps(square), epsilon));
+            _mm256_storeu_ps(moments + i, moment);
+            _mm256_storeu_ps(squares + i, square);
+            _mm256_storeu_ps(values + i, _mm256_fmsub_ps(value, decay, step));
+            _mm256_storeu_ps(gradients + i, _mm256_setzero_ps());
+        }
+        adaptiveUpdateScalar(values + i, gradients + i, moments + i, squares + i, n - i, update);
+    }
+    
+    __attribute__((target("avx2,fma"))) inline __m256 loadBF16AVX2(const bfloat16* p)
+    {
+        return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) p)), 16));
+    }
+    
+    __attribute__((target("avx2,fma"))) float dotBF16AVX2(const float* a, const bfloat16* b, int n)
+    {
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), loadBF16AVX2(b + i), acc0);
+            acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), loadBF16AVX2(b + i + 8), acc1);
+        }
+        return hsum256(_mm256_add_ps(acc0, acc1)) + dotBF16Scalar(a + i, b + i, n - i);
+    }
+    
+    __attribute__((target("avx2,fma"))) void dot4BF16AVX2(const float* a0, const float* a1, const float* a2, const float* a3, const bfloat16* b, int n, float* out)
+    {
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps(), s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+        int k = 0;
+        for (; k + 8 <= n; k += 8)
+        {
+            __m256 bk = loadBF16AVX2(b + k);
+            s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a0 + k), bk, s0);
+            s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a1 + k), bk, s1);
+            s2 = _mm256_fmadd_ps(_mm256_loadu_ps(a2 + k), bk, s2);
+            s3 = _mm256_fmadd_ps(_mm256_loadu_ps(a3 + k), bk, s3);
+        }
+        dot4BF16Scalar(a0 + k, a1 + k, a2 + k, a3 + k, b + k, n - k, out);
+        out[0] += hsum256(s0);
+        out[1] += hsum256(s1);
+        out[2] += hsum256(s2);
+        out[3] += hsum256(s3);
+    }
+    
+    __attribute__((target("avx2,fma"))) void axpyBF16AVX2(float alpha, const bfloat16* x, float* y, int n)
+    {
+        __m256 a = _mm256_set1_ps(alpha);
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, loadBF16AVX2(x + i), _mm256_loadu_ps(y + i)));
+        }
+        axpyBF16Scalar(alpha, x + i, y + i, n - i);
+    }
+    
+    // maddubs wants unsigned * signed bytes, so the sign of a moves onto b: |a| * (b * sign(a)).
+    // With -128 never used a pair of products stays within int16, madd by 1 then widens to int32.
+    __attribute__((target("avx2,fma"))) int32_t dotInt8AVX2(const int8_t* a, const int8_t* b, int n)
+    {
+        const __m256i ones = _mm256_set1_epi16(1);
+        __m256i acc0 = _mm256_setzero_si256();
+        __m256i acc1 = _mm256_setzero_si256();
+        int i = 0;
+        for (; i + 64 <= n; i += 64)
+        {
+            __m256i a0 = _mm256_loadu_si256((const __m256i*) (a + i));
+            __m256i a1 = _mm256_loadu_si256((const __m256i*) (a + i + 32));
+            __m256i p0 = _mm256_maddubs_epi16(_mm256_sign_epi8(a0, a0), _mm256_sign_epi8(_mm256_loadu_si256((const __m256i*) (b + i)), a0));
+            __m256i p1 = _mm256_maddubs_epi16(_mm256_sign_epi8(a1, a1), _mm256_sign_epi8(_mm256_loadu_si256((const __m256i*) (b + i + 32)), a1));
+            acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(p0, ones));
+            acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(p1, ones));
+        }
+        for (; i + 32 <= n; i += 32)
+        {
+            __m256i a0 = _mm256_loadu_si256((const __m256i*) (a + i));
+            __m256i p0 = _mm256_maddubs_epi16(_mm256_sign_epi8(a0, a0), _mm256_sign_epi8(_mm256_loadu_si256((const __m256i*) (b + i)), a0));
+            acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(p0, ones));
+        }
+        __m256i acc = _mm256_add_epi32(acc0, acc1);
+        __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(sum) + dotInt8Scalar(a + i, b + i, n - i);
+    }
+    
+    // -- AVX-512 --
+    
+    __attribute__((target("avx512f"))) inline __mmask16 tailMask(int remaining)
+    {
+        return (__mmask16) ((1u << remaining) - 1);
+    }
+    
+    __attribute__((target("avx512f"))) float dotAVX512(const float* a, const float* b, int n)
+    {
+        __m512 acc0 = _mm512_setzero_ps();
+        __m512 acc1 = _mm512_setzero_ps();
+        int i = 0;
+        for (; i + 32 <= n; i += 32)
+        {
+            acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+            acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+        }
+        for (; i + 16 <= n; i += 16)
+        {
+            acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        }
+        if (i < n)
+        {
+            __mmask16 mask = tailMask(n - i);
+            acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), acc1);
+        }
+        return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+    }
+    
+    __attribute__((target("avx512f"))) void dot4AVX512(const float* a0, const float* a1, const float* a2, const float* a3, const float* b, int n, float* out)
+    {
+        __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps(), s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+        for (int k = 0; k < n; k += 16)
+        {
+            __mmask16 mask = (n - k >= 16) ? (__mmask16) 0xFFFF : tailMask(n - k);
+            __m512 bk = _mm512_maskz_loadu_ps(mask, b + k);
+            s0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a0 + k), bk, s0);
+            s1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a1 + k), bk, s1);
+            s2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a2 + k), bk, s2);
+            s3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a3 + k), bk, s3);
+        }
+        out[0] = _mm512_reduce_add_ps(s0);
+        out[1] = _mm512_reduce_add_ps(s1);
+        out[2] = _mm512_reduce_add_ps(s2);
+        out[3] = _mm512_reduce_add_ps(s3);
+    }
+    
+    __attribute__((target("avx512f"))) void axpyAVX512(float alpha, const float* x, float* y, int n)
+    {
+        __m512 a = _mm512_set1_ps(alpha);
+        for (int i = 0; i < n; i += 16)
+        {
+            __mmask16 mask = (n - i >= 16) ? (__mmask16) 0xFFFF : tailMask(n - i);
+            __m512 result = _mm512_fmadd_ps(a, _mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i));
+            _mm512_mask_storeu_ps(y + i, mask, result);
+        }
+    }
+    
+    __attribute__((target("avx512f"))) float sparseDotAVX512(const float* values, const uint16_t* columns, int n, const float* x)
+    {
+        // Masked 16 bit loads need AVX-512BW, the tail is scalar instead
+        __m512 acc = _mm512_setzero_ps();
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m512i index = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*) (columns + i)));
+            acc = _mm512_fmadd_ps(_mm512_loadu_ps(values + i), _mm512_i32gather_ps(index, x, 4), acc);
+        }
+        return _mm512_reduce_add_ps(acc) + sparseDotScalar(values + i, columns + i, n - i, x);
+    }
+    
+    __attribute__((target("avx512f"))) inline __mmask16 blockMask(int remaining)
+    {
+        return remaining >= 16 ? (__mmask16) 0xFFFF : remaining <= 0 ? (__mmask16) 0 : tailMask(remaining);
+    }
+    
+    template <typename Index>
+    __attribute__((target("avx512f"))) void sparseRowAVX512(const float* values, const Index* columns, int n, const float* B, int N, float* c)
+    {
+        for (int j = 0; j < N; j += 64)
+        {
+            __mmask16 m0 = blockMask(N - j), m1 = blockMask(N - j - 16), m2 = blockMask(N - j - 32), m3 = blockMask(N - j - 48);
+            __m512 c0 = _mm512_maskz_loadu_ps(m0, c + j);
+            __m512 c1 = _mm512_maskz_loadu_ps(m1, c + j + 16);
+            __m512 c2 = _mm512_maskz_loadu_ps(m2, c + j + 32);
+            __m512 c3 = _mm512_maskz_loadu_ps(m3, c + j + 48);
+            for (int i = 0; i < n; i++)
+            {
+                const float* b = B + (size_t) columns[i] * N + j;
+                __m512 value = _mm512_set1_ps(values[i]);
+                c0 = _mm512_fmadd_ps(value, _mm512_maskz_loadu_ps(m0, b), c0);
+                c1 = _mm512_fmadd_ps(value, _mm512_maskz_loadu_ps(m1, b + 16), c1);
+                c2 = _mm512_fmadd_ps(value, _mm512_maskz_loadu_ps(m2, b + 32), c2);
+                c3 = _mm512_fmadd_ps(value, _mm512_maskz_loadu_ps(m3, b + 48), c3);
+            }
+            _mm512_mask_storeu_ps(c + j, m0, c0);
+            _mm512_mask_storeu_ps(c + j + 16, m1, c1);
+            _mm512_mask_storeu_ps(c + j + 32, m2, c2);
+            _mm512_mask_storeu_ps(c + j + 48, m3, c3);
+        }
+    }
+    
+    __attribute__((target("avx512f"))) void momentumUpdateAVX512(float* values, float* velocities, float* gradients, int n, float learnRate, float weightDecay, float momentum, bool nesterov)
+    {
+        __m512 lr = _mm512_set1_ps(learnRate);
+        __m512 decay = _mm512_set1_ps(weightDecay);
+        __m512 mom = _mm512_set1_ps(momentum);
+        for (int i = 0; i < n; i += 16)
+        {
+            __mmask16 mask = (n - i >= 16) ? (__mmask16) 0xFFFF : tailMask(n - i);
+            __m512 gradient = _mm512_maskz_loadu_ps(mask, gradients + i);
+            __m512 velocity = _mm512_fnmadd_ps(gradient, lr, _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, velocities + i), mom));
+            __m512 step = nesterov ? _mm512_fnmadd_ps(gradient, lr, _mm512_mul_ps(velocity, mom)) : velocity;
+            _mm512_mask_storeu_ps(velocities + i, mask, velocity);
+            _mm512_mask_storeu_ps(values + i, mask, _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, values + i), decay, step));
+            _mm512_mask_storeu_ps(gradients + i, mask, _mm512_setzero_ps());
+        }
+    }
+    
+    __attribute__((target("avx512f"))) void adaptiveUpdateAVX512(float* values, float* gradients, float* moments, float* squares, int n, const Kernels::AdaptiveUpdate& update)
+    {
+        __m512 scale = _mm512_set1_ps(update.gradientScale);
+        __m512 l2 = _mm512_set1_ps(update.l2);
+        __m512 beta1 = _mm512_set1_ps(update.beta1);
+        __m512 beta2 = _mm512_set1_ps(update.beta2);
+        __m512 oneMinusBeta1 = _mm512_set1_ps(1.0f - update.beta1);
+        __m512 oneMinusBeta2 = _mm512_set1_ps(1.0f - update.beta2);
+        __m512 stepSize = _mm512_set1_ps(update.stepSize);
+        __m512 epsilon = _mm512_set1_ps(update.epsilon);
+        __m512 decay = _mm512_set1_ps(update.weightDecay);
+        for (int i = 0; i < n; i += 16)
+        {
+            __mmask16 mask = (n - i >= 16) ? (__mmask16) 0xFFFF : tailMask(n - i);
+            __m512 value = _mm512_maskz_loadu_ps(mask, values + i);
+            __m512 gradient = _mm512_fmadd_ps(l2, value, _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, gradients + i), scale));
+            __m512 moment = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, moments + i), beta1, _mm512_mul_ps(gradient, oneMinusBeta1));
+            __m512 square = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, squares + i), beta2, _mm512_mul_ps(_mm512_mul_ps(gradient, gradient), oneMinusBeta2));
+            __m512 step = _mm512_div_ps(_mm512_mul_ps(stepSize, moment), _mm512_add_ps(_mm512_sqrt_ps(square), epsilon));
+            _mm512_mask_storeu_ps(moments + i, mask, moment);
+            _mm512_mask_storeu_ps(squares + i, mask, square);
+            _mm512_mask_storeu_ps(values + i, mask, _mm512_fmsub_ps(value, decay, step));
+            _mm512_mask_storeu_ps(gradients + i, mask, _mm512_setzero_ps());
+        }
+    }
+    
+    __attribute__((target("avx512f"))) inline __m512 loadBF16AVX512(const bfloat16* p)
+    {
+        return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*) p)), 16));
+    }
+    
+    __attribute__((target("avx512f"))) float dotBF16AVX512(const float* a, const bfloat16* b, int n)
+    {
+        __m512 acc0 = _mm512_setzero_ps();
+        __m512 acc1 = _mm512_setzero_ps();
+        int i = 0;
+        for (; i + 32 <= n; i += 32)
+        {
+            acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), loadBF16AVX512(b + i), acc0);
+            acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), loadBF16AVX512(b + i + 16), acc1);
+        }
+        for (; i + 16 <= n; i += 16)
+        {
+            acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), loadBF16AVX512(b + i), acc0);
+        }
+        return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1)) + dotBF16Scalar(a + i, b + i, n - i);
+    }
+    
+    __attribute__((target("avx512f"))) void dot4BF16AVX512(const float* a0, const float* a1, const float* a2, const float* a3, const bfloat16* b, int n, float* out)
+    {
+        __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps(), s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+        int k = 0;
+        for (; k + 16 <= n; k += 16)
+        {
+            __m512 bk = loadBF16AVX512(b + k);
+            s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a0 + k), bk, s0);
+            s1 = _mm512_fmadd_ps(_mm512_loadu_ps(a1 + k), bk, s1);
+            s2 = _mm512_fmadd_ps(_mm512_loadu_ps(a2 + k), bk, s2);
+            s3 = _mm512_fmadd_ps(_mm512_loadu_ps(a3 + k), bk, s3);
+        }
+        dot4BF16Scalar(a0 + k, a1 + k, a2 + k, a3 + k, b + k, n - k, out);
+        out[0] += _mm512_reduce_add_ps(s0);
+        out[1] += _mm512_reduce_add_ps(s1);
+        out[2] += _mm512_reduce_add_ps(s2);
+        out[3] += _mm512_reduce_add_ps(s3);
+    }
+    
+    __attribute__((target("avx512f"))) void axpyBF16AVX512(float alpha, const bfloat16* x, float* y, int n)
+    {
+        __m512 a = _mm512_set1_ps(alpha);
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            _mm512_storeu_ps(y + i, _mm512_fmadd_ps(a, loadBF16AVX512(x + i), _mm512_loadu_ps(y + i)));
+        }
+        axpyBF16Scalar(alpha, x + i, y + i, n - i);
+    }
+    
+    __attribute__((target("avx512f,avx512bw"))) int32_t dotInt8AVX512(const int8_t* a, const int8_t* b, int n)
+    {
+        __m512i acc0 = _mm512_setzero_si512();
+        __m512i acc1 = _mm512_setzero_si512();
+        int i = 0;
+        for (; i + 64 <= n; i += 64)
+        {
+            acc0 = _mm512_add_epi32(acc0, _mm512_madd_epi16(_mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*) (a + i))), _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*) (b + i)))));
+            acc1 = _mm512_add_epi32(acc1, _mm512_madd_epi16(_mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*) (a + i + 32))), _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*) (b + i + 32)))));
+        }
+        for (; i + 32 <= n; i += 32)
+        {
+            acc0 = _mm512_add_epi32(acc0, _mm512_madd_epi16(_mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*) (a + i))), _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*) (b + i)))));
+        }
+        return _mm512_reduce_add_epi32(_mm512_add_epi32(acc0, acc1)) + dotInt8Scalar(a + i, b + i, n - i);
+    }
+    
+    // Same sign trick as AVX2, vpdpbusd then does the u8 * s8 products and the int32 sums in one instruction
+    __attribute__((target("avx512f,avx512bw,avx512vnni"))) int32_t dotInt8VNNI(const int8_t* a, const int8_t* b, int n)
+    {
+        const __m512i zero = _mm512_setzero_si512();
+        __m512i acc0 = _mm512_setzero_si512();
+        __m512i acc1 = _mm512_setzero_si512();
+        int i = 0;
+        for (; i + 128 <= n; i += 128)
+        {
+            __m512i a0 = _mm512_loadu_si512(a + i);
+            __m512i a1 = _mm512_loadu_si512(a + i + 64);
+            __m512i b0 = _mm512_loadu_si512(b + i);
+            __m512i b1 = _mm512_loadu_si512(b + i + 64);
+            acc0 = _mm512_dpbusd_epi32(acc0, _mm512_abs_epi8(a0), _mm512_mask_sub_epi8(b0, _mm512_movepi8_mask(a0), zero, b0));
+            acc1 = _mm512_dpbusd_epi32(acc1, _mm512_abs_epi8(a1), _mm512_mask_sub_epi8(b1, _mm512_movepi8_mask(a1), zero, b1));
+        }
+        for (; i + 64 <= n; i += 64)
+        {
+            __m512i a0 = _mm512_loadu_si512(a + i);
+            __m512i b0 = _mm512_loadu_si512(b + i);
+            acc0 = _mm512_dpbusd_epi32(acc0, _mm512_abs_epi8(a0), _mm512_mask_sub_epi8(b0, _mm512_movepi8_mask(a0), zero, b0));
+        }
+        return _mm512_reduce_add_epi32(_mm512_add_epi32(acc0, acc1)) + dotInt8Scalar(a + i, b + i, n - i);
+    }
+#endif
+    
+    struct KernelTable
+    {
+        const char* name;
+        float (*dot)(const float*, const float*, int);
+        void (*dot4)(const float*, const float*, const float*, const float*, const float*, int, float*);
+        void (*axpy)(float, const float*, float*, int);
+        void (*momentumUpdate)(float*, float*, float*, int, float, float, float, bool);
+        void (*adaptiveUpdate)(float*, float*, float*, float*, int, const Kernels::AdaptiveUpdate&);
+        int32_t (*dotInt8)(const int8_t*, const int8_t*, int);
+        float (*sparseDot)(const float*, const uint16_t*, int, const float*);
+        void (*sparseRow)(const float*, const int*, int, const float*, int, float*);
+        void (*sparseRow16)(const float*, const uint16_t*, int, const float*, int, float*);
+        float (*dotBF16)(const float*, const bfloat16*, int);
+        void (*dot4BF16)(const float*, const float*, const float*, const float*, const bfloat16*, int, float*);
+        void (*axpyBF16)(float, const bfloat16*, float*, int);
+    };
+    
+    // Picks the widest instruction set the CPU supports. NN_KERNELS=scalar|sse|avx2|avx512
+    // caps the choice, which is useful for comparing kernels on one machine.
+    KernelTable selectKernels()
+    {
+        KernelTable table = { "scalar", dotScalar, dot4Scalar, axpyScalar, momentumUpdateScalar, adaptiveUpdateScalar, dotInt8Scalar, sparseDotScalar, sparseRowScalar<int>, sparseRowScalar<uint16_t>, dotBF16Scalar, dot4BF16Scalar, axpyBF16Scalar };
+
+#ifdef NN_KERNELS_X86
+        const char* env = std::getenv("NN_KERNELS");
+        std::string limit = env ? env : "avx512";
+        
+        __builtin_cpu_init();
+        
+        if (limit == "scalar")
+        {
+            return table;
+        }
+        
+        if (__builtin_cpu_supports("sse2"))
+        {
+            table = { "sse", dotSSE, dot4SSE, axpySSE, momentumUpdateSSE, adaptiveUpdateSSE, dotInt8SSE, sparseDotSSE, sparseRowSSE<int>, sparseRowSSE<uint16_t>, dotBF16SSE, dot4BF16SSE, axpyBF16SSE };
+        }
+        
+        if (limit != "sse" && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        {
+            table = { "avx2", dotAVX2, dot4AVX2, axpyAVX2, momentumUpdateAVX2, adaptiveUpdateAVX2, dotInt8AVX2, sparseDotAVX2, sparseRowAVX2<int>, sparseRowAVX2<uint16_t>, dotBF16AVX2, dot4BF16AVX2, axpyBF16AVX2 };
+        }
+        
+        if (limit == "avx512" && __builtin_cpu_supports("avx512f"))
+        {
+            table = { "avx512", dotAVX512, dot4AVX512, axpyAVX512, momentumUpdateAVX512, adaptiveUpdateAVX512, table.dotInt8, sparseDotAVX512, sparseRowAVX512<int>, sparseRowAVX512<uint16_t>, dotBF16AVX512, dot4BF16AVX512, axpyBF16AVX512 };
+            
+            // the int8 kernels need byte and word instructions on top of the float ones
+            if (__builtin_cpu_supports("avx512bw"))
+            {
+                table.dotInt8 = __builtin_cpu_supports("avx512vnni") ? dotInt8VNNI : dotInt8AVX512;
+            }
+        }
+#endif
+        
+        return table;
+    }
+    
+    const KernelTable& kernels()
+    {
+        static const KernelTable table = selectKernels();
+        return table;
+    }
+    
+    // The gemm loops are shared between float and bfloat16 B operands, these pick the row kernel
+    inline float dotRow(const KernelTable& table, const float* a, const float* b, int n) { return table.dot(a, b, n); }
+    inline float dotRow(const KernelTable& table, const float* a, const bfloat16* b, int n) { return table.dotBF16(a, b, n); }
+    
+    inline void dot4Row(const KernelTable& table, const float* a0, const float* a1, const float* a2, const float* a3, const float* b, int n, float* out) { table.dot4(a0, a1, a2, a3, b, n, out); }
+    inline void dot4Row(const KernelTable& table, const float* a0, const float* a1, const float* a2, const float* a3, const bfloat16* b, int n, float* out) { table.dot4BF16(a0, a1, a2, a3, b, n, out); }
+    
+    inline void axpyRow(const KernelTable& table, float alpha, const float* x, float* y, int n) { table.axpy(alpha, x, y, n); }
+    inline void axpyRow(const KernelTable& table, float alpha, const bfloat16* x, float* y, int n) { table.axpyBF16(alpha, x, y, n); }
+    
+    template <typename BType>
+    void gemmNTImpl(int M, int N, int K, const float* A, const BType* B, float* C, bool accumulate)
+    {
+        const KernelTable& table = kernels();
+        
+        if (!accumulate)
+        {
+            std::fill(C, C + (size_t) M * N, 0.0f);
+        }
+        
+        for (int k0 = 0; k0 < K; k0 += kBlockDepth)
+        {
+            int kc = std::min(kBlockDepth, K - k0);
+            
+            for (int j0 = 0; j0 < N; j0 += kBlockCols)
+            {
+                int j1 = std::min(j0 + kBlockCols, N);
+                
+                int i = 0;
+                // 4 rows of A share every row of B that is streamed in
+                for (; i + 4 <= M; i += 4)
+                {
+                    const float* a0 = A + (size_t) (i + 0) * K + k0;
+                    const float* a1 = A + (size_t) (i + 1) * K + k0;
+                    const float* a2 = A + (size_t) (i + 2) * K + k0;
+                    const float* a3 = A + (size_t) (i + 3) * K + k0;
+                    
+                    for (int j = j0; j < j1; j++)
+                    {
+                        float sums[4];
+                        dot4Row(table, a0, a1, a2, a3, B + (size_t) j * K + k0, kc, sums);
+                        C[(size_t) (i + 0) * N + j] += sums[0];
+                        C[(size_t) (i + 1) * N + j] += sums[1];
+                        C[(size_t) (i + 2) * N + j] += sums[2];
+                        C[(size_t) (i + 3) * N + j] += sums[3];
+                    }
+                }
+                
+                for (; i < M; i++)
+                {
+                    const float* a = A + (size_t) i * K + k0;
+                    for (int j = j0; j < j1; j++)
+                    {
+                        C[(size_t) i * N + j] += dotRow(table, a, B + (size_t) j * K + k0, kc);
+                    }
+                }
+            }
+        }
+    }
+    
+    template <typename BType>
+    void gemmNNImpl(int M, int N, int K, const float* A, const BType* B, float* C, bool accumulate)
+    {
+        const KernelTable& table = kernels();
+        
+        if (!accumulate)
+        {
+            std::fill(C, C + (size_t) M * N, 0.0f);
+        }
+        
+        for (int k0 = 0; k0 < K; k0 += kBlockDepth)
+        {
+            int k1 = std::min(k0 + kBlockDepth, K);
+            
+            for (int n0 = 0; n0 < N; n0 += kBlockWidth)
+            {
+                int nc = std::min(kBlockWidth, N - n0);
+                
+                for (int i = 0; i < M; i++)
+                {
+                    float* c = C + (size_t) i * N + n0;
+                    for (int k = k0; k < k1; k++)
+                    {
+                        axpyRow(table, A[(size_t) i * K + k], B + (size_t) k * N + n0, c, nc);
+                    }
+                }
+            }
+        }
+    }
+}
+
+const char* Kernels::isaName()
+{
+    return kernels().name;
+}
+
+float Kernels::dot(const float* a, const float* b, int n)
+{
+    return kernels().dot(a, b, n);
+}
+
+void Kernels::axpy(float alpha, const float* x, float* y, int n)
+{
+    kernels().axpy(alpha, x, y, n);
+}
+
+void Kernels::momentumUpdate(float* values, float* velocities, float* gradients, int n, float learnRate, float weightDecay, float momentum, bool nesterov)
+{
+    kernels().momentumUpdate(values, velocities, gradients, n, learnRate, weightDecay, momentum, nesterov);
+}
+
+void Kernels::adaptiveUpdate(float* values, float* gradients, float* moments, float* squares, int n, const AdaptiveUpdate& update)
+{
+    kernels().adaptiveUpdate(values, gradients, moments, squares, n, update);
+}
+
+float Kernels::sparseDot(const float* values, const uint16_t* columns, int n, const float* x)
+{
+    return kernels().sparseDot(values, columns, n, x);
+}
+
+int32_t Kernels::dotInt8(const int8_t* a, const int8_t* b, int n)
+{
+    return kernels().dotInt8(a, b, n);
+}
+
+void Kernels::gemmNT(int M, int N, int K, const float* A, const float* B, float* C, bool accumulate)
+{
+    gemmNTImpl(M, N, K, A, B, C, accumulate);
+}
+
+void Kernels::gemmNT(int M, int N, int K, const float* A, const bfloat16* B, float* C, bool accumulate)
+{
+    gemmNTImpl(M, N, K, A, B, C, accumulate);
+}
+
+void Kernels::gemmNN(int M, int N, int K, const float* A, const float* B, float* C, bool accumulate)
+{
+    gemmNNImpl(M, N, K, A, B, C, accumulate);
+}
+
+void Kernels::gemmNN(int M, int N, int K, const float* A, const bfloat16* B, float* C, bool accumulate)
+{
+    gemmNNImpl(M, N, K, A, B, C, accumulate);
+}
+
+void Kernels::gemmTN(int M, int N, int K, const float* A, int lda, const float* B, float* C, bool accumulate)
+{
+    const KernelTable& table = kernels();
+    
+    if (!accumulate)
+    {
+        std::fill(C, C + (size_t) M * N, 0.0f);
+    }
+    
+    for (int m0 = 0; m0 < M; m0 += kBlockRows)
+    {
+        int m1 = std::min(m0 + kBlockRows, M);
+        
+        for (int n0 = 0; n0 < N; n0 += kBlockWidth)
+        {
+            int nc = std::min(kBlockWidth, N - n0);
+            
+            for (int k0 = 0; k0 < K; k0 += kBlockDepth)
+            {
+                int k1 = std::min(k0 + kBlockDepth, K);
+                
+                for (int m = m0; m < m1; m++)
+                {
+                    float* c = C + (size_t) m * N + n0;
+                    for (int k = k0; k < k1; k++)
+                    {
+                        table.axpy(A[(size_t) k * lda + m], B + (size_t) k * N + n0, c, nc);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void Kernels::sparseGemmNN(int M, int N, const int* rowOffsets, const int* columns, const float* values, const float* B, float* C)
+{
+    const KernelTable& table = kernels();
+    
+    // Every nonzero adds one row of B to C's row, which the kernel keeps in registers
+    for (int m = 0; m < M; m++)
+    {
+        table.sparseRow(values + rowOffsets[m], columns + rowOffsets[m], rowOffsets[m + 1] - rowOffsets[m], B, N, C + (size_t) m * N);
+    }
+}
+
+void Kernels::sparseGemmNN(int M, int N, const int* rowOffsets, const uint16_t* columns, const float* values, const float* B, float* C)
+{
+    const KernelTable& table = kernels();
+    
+    for (int m = 0; m < M; m++)
+    {
+        table.sparseRow16(values + rowOffsets[m], columns + rowOffsets[m], rowOffsets[m + 1] - rowOffsets[m], B, N, C + (size_t) m * N);
+    }
+}
+
+void Kernels::sparseGemmTN(int M, int N, const int* rowOffsets, const int* columns, const float* values, const float* B, float* C)
+{
+    const KernelTable& table = kernels();
+    
+    for (int m = 0; m < M; m++)
+    {
+        const float* b = B + (size_t) m * N;
+        for (int i = rowOffsets[m]; i < rowOffsets[m + 1]; i++)
+        {
+            table.axpy(values[i], b, C + (size_t) columns[i] * N, N);
+        }
+    }
+}
+
+void Kernels::toBFloat16(const float* x, bfloat16* y, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        y[i] = ::toBFloat16(x[i]);
+    }
+}
+
+void Kernels::sumRows(int M, int N, const float* A, int lda, float* out)
+{
+    const KernelTable& table = kernels();
+    
+    for (int i = 0; i < M; i++)
+    {
+        table.axpy(1.0f, A + (size_t) i * lda, out, N);
+    }
+}
+
+void Kernels::broadcastRows(int M, int N, const float* row, float* C)
+{
+    for (int i = 0; i < M; i++)
+    {
+        std::memcpy(C + (size_t) i * N, row, N * sizeof(float));
+    }
+}
@@ -0,0 +1,87 @@
+//
+//  Kernels.hpp
+//  Neural network
+//
+
+#pragma once
+
+#include <cstdint>
+
+#include "BFloat16.hpp"
+
+// Row-major, cache-blocked matrix kernels used by the batched Layer path.
+// Naming follows BLAS: N = operand used as stored, T = operand used transposed.
+// The vector primitives are SSE/AVX2/AVX-512 on x86, picked once at startup from
+// CPUID, with a scalar fallback everywhere else.
+class Kernels
+{
+public:
+    // Constants of one Adam, AdamW or RMSProp step, see OptimizerStep. Per element:
+    //   g = gradient * gradientScale + l2 * value
+    //   moment = beta1 * moment + (1 - beta1) * g
+    //   square = beta2 * square + (1 - beta2) * g * g
+    //   value = value * weightDecay - stepSize * moment / (sqrt(square) + epsilon)
+    struct AdaptiveUpdate
+    {
+        float gradientScale = 1;
+        float l2 = 0;
+        float beta1 = 0;
+        float beta2 = 0;
+        float stepSize = 0;
+        float epsilon = 0;
+        float weightDecay = 1;
+    };
+    
+    // name of the instruction set the dispatcher picked
+    static const char* isaName();
+    
+    static float dot(const float* a, const float* b, int n);
+    
+    // sum of values[n] * x[columns[n]], a row of a compressed sparse matrix times a dense vector
+    static float sparseDot(const float* values, const uint16_t* columns, int n, const float* x);
+    
+    // exact int32 sum of a[n] * b[n], used by quantized inference
+    static int32_t dotInt8(const int8_t* a, const int8_t* b, int n);
+    
+    // y[n] += alpha * x[n]
+    static void axpy(float alpha, const float* x, float* y, int n);
+    
+    // momentum SGD step, also clears the gradients. Nesterov moves the values by the look-ahead
+    // momentum * velocity - learnRate * gradient instead of the new velocity.
+    static void momentumUpdate(float* values, float* velocities, float* gradients, int n, float learnRate, float weightDecay, float momentum, bool nesterov = false);
+    
+    // Adam, AdamW or RMSProp step over values, gradients and their two state buffers, also clears the gradients
+    static void adaptiveUpdate(float* values, float* gradients, float* moments, float* squares, int n, const AdaptiveUpdate& update);
+    
+    // C[M x N] (+)= A[M x K] * B[N x K]^T
+    static void gemmNT(int M, int N, int K, const float* A, const float* B, float* C, bool accumulate = false);
+    
+    // C[M x N] (+)= A[M x K] * B[K x N]
+    static void gemmNN(int M, int N, int K, const float* A, const float* B, float* C, bool accumulate = false);
+    
+    // bfloat16 B operands for the mixed precision path, still accumulated in float
+    static void gemmNT(int M, int N, int K, const float* A, const bfloat16* B, float* C, bool accumulate = false);
+    static void gemmNN(int M, int N, int K, const float* A, const bfloat16* B, float* C, bool accumulate = false);
+    
+    // C[M x N] (+)= A[K x M]^T * B[K x N], rows of A are lda apart so C can be a row block
+    static void gemmTN(int M, int N, int K, const float* A, int lda, const float* B, float* C, bool accumulate = false);
+    
+    // C[M x N] += A[M x K] * B[K x N] with A in compressed sparse rows: row m's nonzero values and their
+    // columns are entries [rowOffsets[m], rowOffsets[m + 1]) of values and columns. Zeros of A cost nothing.
+    static void sparseGemmNN(int M, int N, const int* rowOffsets, const int* columns, const float* values, const float* B, float* C);
+    
+    // Same with 16 bit columns, the compact form pruned layers are stored in
+    static void sparseGemmNN(int M, int N, const int* rowOffsets, const uint16_t* columns, const float* values, const float* B, float* C);
+    
+    // C[K x N] += A[M x K]^T * B[M x N] with A in compressed sparse rows as above
+    static void sparseGemmTN(int M, int N, const int* rowOffsets, const int* columns, const float* values, const float* B, float* C);
+    
+    // out[N] += column sums of A[M x N], rows of A are lda apart
+    static void sumRows(int M, int N, const float* A, int lda, float* out);
+    
+    // y[n] = x[n] rounded to bfloat16
+    static void toBFloat16(const float* x, bfloat16* y, int n);
+    
+    // every row of C[M x N] = row[N]
+    static void broadcastRows(int M, int N, const float* row, float* C);
+};
@@ -6,136 +6,539 @@
 //
 
 #include "Layer.hpp"
+#include "Kernels.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <numeric>
 #include <random>
-#include <mutex>
-#include <thread>
+#include <stdexcept>
+#include <string>
 
 Layer::Layer(int numNodesIn, int numNodesOut)
-: m_weights(numNodesIn * numNodesOut), m_biases(numNodesOut), m_weightGradients(m_weights.size()), m_biasGradients(m_biases.size()), m_weightVelocities(m_weights.size(), 0), m_biasVelocities(m_biases.size(), 0)
+: m_parameters(numNodesIn * numNodesOut + numNodesOut), m_gradients(m_parameters.size(), 0)
 {
     m_numNodesIn = numNodesIn;
     m_numNodesOut = numNodesOut;
+    
+    setOptimizer(OptimizerType::Momentum);
 }
 
-std::vector<float> Layer::CalculateOutputs(std::vector<float> inputs, ActivationType activationType)
-{    
-    std::vector<float> outputs(m_numNodesOut);
+void Layer::setOptimizer(OptimizerType type)
+{
+    m_stateStride = roundToCacheLine<float>(numParameters());
+    m_optimizerState.assign(OptimizerSettings::numStateBuffers(type) * m_stateStride, 0.0f);
+}
 
-    for (int nodeOut = 0; nodeOut < m_numNodesOut; nodeOut++)
+void Layer::aliasParameters(std::shared_ptr<MappedFile> file, float* parameters)
+{
+    m_mappedFile = std::move(file);
+    m_mappedParameters = parameters;
+    
+    // the owned copy is no longer needed
+    AlignedVector<float>().swap(m_parameters);
+    AlignedVector<float>().swap(m_weightMask);
+    
+    updateWeightCopies();
+}
+
+void Layer::setMixedPrecision(bool enabled)
+{
+    if (enabled)
+    {
+        m_weightsBF16.resize((size_t) m_numNodesIn * m_numNodesOut);
+        updateWeightCopies();
+    }
+    else
     {
-        float weightedInput = 0;
+        AlignedVector<bfloat16>().swap(m_weightsBF16);
+    }
+}
 
-        for (int nodeIn = 0; nodeIn < m_numNodesIn; nodeIn++)
+void Layer::setSparseInputs(bool enabled)
+{
+    if (enabled)
+    {
+        m_weightsTransposed.resize((size_t) m_numNodesIn * m_numNodesOut);
+        updateWeightCopies();
+    }
+    else
+    {
+        AlignedVector<float>().swap(m_weightsTransposed);
+    }
+}
+
+void Layer::prune(float sparsity)
+{
+    int numWeights = m_numNodesIn * m_numNodesOut;
+    int numPruned = (int) std::lround(std::clamp(sparsity, 0.0f, 1.0f) * (double) numWeights);
+    
+    if (numPruned == 0)
+    {
+        AlignedVector<float>().swap(m_weightMask);
+        return;
+    }
+    
+    float* layerWeights = weights();
+    
+    std::vector<int> order(numWeights);
+    std::iota(order.begin(), order.end(), 0);
+    std::nth_element(order.begin(), order.begin() + (numPruned - 1), order.end(), [&](int a, int b)
+    {
+        return std::abs(layerWeights[a]) < std::abs(layerWeights[b]);
+    });
+    
+    for (int i = 0; i < numPruned; i++)
+    {
+        layerWeights[order[i]] = 0.0f;
+    }
+    
+    fixZeroWeights();
+}
+
+void Layer::fixZeroWeights()
+{
+    int numWeights = m_numNodesIn * m_numNodesOut;
+    const float* layerWeights = weights();
+    
+    m_weightMask.resize(numWeights);
+    for (int i = 0; i < numWeights; i++)
+    {
+        m_weightMask[i] = layerWeights[i] != 0.0f ? 1.0f : 0.0f;
+    }
+    
+    // Velocities and moments of pruned weights would only ever be multiplied away
+    for (size_t buffer = 0; buffer < m_optimizerState.size(); buffer += m_stateStride)
+    {
+        for (int i = 0; i < numWeights; i++)
         {
-            weightedInput += inputs[nodeIn] * GetWeight(nodeIn, nodeOut);
+            m_optimizerState[buffer + i] *= m_weightMask[i];
         }
-        
-        weightedInput += m_biases[nodeOut];
-        
-        outputs[nodeOut] = weightedInput;
     }
-        
-    for (int outputNode = 0; outputNode < m_numNodesOut; outputNode++)
+    
+    updateWeightCopies();
+}
+
+int Layer::numNonZeroWeights() const
+{
+    const float* layerWeights = weights();
+    return (int) (m_numNodesIn * m_numNodesOut - std::count(layerWeights, layerWeights + m_numNodesIn * m_numNodesOut, 0.0f));
+}
+
+void Layer::updateWeightCopies()
+{
+    if (mixedPrecision())
     {
-        outputs[outputNode] = Activation::activate(outputs, outputNode, ActivationType::Sigmoid);
+        Kernels::toBFloat16(weights(), m_weightsBF16.data(), (int) m_weightsBF16.size());
     }
     
-    return outputs;
+    if (sparseInputs())
+    {
+        const float* layerWeights = weights();
+        for (int nodeOut = 0; nodeOut < m_numNodesOut; nodeOut++)
+        {
+            for (int nodeIn = 0; nodeIn < m_numNodesIn; nodeIn++)
+            {
+                m_weightsTransposed[(size_t) nodeIn * m_numNodesOut + nodeOut] = layerWeights[GetFlatWeightIndex(nodeIn, nodeOut)];
+            }
+        }
+    }
 }
 
-std::vector<float> Layer::CalculateOutputs(LayerLearnData& layerData, std::vector<float> inputs, ActivationType activationType)
+void SparseRows::assign(const float* rows, int numRows, int numColumns)
 {
-    layerData.inputs = inputs;
+    this->numRows = numRows;
+    this->numColumns = numColumns;
+    
+    rowOffsets.resize(numRows + 1);
+    columns.clear();
+    values.clear();
+    
+    for (int row = 0; row < numRows; row++)
+    {
+        rowOffsets[row] = (int) values.size();
+        
+        const float* rowValues = rows + (size_t) row * numColumns;
+        for (int column = 0; column < numColumns; column++)
+        {
+            if (rowValues[column] != 0.0f)
+            {
+                columns.push_back(column);
+                values.push_back(rowValues[column]);
+            }
+        }
+    }
+    rowOffsets[numRows] = (int) values.size();
+}
 
+float SparseRows::density() const
+{
+    return numRows > 0 && numColumns > 0 ? values.size() / ((float) numRows * numColumns) : 0.0f;
+}
+
+std::vector<float> Layer::CalculateOutputs(std::vector<float> inputs, ActivationType activationType)
+{    
+    std::vector<float> outputs(m_numNodesOut);
+    
+    CalculateOutputs(inputs, outputs, activationType);
+    
+    return outputs;
+}
+
+void Layer::CalculateOutputs(std::span<const float> inputs, std::span<float> outputs, ActivationType activationType) const
+{
+    const float* layerWeights = weights();
+    const float* layerBiases = biases();
+    
     for (int nodeOut = 0; nodeOut < m_numNodesOut; nodeOut++)
     {
-        float weightedInput = m_biases[nodeOut];
+        outputs[nodeOut] = Kernels::dot(inputs.data(), layerWeights + nodeOut * m_numNodesIn, m_numNodesIn) + layerBiases[nodeOut];
+    }
+    
+    Activation::activate(outputs.first(m_numNodesOut), activationType);
+}
 
-        for (int nodeIn = 0; nodeIn < m_numNodesIn; nodeIn++)
-        {
-            weightedInput += inputs[nodeIn] * GetWeight(nodeIn, nodeOut);
-        }
+const std::vector<float>& Layer::CalculateOutputs(LayerLearnData& layerData, std::span<const float> inputs, ActivationType activationType)
+{
+    layerData.inputs = inputs;
+    
+    // No-ops once the layer data has been used
+    layerData.weightedInputs.resize(m_numNodesOut);
+    layerData.activations.resize(m_numNodesOut);
+    layerData.nodeValues.resize(m_numNodesOut);
+    layerData.derivatives.resize(m_numNodesOut);
+    
+    for (int nodeOut = 0; nodeOut < m_numNodesOut; nodeOut++)
+    {
+        float weightedInput = biases()[nodeOut] + Kernels::dot(inputs.data(), &weights()[GetFlatWeightIndex(0, nodeOut)], m_numNodesIn);
         
         layerData.weightedInputs[nodeOut] = weightedInput;
     }
-        
-    for (int i = 0; i < layerData.activations.size(); i++)
-    {
-        layerData.activations[i] = Activation::activate(layerData.weightedInputs, i, ActivationType::Sigmoid);
-    }
+    
+    std::copy(layerData.weightedInputs.begin(), layerData.weightedInputs.end(), layerData.activations.begin());
+    Activation::activate(std::span<float>(layerData.activations), activationType);
     
     return layerData.activations;
 }
 
-void Layer::CalculateOutputLayerNodeValues(LayerLearnData& layerData, std::vector<float> expectedOutputs, CostType costType)
+void Layer::CalculateOutputLayerNodeValues(LayerLearnData& layerData, std::span<const float> expectedOutputs, CostType costType, ActivationType activationType)
 {
+    // Same shortcut as the batched path, which only holds for softmax outputs
+    if (activationType == ActivationType::Softmax && costType == CostType::CrossEntropy)
+    {
+        Cost::softmaxCrossEntropyDerivative(layerData.activations, expectedOutputs, layerData.nodeValues);
+        return;
+    }
+    
+    Activation::derivative(layerData.weightedInputs, layerData.nodeValues, activationType);
+    
     for (int i = 0; i < layerData.nodeValues.size(); i++)
     {
-        float costDerivative = Cost::derivative(layerData.activations[i], expectedOutputs[i], CostType::MeanSquareError);
-        float activationDerivative = Activation::derivative(layerData.weightedInputs, i, ActivationType::Softmax);
-        layerData.nodeValues[i] = costDerivative * activationDerivative;
+        layerData.nodeValues[i] *= Cost::derivative(layerData.activations[i], expectedOutputs[i], costType);
     }
 }
 
-void Layer::CalculateLayerNodeValues(LayerLearnData& layerData, Layer oldLayer, std::vector<float> oldNodeValues, ActivationType activationType)
+void Layer::CalculateLayerNodeValues(LayerLearnData& layerData, const Layer& oldLayer, std::span<const float> oldNodeValues, ActivationType activationType)
 {
+    // nodeValues = oldNodeValues * oldWeights, the batched kernel with one row. It walks each row of the
+    // old weights contiguously instead of striding down a column per node.
+    Kernels::gemmNN(1, m_numNodesOut, oldLayer.m_numNodesOut, oldNodeValues.data(), oldLayer.weights(), layerData.nodeValues.data());
+    
+    Activation::derivative(layerData.weightedInputs, layerData.derivatives, activationType);
     for (int newNodeIndex = 0; newNodeIndex < m_numNodesOut; newNodeIndex++)
     {
-        float newNodeValue = 0;
-        for (int oldNodeIndex = 0; oldNodeIndex < oldNodeValues.size(); oldNodeIndex++)
-        {
-            // Partial derivative of the weighted input with respect to the input
-            float weightedInputDerivative = oldLayer.GetWeight(newNodeIndex, oldNodeIndex);
-            newNodeValue += weightedInputDerivative * oldNodeValues[oldNodeIndex];
-        }
-        newNodeValue *= Activation::derivative(layerData.weightedInputs, newNodeIndex, activationType);
-        layerData.nodeValues[newNodeIndex] = newNodeValue;
+        layerData.nodeValues[newNodeIndex] *= layerData.derivatives[newNodeIndex];
     }
 }
 
 void Layer::updateGradients(LayerLearnData& layerData)
 {
-    std::mutex mtx;
-    mtx.lock();
+    // Writes straight into the layer, so only one sample may be accumulated at a time.
+    // Concurrent training goes through the LayerGradients overload instead.
+    for (int nodeOut = 0; nodeOut < m_numNodesOut; nodeOut++)
     {
-        for (int nodeOut = 0; nodeOut < m_numNodesOut; nodeOut++)
+        float nodeValue = layerData.nodeValues[nodeOut];
+        Kernels::axpy(nodeValue, layerData.inputs.data(), &m_gradients[GetFlatWeightIndex(0, nodeOut)], m_numNodesIn);
+    }
+    
+    float* biasGradients = m_gradients.data() + m_numNodesIn * m_numNodesOut;
+    for (int nodeOut = 0; nodeOut < m_numNodesOut; nodeOut++)
+    {
+        biasGradients[nodeOut] += layerData.nodeValues[nodeOut];
+    }
+}
+
+void Layer::applyGradient(const OptimizerStep& step)
+{
+    applyGradient(step, 0, numParameters());
+}
+
+void Layer::applyGradient(const OptimizerStep& step, int begin, int end)
+{
+    int numWeights = m_numNodesIn * m_numNodesOut;
+    float* parameters = weights();
+    
+    int weightEnd = std::min(end, numWeights);
+    if (begin < weightEnd)
+    {
+        step.apply(parameters + begin, &m_gradients[begin], &m_optimizerState[begin], m_stateStride, weightEnd - begin, true);
+        
+        if (pruned())
         {
-            float nodeValue = layerData.nodeValues[nodeOut];
-            for (int nodeIn = 0; nodeIn < m_numNodesIn; nodeIn++)
+            for (int i = begin; i < weightEnd; i++)
             {
-                m_weightGradients[GetFlatWeightIndex(nodeIn, nodeOut)] += layerData.inputs[nodeIn] * nodeValue;
+                parameters[i] *= m_weightMask[i];
             }
         }
         
-        for (int nodeOut = 0; nodeOut < m_numNodesOut; nodeOut++)
+        // Rounded and transposed while the block is still in cache
+        if (mixedPrecision())
+        {
+            Kernels::toBFloat16(parameters + begin, &m_weightsBF16[begin], weightEnd - begin);
+        }
+        if (sparseInputs())
+        {
+            for (int i = begin; i < weightEnd; i++)
+            {
+                int nodeOut = i / m_numNodesIn;
+                int nodeIn = i - nodeOut * m_numNodesIn;
+                m_weightsTransposed[(size_t) nodeIn * m_numNodesOut + nodeOut] = parameters[i];
+            }
+        }
+    }
+    
+    // biases are not decayed
+    int biasBegin = std::max(begin, numWeights);
+    if (biasBegin < end)
+    {
+        step.apply(parameters + biasBegin, &m_gradients[biasBegin], &m_optimizerState[biasBegin], m_stateStride, end - biasBegin, false);
+    }
+}
+
+void Layer::applyGradientRelaxed(const LayerGradients& gradients, float learnRate, float regularization, float momentum)
+{
+    auto update = [&](float* values, float* velocities, const float* gradients, const float* mask, int n, float weightDecay)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            std::atomic_ref<float> value(values[i]);
+            std::atomic_ref<float> velocity(velocities[i]);
+            
+            float newVelocity = velocity.load(std::memory_order_relaxed) * momentum - gradients[i] * learnRate;
+            float newValue = value.load(std::memory_order_relaxed) * weightDecay + newVelocity;
+            velocity.store(newVelocity, std::memory_order_relaxed);
+            value.store(mask ? newValue * mask[i] : newValue, std::memory_order_relaxed);
+        }
+    };
+    
+    int numWeights = m_numNodesIn * m_numNodesOut;
+    
+    update(weights(), m_optimizerState.data(), gradients.values, pruned() ? m_weightMask.data() : nullptr, numWeights, 1.0f - regularization * learnRate);
+    
+    // biases are not decayed
+    update(biases(), m_optimizerState.data() + numWeights, gradients.values + numWeights, nullptr, m_numNodesOut, 1.0f);
+}
+
+size_t Layer::batchDataSize(int capacity) const
+{
+    size_t rows = roundToCacheLine<float>((size_t) capacity * m_numNodesOut);
+    
+    return 3 * rows + roundToCacheLine<float>(m_numNodesOut);
+}
+
+size_t Layer::gradientsSize() const
+{
+    return roundToCacheLine<float>(numParameters());
+}
+
+float* Layer::bindBatchData(LayerBatchData& batchData, float* arena, int capacity) const
+{
+    size_t rows = roundToCacheLine<float>((size_t) capacity * m_numNodesOut);
+    
+    batchData.batchSize = 0;
+    batchData.capacity = capacity;
+    batchData.inputs = nullptr;
+    batchData.weightedInputs = arena;
+    batchData.activations = arena + rows;
+    batchData.nodeValues = arena + 2 * rows;
+    batchData.derivatives = arena + 3 * rows;
+    
+    return arena + batchDataSize(capacity);
+}
+
+float* Layer::bindGradients(LayerGradients& gradients, float* arena) const
+{
+    gradients.values = arena;
+    
+    return arena + gradientsSize();
+}
+
+const float* Layer::CalculateOutputs(LayerBatchData& batchData, const float* inputs, int batchSize, ActivationType activationType)
+{
+    if (batchSize > batchData.capacity)
+    {
+        throw std::runtime_error("[Layer CalculateOutputs] Batch of " + std::to_string(batchSize) + " exceeds workspace capacity " + std::to_string(batchData.capacity));
+    }
+    
+    batchData.batchSize = batchSize;
+    batchData.inputs = inputs;
+    batchData.sparseInputs = nullptr;
+    
+    // weightedInputs = inputs * weights^T + biases, one row per sample
+    Kernels::broadcastRows(batchSize, m_numNodesOut, biases(), batchData.weightedInputs);
+    if (mixedPrecision())
+    {
+        Kernels::gemmNT(batchSize, m_numNodesOut, m_numNodesIn, inputs, m_weightsBF16.data(), batchData.weightedInputs, true);
+    }
+    else
+    {
+        Kernels::gemmNT(batchSize, m_numNodesOut, m_numNodesIn, inputs, weights(), batchData.weightedInputs, true);
+    }
+    
+    std::copy(batchData.weightedInputs, batchData.weightedInputs + batchSize * m_numNodesOut, batchData.activations);
+    for (int sample = 0; sample < batchSize; sample++)
+    {
+        Activation::activate(std::span<float>(&batchData.activations[sample * m_numNodesOut], m_numNodesOut), activationType);
+    }
+    
+    return batchData.activations;
+}
+
+const float* Layer::CalculateOutputs(LayerBatchData& batchData, const float* inputs, const SparseRows& sparseInputs, ActivationType activationType)
+{
+    int batchSize = sparseInputs.numRows;
+    
+    if (!this->sparseInputs())
+    {
+        throw std::runtime_error("[Layer CalculateOutputs] Sparse inputs are not enabled");
+    }
+    if (batchSize > batchData.capacity)
+    {
+        throw std::runtime_error("[Layer CalculateOutputs] Batch of " + std::to_string(batchSize) + " exceeds workspace capacity " + std::to_string(batchData.capacity));
+    }
+    
+    batchData.batchSize = batchSize;
+    batchData.inputs = inputs;
+    batchData.sparseInputs = &sparseInputs;
+    
+    // weightedInputs = inputs * weights^T + biases, one row of the transposed weights per nonzero input
+    Kernels::broadcastRows(batchSize, m_numNodesOut, biases(), batchData.weightedInputs);
+    Kernels::sparseGemmNN(batchSize, m_numNodesOut, sparseInputs.rowOffsets.data(), sparseInputs.columns.data(), sparseInputs.values.data(), m_weightsTransposed.data(), batchData.weightedInputs);
+    
+    std::copy(batchData.weightedInputs, batchData.weightedInputs + batchSize * m_numNodesOut, batchData.activations);
+    for (int sample = 0; sample < batchSize; sample++)
+    {
+        Activation::activate(std::span<float>(&batchData.activations[sample * m_numNodesOut], m_numNodesOut), activationType);
+    }
+    
+    return batchData.activations;
+}
+
+void Layer::CalculateOutputLayerNodeValues(LayerBatchData& batchData, const float* expectedOutputs, CostType costType, ActivationType activationType)
+{
+    // Softmax and cross entropy cancel down to activations - expectedOutputs, which skips the
+    // Jacobian and the division by a * (1 - a) in Cost::derivative
+    if (activationType == ActivationType::Softmax && costType == CostType::CrossEntropy)
+    {
+        int size = batchData.batchSize * m_numNodesOut;
+        Cost::softmaxCrossEntropyDerivative(std::span<const float>(batchData.activations, size), std::span<const float>(expectedOutputs, size), std::span<float>(batchData.nodeValues, size));
+        return;
+    }
+    
+    for (int sample = 0; sample < batchData.batchSize; sample++)
+    {
+        int offset = sample * m_numNodesOut;
+        Activation::derivative(std::span<const float>(&batchData.weightedInputs[offset], m_numNodesOut), std::span<float>(&batchData.nodeValues[offset], m_numNodesOut), activationType);
+        
+        for (int i = 0; i < m_numNodesOut; i++)
         {
-            m_biasGradients[nodeOut] += layerData.nodeValues[nodeOut];
+            batchData.nodeValues[offset + i] *= Cost::derivative(batchData.activations[offset + i], expectedOutputs[offset + i], costType);
         }
     }
-    mtx.unlock();
 }
 
-void Layer::applyGradient(float learnRate, float regularization, float momentum)
+void Layer::CalculateLayerNodeValues(LayerBatchData& batchData, const Layer& oldLayer, const LayerBatchData& oldBatchData, ActivationType activationType)
 {
-    float weightDecay = (1.0f - regularization * learnRate);
+    // nodeValues = oldNodeValues * oldWeights, then scaled by the activation derivative
+    oldLayer.CalculateInputGradients(oldBatchData, batchData.nodeValues);
+    applyActivationDerivative(batchData, activationType);
+}
 
-    for (int i = 0; i < m_weights.size(); i++)
+void Layer::CalculateInputGradients(const LayerBatchData& batchData, float* inputGradients) const
+{
+    if (mixedPrecision())
+    {
+        Kernels::gemmNN(batchData.batchSize, m_numNodesIn, m_numNodesOut, batchData.nodeValues, m_weightsBF16.data(), inputGradients);
+    }
+    else
     {
-        float velocity = m_weightVelocities[i] * momentum - m_weightGradients[i] * learnRate;
-        m_weightVelocities[i] = velocity;
-        m_weights[i] = m_weights[i] * weightDecay + velocity;
-        m_weightGradients[i] = 0;
+        Kernels::gemmNN(batchData.batchSize, m_numNodesIn, m_numNodesOut, batchData.nodeValues, weights(), inputGradients);
     }
+}
 
-    for (int i = 0; i < m_biases.size(); i++)
+void Layer::applyActivationDerivative(LayerBatchData& batchData, ActivationType activationType) const
+{
+    std::span<float> derivatives(batchData.derivatives, m_numNodesOut);
+    for (int sample = 0; sample < batchData.batchSize; sample++)
     {
-        float velocity = m_biasVelocities[i] * momentum - m_biasGradients[i] * learnRate;
-        m_biasVelocities[i] = velocity;
-        m_biases[i] += velocity;
-        m_biasGradients[i] = 0;
+        int offset = sample * m_numNodesOut;
+        Activation::derivative(std::span<const float>(&batchData.weightedInputs[offset], m_numNodesOut), derivatives, activationType);
+        
+        for (int i = 0; i < m_numNodesOut; i++)
+        {
+            batchData.nodeValues[offset + i] *= derivatives[i];
+        }
     }
 }
 
+void Layer::updateGradients(const LayerBatchData& batchData, LayerGradients& gradients) const
+{
+    float* weightGradients = gradients.values;
+    float* biasGradients = weightGradients + (size_t) m_numNodesIn * m_numNodesOut;
+    
+    // weightGradients = nodeValues^T * inputs, summed over the batch
+    if (batchData.sparseInputs)
+    {
+        const SparseRows& inputs = *batchData.sparseInputs;
+        std::fill(weightGradients, biasGradients, 0.0f);
+        Kernels::sparseGemmTN(batchData.batchSize, m_numNodesOut, inputs.rowOffsets.data(), inputs.columns.data(), inputs.values.data(), batchData.nodeValues, weightGradients);
+    }
+    else if (sparseInputs())
+    {
+        // transposed, inputs^T * nodeValues
+        Kernels::gemmTN(m_numNodesIn, m_numNodesOut, batchData.batchSize, batchData.inputs, m_numNodesIn, batchData.nodeValues, weightGradients);
+    }
+    else
+    {
+        Kernels::gemmTN(m_numNodesOut, m_numNodesIn, batchData.batchSize, batchData.nodeValues, m_numNodesOut, batchData.inputs, weightGradients);
+    }
+    
+    std::fill(biasGradients, biasGradients + m_numNodesOut, 0.0f);
+    Kernels::sumRows(batchData.batchSize, m_numNodesOut, batchData.nodeValues, m_numNodesOut, biasGradients);
+}
+
+void Layer::addGradients(const LayerGradients& gradients, int begin, int end)
+{
+    if (sparseInputs())
+    {
+        // Weight gradients in the transposed layout, see LayerGradients
+        int weightEnd = std::min(end, m_numNodesIn * m_numNodesOut);
+        for (; begin < weightEnd; begin++)
+        {
+            int nodeOut = begin / m_numNodesIn;
+            int nodeIn = begin - nodeOut * m_numNodesIn;
+            m_gradients[begin] += gradients.values[(size_t) nodeIn * m_numNodesOut + nodeOut];
+        }
+        if (begin >= end)
+        {
+            return;
+        }
+    }
+    
+    Kernels::axpy(1.0f, &gradients.values[begin], &m_gradients[begin], end - begin);
+}
+
 // Calculate layer output activations and store inputs/weightedInputs/activations in the given learnData object
 //std::vector<float> Layer::CalculateOutputs(std::vector<float> inputs, LayerLearnData learnData)
 //{
@@ -185,7 +588,7 @@ void Layer::applyGradient(float learnRate, float regularization, float momentum)
 float Layer::GetWeight(int nodeIn, int nodeOut)
 {
     int flatIndex = nodeOut * m_numNodesIn + nodeIn;
-    return m_weights[flatIndex];
+    return weights()[flatIndex];
 }
 
 int Layer::GetFlatWeightIndex(int inputNeuronIndex, int outputNeuronIndex)
@@ -198,19 +601,26 @@ int Layer::GetFlatWeightIndex(int inputNeuronIndex, int outputNeuronIndex)
 //    this.activation = activation;
 //}
 
+void Layer::setParameters(const float* parameters)
+{
+    std::copy(parameters, parameters + numParameters(), weights());
+    
+    updateWeightCopies();
+}
+
 void Layer::initRandomWeights()
 {
     std::default_random_engine generator;
     std::normal_distribution<float> distribution(0.0f, 1.0f);
     
-    for (int i = 0; i < m_weights.size(); i++)
-    {
-        m_weights[i] = distribution(generator);
-    }
+    float* parameters = weights();
     
-    for (int i = 0; i < m_biases.size(); i++)
+    for (int i = 0; i < numParameters(); i++)
     {
-        m_biases[i] = distribution(generator);
+        parameters[i] = distribution(generator);
     }
     
+    AlignedVector<float>().swap(m_weightMask);
+    
+    updateWeightCopies();
 }
@@ -8,16 +8,65 @@
 #pragma once
 
 #include <vector>
+#include <span>
 
+#include <memory>
+
+#include "AlignedAllocator.hpp"
+#include "BFloat16.hpp"
 #include "Activation.hpp"
 #include "Cost.hpp"
+#include "MappedFile.hpp"
+#include "Optimizer.hpp"
 
 struct LayerLearnData
 {
-    std::vector<float> inputs;
+    std::span<const float> inputs; // the previous layer's activations or the caller's sample, not copied
     std::vector<float> weightedInputs;
     std::vector<float> activations;
     std::vector<float> nodeValues;
+    std::vector<float> derivatives; // scratch for the activation derivatives of the backward pass
+};
+
+// Compressed sparse rows (CSR) of a batch of inputs: the nonzero values of row r and their columns are
+// entries [rowOffsets[r], rowOffsets[r + 1]) of values and columns. The buffers keep their capacity between batches.
+struct SparseRows
+{
+    int numRows = 0;
+    int numColumns = 0;
+    std::vector<int> rowOffsets;
+    std::vector<int> columns;
+    std::vector<float> values;
+    
+    // Rebuilds the rows from a dense numRows x numColumns matrix, dropping exact zeros
+    void assign(const float* rows, int numRows, int numColumns);
+    
+    // Fraction of the entries that are nonzero
+    float density() const;
+};
+
+// One mini-batch worth of LayerLearnData, stored row-major with one row per sample.
+// The buffers are slices of a workspace arena handed out by Layer::bindBatchData.
+struct LayerBatchData
+{
+    int batchSize = 0;
+    int capacity = 0; // rows the slices have room for
+    
+    const float* inputs = nullptr; // batchSize x numNodesIn, owned by the previous layer or the caller
+    const SparseRows* sparseInputs = nullptr; // the nonzeros of inputs when the forward pass used the sparse kernel
+    float* weightedInputs = nullptr; // capacity x numNodesOut
+    float* activations = nullptr;
+    float* nodeValues = nullptr;
+    float* derivatives = nullptr; // numNodesOut, scratch for one sample
+};
+
+// Gradient accumulator for one layer: numNodesOut x numNodesIn weight gradients followed by the
+// bias gradients. Every chunk of a mini-batch writes its own, so workers never share a cache line.
+// A layer with sparse inputs keeps its weight gradients transposed (numNodesIn x numNodesOut) instead,
+// so a nonzero input adds one contiguous row; addGradients transposes them back.
+struct LayerGradients
+{
+    float* values = nullptr; // numParameters(), a slice of a workspace arena
 };
 
 class Layer
@@ -27,15 +76,67 @@ public:
     
     std::vector<float> CalculateOutputs(std::vector<float> inputs, ActivationType activationType);
     
-    std::vector<float> CalculateOutputs(LayerLearnData& layerData, std::vector<float> inputs, ActivationType activationType);
-
-    void CalculateOutputLayerNodeValues(LayerLearnData& layerData, std::vector<float> expectedOutputs, CostType costType);
-        
-    void CalculateLayerNodeValues(LayerLearnData& layerData, Layer oldLayer, std::vector<float> oldNodeValues, ActivationType activationType);
-
+    // Single sample into caller owned storage, outputs.size() == numNodesOut()
+    void CalculateOutputs(std::span<const float> inputs, std::span<float> outputs, ActivationType activationType) const;
+    
+    // Returns layerData.activations, which the next layer can take as its inputs without a copy
+    const std::vector<float>& CalculateOutputs(LayerLearnData& layerData, std::span<const float> inputs, ActivationType activationType);
+    
+    void CalculateOutputLayerNodeValues(LayerLearnData& layerData, std::span<const float> expectedOutputs, CostType costType, ActivationType activationType);
+    
+    // oldLayer is the next layer towards the output, oldNodeValues its node values
+    void CalculateLayerNodeValues(LayerLearnData& layerData, const Layer& oldLayer, std::span<const float> oldNodeValues, ActivationType activationType);
+    
     void updateGradients(LayerLearnData& layerData);
     
-    void applyGradient(float learnRate, float regularization, float momentum);
+    // One optimizer step with the gradients accumulated in the layer, which it clears
+    void applyGradient(const OptimizerStep& step);
+    
+    // Same over parameters [begin, end) only, see LayerGradients for the layout. Disjoint ranges of one step
+    // can run on different threads; the bfloat16 weights of the range are re-rounded too.
+    void applyGradient(const OptimizerStep& step, int begin, int end);
+    
+    // Sizes and clears the velocities or moments for type, which every step after this must use
+    void setOptimizer(OptimizerType type);
+    
+    // Momentum step straight from a worker's gradients for asynchronous (Hogwild) training. Other workers
+    // may be reading or updating the same parameters, every element goes through a relaxed std::atomic_ref
+    // so no update is torn, but concurrent ones can overwrite each other. Leaves the bfloat16 copy stale.
+    // Pruned weights stay zero.
+    // Uses the first optimizer state buffer as the velocities, so the layer's optimizer should be Momentum.
+    void applyGradientRelaxed(const LayerGradients& gradients, float learnRate, float regularization, float momentum);
+    
+    // -- Batched path: every call processes a whole mini-batch as one matrix --
+    // Returns batchData.activations, batchSize must not exceed batchData.capacity
+    const float* CalculateOutputs(LayerBatchData& batchData, const float* inputs, int batchSize, ActivationType activationType);
+    
+    // Same with the multiplications skipping the zero inputs, sparseInputs holds the nonzeros of inputs and must
+    // outlive the backward pass. Needs setSparseInputs(true).
+    const float* CalculateOutputs(LayerBatchData& batchData, const float* inputs, const SparseRows& sparseInputs, ActivationType activationType);
+    
+    void CalculateOutputLayerNodeValues(LayerBatchData& batchData, const float* expectedOutputs, CostType costType, ActivationType activationType);
+    
+    void CalculateLayerNodeValues(LayerBatchData& batchData, const Layer& oldLayer, const LayerBatchData& oldBatchData, ActivationType activationType);
+    
+    // The two halves of CalculateLayerNodeValues, for when the layers live on different threads.
+    // inputGradients (batchSize x numNodesIn) = nodeValues * weights, the previous layer's node values before
+    // its activation derivative is applied.
+    void CalculateInputGradients(const LayerBatchData& batchData, float* inputGradients) const;
+    void applyActivationDerivative(LayerBatchData& batchData, ActivationType activationType) const;
+    
+    // Overwrites gradients with the gradients of the batch, with the sparse kernel if the forward pass used it
+    void updateGradients(const LayerBatchData& batchData, LayerGradients& gradients) const;
+    
+    // Adds elements [begin, end) of gradients to the layer's own gradients, see LayerGradients for the layout
+    void addGradients(const LayerGradients& gradients, int begin, int end);
+    
+    // Floats of arena used by bindBatchData and bindGradients, each slice starts on a cache line
+    size_t batchDataSize(int capacity) const;
+    size_t gradientsSize() const;
+    
+    // Points the buffers at the front of arena and returns the first float past them
+    float* bindBatchData(LayerBatchData& batchData, float* arena, int capacity) const;
+    float* bindGradients(LayerGradients& gradients, float* arena) const;
     
     //std::vector<float> CalculateOutputs(std::vector<float> inputs, LayerLearnData learnData);
     
@@ -47,25 +148,75 @@ public:
     
     
     void initRandomWeights();
-        
+    
+    int numNodesIn() const { return m_numNodesIn; }
+    int numNodesOut() const { return m_numNodesOut; }
+    
+    // Weights (numNodesOut x numNodesIn) followed by biases, the layout used by ModelFile
+    int numParameters() const { return m_numNodesIn * m_numNodesOut + m_numNodesOut; }
+    const float* parameters() const { return m_mappedParameters ? m_mappedParameters : m_parameters.data(); }
+    
+    // Overwrites the weights and biases with numParameters() floats in the same layout, e.g. another replica's
+    void setParameters(const float* parameters);
+    
+    // Keeps a bfloat16 copy of the weights that the batched forward and backward passes read, halving their
+    // traffic. The float weights stay the master copy applyGradient updates and gradients stay float.
+    void setMixedPrecision(bool enabled);
+    bool mixedPrecision() const { return !m_weightsBF16.empty(); }
+    
+    // Magnitude pruning: zeros the fraction sparsity of the weights with the smallest magnitude and keeps every
+    // zero weight at zero through further training, so fine-tuning only moves the surviving ones. Biases are never
+    // pruned. 0 removes the mask and leaves the weights as they are.
+    void prune(float sparsity);
+    
+    // Same mask over exactly the weights that are zero now, e.g. ones loaded from a pruned file
+    void fixZeroWeights();
+    bool pruned() const { return !m_weightMask.empty(); }
+    
+    // Weights that are not zero, biases excluded
+    int numNonZeroWeights() const;
+    
+    // Keeps a transposed float copy of the weights (numNodesIn x numNodesOut) for the sparse input kernels, which
+    // add one row of it per nonzero input, and switches the gradients to the transposed layout. For the first
+    // layer, whose inputs are mostly zero pixels. applyGradientRelaxed leaves the copy stale.
+    void setSparseInputs(bool enabled);
+    bool sparseInputs() const { return !m_weightsTransposed.empty(); }
+    
+    // Uses numParameters() floats inside a mapped file as the parameters instead of copying them.
+    // The mapping is copy-on-write, so training afterwards only touches this process' pages.
+    void aliasParameters(std::shared_ptr<MappedFile> file, float* parameters);
+    
 private:
     
     int m_numNodesIn;
     int m_numNodesOut;
-
-    std::vector<float> m_weights;
-    std::vector<float> m_biases;
-
-    std::vector<float> m_weightGradients;
-    std::vector<float> m_biasGradients;
-
-    std::vector<float> m_weightVelocities;
-    std::vector<float> m_biasVelocities;
-          
+    
+    AlignedVector<float> m_parameters;
+    
+    std::shared_ptr<MappedFile> m_mappedFile;
+    float* m_mappedParameters = nullptr;
+    
+    AlignedVector<bfloat16> m_weightsBF16; // empty unless mixed precision is on
+    AlignedVector<float> m_weightsTransposed; // empty unless sparse inputs are on
+    AlignedVector<float> m_weightMask; // 1 for kept and 0 for pruned weights, empty unless pruned
+    
+    AlignedVector<float> m_gradients; // numParameters(), laid out like the parameters
+    
+    AlignedVector<float> m_optimizerState; // OptimizerSettings::numStateBuffers buffers, m_stateStride floats apart
+    size_t m_stateStride = 0;
+    
     //Activation m_activation;
     //Cost m_cost;
     
 private:
+    float* weights() { return m_mappedParameters ? m_mappedParameters : m_parameters.data(); }
+    const float* weights() const { return parameters(); }
+    float* biases() { return weights() + m_numNodesIn * m_numNodesOut; }
+    const float* biases() const { return weights() + m_numNodesIn * m_numNodesOut; }
+    
+    // Re-rounds m_weightsBF16 and re-transposes m_weightsTransposed after the float weights changed
+    void updateWeightCopies();
+    
     float GetWeight(int nodeIn, int nodeOut);
     int GetFlatWeightIndex(int inputNeuronIndex, int outputNeuronIndex);
 };
@@ -0,0 +1,71 @@
+//
+//  MappedFile.cpp
+//  Neural network
+//
+
+#include "MappedFile.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::shared_ptr<MappedFile> MappedFile::open(const std::string& filePath)
+{
+    int fd = ::open(filePath.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Could not open " + filePath);
+    }
+    
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        ::close(fd);
+        throw std::runtime_error("Empty or unreadable file " + filePath);
+    }
+    
+    size_t size = (size_t) info.st_size;
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    
+    if (data == MAP_FAILED)
+    {
+        throw std::runtime_error("Could not map " + filePath);
+    }
+    
+    return std::shared_ptr<MappedFile>(new MappedFile(static_cast<unsigned char*>(data), size));
+}
+
+MappedFile::MappedFile(unsigned char* data, size_t size)
+: m_data(data), m_size(size)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    munmap(m_data, m_size);
+}
+
+// The tail bytes past the last whole word are folded in one at a time
+uint64_t MappedFile::checksum(const unsigned char* data, size_t size)
+{
+    const uint64_t prime = 1099511628211ull;
+    uint64_t hash = 14695981039346656037ull;
+    
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * prime;
+    }
+    for (; i < size; i++)
+    {
+        hash = (hash ^ data[i]) * prime;
+    }
+    return hash;
+}
@@ -0,0 +1,38 @@
+//
+//  MappedFile.hpp
+//  Neural network
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// A whole file mapped copy-on-write: reads come straight from the page cache and
+// writes stay private to this process, so buffers can alias the file and still be trained
+class MappedFile
+{
+public:
+    // Throws std::runtime_error if the file can't be opened or mapped
+    static std::shared_ptr<MappedFile> open(const std::string& filePath);
+    
+    ~MappedFile();
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    unsigned char* data() { return m_data; }
+    const unsigned char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    
+    // FNV-1a over 64 bit words, used by the binary file formats
+    static uint64_t checksum(const unsigned char* data, size_t size);
+    
+private:
+    MappedFile(unsigned char* data, size_t size);
+    
+    unsigned char* m_data;
+    size_t m_size;
+};
@@ -0,0 +1,321 @@
+//
+//  ModelFile.cpp
+//  Neural network
+//
+
+#include "ModelFile.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+
+namespace
+{
+    constexpr char kMagic[4] = { 'N', 'N', 'W', 'T' };
+    constexpr size_t kBlobAlignment = 64;
+    constexpr int kMaxSparseInputs = 65536; // columns are 16 bit
+    
+    size_t alignUp(size_t value, size_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+    
+    size_t layerParameterCount(const std::vector<int>& layerSizes, int layer)
+    {
+        return (size_t) layerSizes[layer] * layerSizes[layer + 1] + layerSizes[layer + 1];
+    }
+    
+    // Where the arrays of a version 2 layer blob start, relative to the blob
+    struct SparseBlobLayout
+    {
+        size_t rowOffsets;
+        size_t columns;
+        size_t values;
+        size_t biases;
+        size_t size;
+        
+        SparseBlobLayout(int numNodesOut, size_t numNonZero)
+        {
+            rowOffsets = sizeof(uint32_t);
+            columns = rowOffsets + ((size_t) numNodesOut + 1) * sizeof(uint32_t);
+            values = alignUp(columns + numNonZero * sizeof(uint16_t), sizeof(float));
+            biases = values + numNonZero * sizeof(float);
+            size = biases + (size_t) numNodesOut * sizeof(float);
+        }
+    };
+    
+    size_t countNonZero(const float* values, size_t count)
+    {
+        return count - std::count(values, values + count, 0.0f);
+    }
+}
+
+void ModelFile::write(const std::string& filePath, const std::vector<int>& layerSizes, ActivationType activationType, CostType costType, const std::vector<const float*>& layerParameters, bool sparse)
+{
+    uint32_t numLayers = (uint32_t) layerParameters.size();
+    
+    // Lay the whole file out in memory first, the checksum needs all of it
+    size_t tableOffset = sizeof(ModelFileHeader);
+    size_t offsetsOffset = alignUp(tableOffset + (numLayers + 1) * sizeof(uint32_t), sizeof(uint64_t));
+    size_t headerSize = alignUp(offsetsOffset + numLayers * sizeof(uint64_t), kBlobAlignment);
+    
+    std::vector<uint64_t> offsets(numLayers);
+    size_t fileSize = headerSize;
+    for (uint32_t layer = 0; layer < numLayers; layer++)
+    {
+        offsets[layer] = fileSize;
+        
+        size_t blobSize = layerParameterCount(layerSizes, layer) * sizeof(float);
+        if (sparse)
+        {
+            if (layerSizes[layer] > kMaxSparseInputs)
+            {
+                throw std::runtime_error("Layer " + std::to_string(layer) + " has too many inputs for a sparse weights file");
+            }
+            size_t numWeights = (size_t) layerSizes[layer] * layerSizes[layer + 1];
+            blobSize = SparseBlobLayout(layerSizes[layer + 1], countNonZero(layerParameters[layer], numWeights)).size;
+        }
+        fileSize = alignUp(fileSize + blobSize, kBlobAlignment);
+    }
+    
+    std::vector<unsigned char> contents(fileSize, 0);
+    
+    for (uint32_t i = 0; i <= numLayers; i++)
+    {
+        uint32_t size = (uint32_t) layerSizes[i];
+        std::memcpy(&contents[tableOffset + i * sizeof(uint32_t)], &size, sizeof(uint32_t));
+    }
+    std::memcpy(&contents[offsetsOffset], offsets.data(), numLayers * sizeof(uint64_t));
+    
+    for (uint32_t layer = 0; layer < numLayers; layer++)
+    {
+        if (!sparse)
+        {
+            std::memcpy(&contents[offsets[layer]], layerParameters[layer], layerParameterCount(layerSizes, layer) * sizeof(float));
+            continue;
+        }
+        
+        int numNodesIn = layerSizes[layer];
+        int numNodesOut = layerSizes[layer + 1];
+        const float* weights = layerParameters[layer];
+        
+        uint32_t numNonZero = (uint32_t) countNonZero(weights, (size_t) numNodesIn * numNodesOut);
+        SparseBlobLayout layout(numNodesOut, numNonZero);
+        unsigned char* blob = &contents[offsets[layer]];
+        std::memcpy(blob, &numNonZero, sizeof(uint32_t));
+        
+        uint32_t entry = 0;
+        for (int nodeOut = 0; nodeOut < numNodesOut; nodeOut++)
+        {
+            std::memcpy(blob + layout.rowOffsets + nodeOut * sizeof(uint32_t), &entry, sizeof(uint32_t));
+            
+            const float* row = weights + (size_t) nodeOut * numNodesIn;
+            for (int nodeIn = 0; nodeIn < numNodesIn; nodeIn++)
+            {
+                if (row[nodeIn] != 0.0f)
+                {
+                    uint16_t column = (uint16_t) nodeIn;
+                    std::memcpy(blob + layout.columns + entry * sizeof(uint16_t), &column, sizeof(uint16_t));
+                    std::memcpy(blob + layout.values + entry * sizeof(float), &row[nodeIn], sizeof(float));
+                    entry++;
+                }
+            }
+        }
+        std::memcpy(blob + layout.rowOffsets + numNodesOut * sizeof(uint32_t), &entry, sizeof(uint32_t));
+        std::memcpy(blob + layout.biases, weights + (size_t) numNodesIn * numNodesOut, numNodesOut * sizeof(float));
+    }
+    
+    ModelFileHeader header = {};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = sparse ? kSparseVersion : kVersion;
+    header.numLayers = numLayers;
+    header.activationType = (uint32_t) activationType;
+    header.costType = (uint32_t) costType;
+    header.headerSize = (uint32_t) headerSize;
+    header.fileSize = fileSize;
+    header.checksum = MappedFile::checksum(contents.data() + sizeof(ModelFileHeader), fileSize - sizeof(ModelFileHeader));
+    std::memcpy(contents.data(), &header, sizeof(header));
+    
+    std::ofstream file(filePath, std::ios::out | std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(contents.data()), contents.size());
+    
+    if (!file)
+    {
+        throw std::runtime_error("Could not write weights to " + filePath);
+    }
+}
+
+ModelFile ModelFile::read(const std::string& filePath)
+{
+    ModelFile model;
+    model.file = MappedFile::open(filePath);
+    
+    const unsigned char* data = model.file->data();
+    size_t size = model.file->size();
+    
+    ModelFileHeader header;
+    if (size < sizeof(header))
+    {
+        throw std::runtime_error(filePath + " is too small to be a weights file");
+    }
+    std::memcpy(&header, data, sizeof(header));
+    
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0)
+    {
+        throw std::runtime_error(filePath + " is not a weights file");
+    }
+    if (header.version != kVersion && header.version != kSparseVersion)
+    {
+        throw std::runtime_error(filePath + " has unsupported weights version " + std::to_string(header.version));
+    }
+    // The header is outside the checksum, and both are cast to enums
+    if (header.activationType > (uint32_t) ActivationType::Softmax)
+    {
+        throw std::runtime_error(filePath + " has unknown activation type " + std::to_string(header.activationType));
+    }
+    if (header.costType > (uint32_t) CostType::CrossEntropy)
+    {
+        throw std::runtime_error(filePath + " has unknown cost type " + std::to_string(header.costType));
+    }
+    if (header.fileSize != size || header.numLayers == 0 || header.headerSize > size)
+    {
+        throw std::runtime_error(filePath + " is truncated or corrupt");
+    }
+    if (MappedFile::checksum(data + sizeof(header), size - sizeof(header)) != header.checksum)
+    {
+        throw std::runtime_error(filePath + " failed its checksum");
+    }
+    
+    // A matching checksum only means the file is intact, everything it describes is still checked
+    // against the mapping, comparing sizes with the space left so that no sum or product can wrap
+    size_t tableOffset = sizeof(ModelFileHeader);
+    size_t offsetsOffset = alignUp(tableOffset + ((size_t) header.numLayers + 1) * sizeof(uint32_t), sizeof(uint64_t));
+    if (header.headerSize < offsetsOffset || (header.headerSize - offsetsOffset) / sizeof(uint64_t) < header.numLayers)
+    {
+        throw std::runtime_error(filePath + " has an invalid layer table");
+    }
+    
+    model.layerSizes.resize(header.numLayers + 1);
+    for (uint32_t i = 0; i <= header.numLayers; i++)
+    {
+        uint32_t layerSize;
+        std::memcpy(&layerSize, data + tableOffset + i * sizeof(uint32_t), sizeof(uint32_t));
+        if (layerSize == 0 || layerSize > (uint32_t) std::numeric_limits<int>::max())
+        {
+            throw std::runtime_error(filePath + " has an invalid layer size " + std::to_string(layerSize));
+        }
+        model.layerSizes[i] = (int) layerSize;
+    }
+    
+    model.layerOffsets.resize(header.numLayers);
+    std::memcpy(model.layerOffsets.data(), data + offsetsOffset, header.numLayers * sizeof(uint64_t));
+    
+    model.sparse = header.version == kSparseVersion;
+    
+    for (uint32_t layer = 0; layer < header.numLayers; layer++)
+    {
+        uint64_t offset = model.layerOffsets[layer];
+        if (offset % kBlobAlignment != 0 || offset < header.headerSize || offset > size)
+        {
+            throw std::runtime_error(filePath + " has an invalid layer table");
+        }
+        
+        size_t numNodesIn = model.layerSizes[layer];
+        size_t numNodesOut = model.layerSizes[layer + 1];
+        size_t available = size - offset;
+        
+        if (!model.sparse)
+        {
+            size_t availableFloats = available / sizeof(float);
+            if (availableFloats < numNodesOut || numNodesIn > (availableFloats - numNodesOut) / numNodesOut)
+            {
+                throw std::runtime_error(filePath + " has an invalid layer table");
+            }
+            continue;
+        }
+        
+        uint32_t numNonZero = 0;
+        if (available >= sizeof(uint32_t))
+        {
+            std::memcpy(&numNonZero, data + offset, sizeof(uint32_t));
+        }
+        if (available < sizeof(uint32_t) || numNodesIn > kMaxSparseInputs || numNonZero > numNodesIn * numNodesOut)
+        {
+            throw std::runtime_error(filePath + " has an invalid sparse layer");
+        }
+        
+        // A 32 bit count of nonzeros and an int number of rows keep the layout far from wrapping
+        SparseBlobLayout layout(model.layerSizes[layer + 1], numNonZero);
+        if (layout.size > available)
+        {
+            throw std::runtime_error(filePath + " has an invalid layer table");
+        }
+        
+        // Rows must tile [0, numNonZero) in order and every column must be an input, then
+        // expandLayerParameters can index with them unchecked
+        const unsigned char* blob = data + offset;
+        uint32_t rowBegin;
+        std::memcpy(&rowBegin, blob + layout.rowOffsets, sizeof(uint32_t));
+        if (rowBegin != 0)
+        {
+            throw std::runtime_error(filePath + ": sparse layer " + std::to_string(layer) + " has invalid row offsets");
+        }
+        for (size_t nodeOut = 0; nodeOut < numNodesOut; nodeOut++)
+        {
+            uint32_t rowEnd;
+            std::memcpy(&rowEnd, blob + layout.rowOffsets + (nodeOut + 1) * sizeof(uint32_t), sizeof(uint32_t));
+            if (rowEnd < rowBegin || (nodeOut + 1 == numNodesOut && rowEnd != numNonZero))
+            {
+                throw std::runtime_error(filePath + ": sparse layer " + std::to_string(layer) + " has invalid row offsets");
+            }
+            rowBegin = rowEnd;
+        }
+        
+        for (uint32_t entry = 0; entry < numNonZero; entry++)
+        {
+            uint16_t column;
+            std::memcpy(&column, blob + layout.columns + entry * sizeof(uint16_t), sizeof(uint16_t));
+            if (column >= numNodesIn)
+            {
+                throw std::runtime_error(filePath + ": sparse layer " + std::to_string(layer) + " has an invalid column");
+            }
+        }
+    }
+    
+    model.activationType = (ActivationType) header.activationType;
+    model.costType = (CostType) header.costType;
+    
+    return model;
+}
+
+void ModelFile::expandLayerParameters(int layer, float* parameters) const
+{
+    int numNodesIn = layerSizes[layer];
+    int numNodesOut = layerSizes[layer + 1];
+    const unsigned char* blob = file->data() + layerOffsets[layer];
+    
+    uint32_t numNonZero;
+    std::memcpy(&numNonZero, blob, sizeof(uint32_t));
+    SparseBlobLayout layout(numNodesOut, numNonZero);
+    
+    std::fill(parameters, parameters + (size_t) numNodesIn * numNodesOut, 0.0f);
+    
+    // read() validated the rows and columns
+    for (int nodeOut = 0; nodeOut < numNodesOut; nodeOut++)
+    {
+        uint32_t rowBegin, rowEnd;
+        std::memcpy(&rowBegin, blob + layout.rowOffsets + nodeOut * sizeof(uint32_t), sizeof(uint32_t));
+        std::memcpy(&rowEnd, blob + layout.rowOffsets + (nodeOut + 1) * sizeof(uint32_t), sizeof(uint32_t));
+        
+        for (uint32_t entry = rowBegin; entry < rowEnd; entry++)
+        {
+            uint16_t column;
+            std::memcpy(&column, blob + layout.columns + entry * sizeof(uint16_t), sizeof(uint16_t));
+            std::memcpy(&parameters[(size_t) nodeOut * numNodesIn + column], blob + layout.values + entry * sizeof(float), sizeof(float));
+        }
+    }
+    
+    std::memcpy(parameters + (size_t) numNodesIn * numNodesOut, blob + layout.biases, numNodesOut * sizeof(float));
+}
@@ -0,0 +1,72 @@
+//
+//  ModelFile.hpp
+//  Neural network
+//
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Activation.hpp"
+#include "Cost.hpp"
+#include "MappedFile.hpp"
+
+// Binary weights file, little endian:
+//
+//   ModelFileHeader                       64 bytes
+//   uint32 layerSizes[numLayers + 1]
+//   uint64 layerOffsets[numLayers]        byte offset of each layer's parameters
+//   per layer, 64 byte aligned:           float weights[out x in] followed by float biases[out]
+//
+// The parameter blobs match Layer's in-memory layout, so a loaded Layer can alias the mapping.
+//
+// Version 2 files hold pruned layers with only their nonzero weights, in compressed sparse rows:
+//
+//   per layer, 64 byte aligned:           uint32 numNonZero, uint32 rowOffsets[out + 1],
+//                                         uint16 columns[numNonZero] padded to 4 bytes,
+//                                         float values[numNonZero], float biases[out]
+struct ModelFileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t numLayers;
+    uint32_t activationType;
+    uint32_t costType;
+    uint32_t headerSize; // bytes up to the first parameter blob
+    uint64_t fileSize;
+    uint64_t checksum; // of every byte after the header
+    uint8_t reserved[24];
+};
+
+static_assert(sizeof(ModelFileHeader) == 64, "ModelFileHeader must stay 64 bytes");
+
+class ModelFile
+{
+public:
+    static constexpr uint32_t kVersion = 1;
+    static constexpr uint32_t kSparseVersion = 2;
+    
+    // layerParameters[i] holds layerSizes[i] x layerSizes[i + 1] weights followed by layerSizes[i + 1] biases.
+    // Sparse writes a version 2 file without the zero weights.
+    static void write(const std::string& filePath, const std::vector<int>& layerSizes, ActivationType activationType, CostType costType, const std::vector<const float*>& layerParameters, bool sparse = false);
+    
+    // Maps the file and validates it, throws std::runtime_error if it is not a usable weights file
+    static ModelFile read(const std::string& filePath);
+    
+    // Version 1 only, the parameters in place
+    float* layerParameters(int layer) { return reinterpret_cast<float*>(file->data() + layerOffsets[layer]); }
+    
+    // Version 2 only, writes the layer's parameters with the zeros filled back in
+    void expandLayerParameters(int layer, float* parameters) const;
+    
+    bool sparse = false;
+    std::vector<int> layerSizes;
+    ActivationType activationType;
+    CostType costType;
+    
+    std::shared_ptr<MappedFile> file;
+    std::vector<uint64_t> layerOffsets;
+};
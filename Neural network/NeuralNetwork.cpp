@@ -7,252 +7,1514 @@
 
 #include "NeuralNetwork.hpp"
 #include "Layer.hpp"
+#include "Kernels.hpp"
+#include "ModelFile.hpp"
+#include "SpscQueue.hpp"
 
-#include <fstream>
-#include <sstream>
 #include <iostream>
 #include <random>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <numeric>
+#include <stdexcept>
 #include <thread>
 
-#include <future>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace
+{
+    constexpr int kMinChunkSize = 8; // smallest slice of a mini-batch handed to one worker
+    constexpr int kTestBatchSize = 256;
+    constexpr int kReduceBlockSize = 4096; // gradient elements per reduction task
+    constexpr float kInputNoise = 0.001f; // stddev of the pixel noise added to every training batch
+    constexpr float kMaxSparseDensity = 0.5f; // nonzero fraction above which the dense first layer kernels are faster
+    constexpr unsigned int kShuffleSeed = 5489;
+    
+    // One mini-batch for every pipeline stage, a null batch stops the stage
+    struct PipelineStep
+    {
+        const TrainingBatch* batch;
+        const OptimizerStep* optimizerStep;
+    };
+    
+    // First layer of every pipeline stage followed by the number of layers. Contiguous groups, split so the
+    // stage with the most parameters has as few as possible.
+    std::vector<int> partitionLayers(const std::vector<Layer>& layers, int numStages)
+    {
+        int numLayers = (int) layers.size();
+        
+        auto split = [&](int64_t capacity)
+        {
+            std::vector<int> begins { 0 };
+            int64_t load = 0;
+            for (int layer = 0; layer < numLayers; layer++)
+            {
+                int64_t size = layers[layer].numParameters();
+                int remainingStages = numStages - (int) begins.size();
+                bool full = load + size > capacity || numLayers - layer == remainingStages;
+                if (layer > begins.back() && remainingStages > 0 && full)
+                {
+                    begins.push_back(layer);
+                    load = 0;
+                }
+                load += size;
+            }
+            begins.push_back(numLayers);
+            return begins;
+        };
+        
+        auto fits = [&](int64_t capacity)
+        {
+            int numGroups = 1;
+            int64_t load = 0;
+            for (const Layer& layer : layers)
+            {
+                if (load > 0 && load + layer.numParameters() > capacity)
+                {
+                    numGroups++;
+                    load = 0;
+                }
+                load += layer.numParameters();
+            }
+            return numGroups <= numStages;
+        };
+        
+        int64_t low = 0;
+        int64_t high = 0;
+        for (const Layer& layer : layers)
+        {
+            low = std::max<int64_t>(low, layer.numParameters());
+            high += layer.numParameters();
+        }
+        while (low < high)
+        {
+            int64_t middle = (low + high) / 2;
+            if (fits(middle))
+            {
+                high = middle;
+            }
+            else
+            {
+                low = middle + 1;
+            }
+        }
+        
+        return split(low);
+    }
+    
+    // Order of one stage's steps over numMicroBatches micro-batches, true for a forward step.
+    // Forward and backward steps each go through the micro-batches in ascending order.
+    std::vector<bool> stageSchedule(PipelineSchedule schedule, int stage, int numStages, int numMicroBatches)
+    {
+        // GPipe runs every forward step first, 1F1B only as many as it takes to fill the stages after this one
+        int numWarmup = schedule == PipelineSchedule::GPipe ? numMicroBatches : std::min(numStages - 1 - stage, numMicroBatches);
+        
+        std::vector<bool> steps(numWarmup, true);
+        for (int micro = numWarmup; micro < numMicroBatches; micro++)
+        {
+            steps.push_back(true);
+            steps.push_back(false);
+        }
+        steps.resize(2 * numMicroBatches, false);
+        return steps;
+    }
+}
 
 Network::Network(std::vector<int> layerSizes, ActivationType activationType, CostType costType)
 : m_activationType(activationType), m_costType(costType)
 {
     m_layerSizes = layerSizes;
-
+    
     for (int i = 0; i < m_layerSizes.size() - 1; i++)
     {
-        m_layers.push_back(Layer(m_layerSizes[i], m_layerSizes[i + 1]));
+        m_layers.push_back(Layer(m_layerSizes[i], m_layerSizes[i + 1]));
+    }
+    
+    setNumThreads(0);
+}
+
+void Network::setNumThreads(int numThreads)
+{
+    m_threadPool = std::make_unique<ThreadPool>(numThreads);
+    m_workerData.resize(m_threadPool->size());
+}
+
+EvaluationResult Network::test()
+{
+    EvaluationResult result;
+    result.numSamples = m_data.size();
+    result.numClasses = m_layerSizes[m_layerSizes.size() - 1];
+    result.confusionMatrix.assign(result.numClasses * result.numClasses, 0);
+    
+    if (m_data.empty())
+    {
+        std::cerr << "[Network test] Invalid dataset";
+        return result;
+    }
+    
+    int numOutputs = result.numClasses;
+    
+    for (NetworkBatchData& workerData : m_workerData)
+    {
+        reserveWorkspace(workerData, kTestBatchSize, false);
+        workerData.numCorrect = 0;
+        workerData.loss = 0;
+        workerData.confusionMatrix.assign(result.confusionMatrix.size(), 0);
+    }
+    
+    auto start = std::chrono::steady_clock::now();
+    
+    m_threadPool->parallelFor(m_data.size(), kTestBatchSize, [&](int begin, int end, int worker)
+    {
+        NetworkBatchData& batchData = m_workerData[worker];
+        loadBatch(batchData, begin, end - begin);
+        
+        const float* outputs = inferencePass(batchData.inputRows, end - begin, batchData.layerData, sparseInputs(batchData));
+        const float* weightedInputs = batchData.layerData[m_layers.size() - 1].weightedInputs;
+        
+        for (int i = 0; i < end - begin; i++)
+        {
+            std::span<const float> output(&outputs[i * numOutputs], numOutputs);
+            std::span<const float> expected(&batchData.expectedOutputs[i * numOutputs], numOutputs);
+            
+            int prediction = maxValueIndex(output);
+            if (prediction == batchData.labels[i])
+            {
+                batchData.numCorrect += 1;
+            }
+            batchData.confusionMatrix[batchData.labels[i] * numOutputs + prediction] += 1;
+            
+            batchData.loss += Cost::getCost(output, std::span<const float>(&weightedInputs[i * numOutputs], numOutputs), expected, m_costType, ActivationType::Softmax);
+        }
+    });
+    
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    
+    double loss = 0;
+    for (const NetworkBatchData& workerData : m_workerData)
+    {
+        result.numCorrect += workerData.numCorrect;
+        loss += workerData.loss;
+        for (size_t i = 0; i < result.confusionMatrix.size(); i++)
+        {
+            result.confusionMatrix[i] += workerData.confusionMatrix[i];
+        }
+    }
+    
+    result.accuracy = result.numCorrect / (float) result.numSamples;
+    result.loss = (float) (loss / result.numSamples);
+    result.samplesPerSecond = result.numSamples / elapsed.count();
+    
+    return result;
+}
+
+void Network::train(int iterations, int miniBatchSize, float learnRate, float regularization, float momentum)
+{
+    if (m_data.empty())
+    {
+        std::cerr << "[Network train] Invalid dataset";
+        return;
+    }
+    
+    trainReplica(iterations, miniBatchSize, learnRate, regularization, momentum, nullptr);
+}
+
+void Network::trainDataParallel(Transport& transport, int iterations, int miniBatchSize, float learnRate, float regularization, float momentum)
+{
+    if (m_data.size() < transport.size())
+    {
+        std::cerr << "[Network trainDataParallel] Invalid dataset";
+        return;
+    }
+    
+    // Every replica starts from rank 0's weights
+    for (Layer& layer : m_layers)
+    {
+        std::vector<float> parameters(layer.parameters(), layer.parameters() + layer.numParameters());
+        transport.broadcast(parameters.data(), parameters.size() * sizeof(float));
+        layer.setParameters(parameters.data());
+    }
+    
+    trainReplica(iterations, miniBatchSize, learnRate, regularization, momentum, &transport);
+}
+
+void Network::trainMultiProcess(int numProcesses, int iterations, int miniBatchSize, float learnRate, float regularization, float momentum, TransportType transportType)
+{
+    if (numProcesses <= 1)
+    {
+        train(iterations, miniBatchSize, learnRate, regularization, momentum);
+        return;
+    }
+    
+    int numThreads = m_threadPool->size();
+    int threadsPerProcess = std::max(1, numThreads / numProcesses);
+    
+    // Created before forking so every process inherits the segment or knows every endpoint
+    std::unique_ptr<SharedMemoryTransport> sharedMemory;
+    std::vector<std::string> endpoints;
+    if (transportType == TransportType::SharedMemory)
+    {
+        sharedMemory = std::make_unique<SharedMemoryTransport>(numProcesses);
+    }
+    else
+    {
+        endpoints = TcpTransport::loopbackEndpoints(numProcesses);
+    }
+    
+    auto runReplica = [&](int rank)
+    {
+        if (sharedMemory)
+        {
+            sharedMemory->setRank(rank);
+            trainDataParallel(*sharedMemory, iterations, miniBatchSize, learnRate, regularization, momentum);
+        }
+        else
+        {
+            TcpTransport tcp(rank, endpoints);
+            trainDataParallel(tcp, iterations, miniBatchSize, learnRate, regularization, momentum);
+        }
+    };
+    
+    std::cout.flush();
+    std::cerr.flush();
+    
+    std::vector<pid_t> children;
+    for (int rank = 1; rank < numProcesses; rank++)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            int status = 0;
+            try
+            {
+                // The pool's threads were not forked along, leave it be and start a new one
+                m_threadPool.release();
+                setNumThreads(threadsPerProcess);
+                m_telemetry.disable();
+                
+                runReplica(rank);
+            }
+            catch (const std::exception& exception)
+            {
+                std::cerr << "[Network trainMultiProcess] Rank " << rank << ": " << exception.what() << std::endl;
+                if (sharedMemory)
+                {
+                    sharedMemory->abort();
+                }
+                status = 1;
+            }
+            std::cout.flush();
+            _exit(status);
+        }
+        
+        if (pid < 0)
+        {
+            break;
+        }
+        children.push_back(pid);
+    }
+    
+    bool failed = children.size() != numProcesses - 1;
+    std::string error = failed ? "Could not fork every worker process" : "";
+    
+    // Rank 0 would wait forever on a child that died, so it is watched from the side
+    std::vector<bool> exited(children.size(), false);
+    std::atomic<bool> finished = false;
+    std::atomic<bool> childFailed = false;
+    
+    auto reap = [&](int child, int options)
+    {
+        int status = 0;
+        if (!exited[child] && waitpid(children[child], &status, options) == children[child])
+        {
+            exited[child] = true;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            {
+                childFailed = true;
+                if (sharedMemory)
+                {
+                    sharedMemory->abort();
+                }
+            }
+        }
+    };
+    
+    std::thread watcher([&]()
+    {
+        while (!finished)
+        {
+            for (int child = 0; child < children.size(); child++)
+            {
+                reap(child, WNOHANG);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    });
+    
+    if (!failed)
+    {
+        setNumThreads(threadsPerProcess);
+        
+        try
+        {
+            runReplica(0);
+        }
+        catch (const std::exception& exception)
+        {
+            failed = true;
+            error = exception.what();
+        }
+    }
+    
+    if (failed && sharedMemory)
+    {
+        sharedMemory->abort();
+    }
+    
+    finished = true;
+    watcher.join();
+    
+    for (int child = 0; child < children.size(); child++)
+    {
+        reap(child, 0);
+    }
+    
+    setNumThreads(numThreads);
+    
+    if (failed || childFailed)
+    {
+        throw std::runtime_error("[Network trainMultiProcess] " + (error.empty() ? std::string("A worker process failed") : error));
+    }
+}
+
+void Network::trainReplica(int iterations, int miniBatchSize, float learnRate, float regularization, float momentum, Transport* transport)
+{
+    // int8 and sparse copies would go stale as soon as the weights move
+    clearQuantization();
+    clearCompression();
+    
+    int numReplicas = transport ? transport->size() : 1;
+    int rank = transport ? transport->rank() : 0;
+    
+    // Equal shards, so every replica takes the same number of steps. The whole-dataset default of train()
+    // arrives as INT_MAX, so the batch is clamped before it is rounded up.
+    int numSamples = m_data.size() / numReplicas;
+    int shardBegin = rank * numSamples;
+    miniBatchSize = std::min(miniBatchSize, m_data.size());
+    miniBatchSize = std::min((miniBatchSize + numReplicas - 1) / numReplicas, numSamples);
+    
+    // Each mini-batch is split into chunks that the pool runs forward and backward independently
+    int chunkSize = std::max(kMinChunkSize, (miniBatchSize + 2 * m_threadPool->size() - 1) / (2 * m_threadPool->size()));
+    m_chunkData.resize((miniBatchSize + chunkSize - 1) / chunkSize);
+    for (NetworkBatchData& data : m_chunkData)
+    {
+        reserveWorkspace(data, chunkSize, true);
+    }
+    
+    // The next shuffled, noisy mini-batch is gathered in the background while this one trains
+    BatchPipeline pipeline(m_data, miniBatchSize, iterations, kInputNoise, kShuffleSeed + rank, shardBegin, shardBegin + numSamples, m_sparseInputs);
+    
+    m_telemetry.begin(m_threadPool->size());
+    
+    int iteration = -1;
+    while (true)
+    {
+        const TrainingBatch* batch;
+        {
+            Telemetry::ScopedTimer timer(m_telemetry, 0, TelemetryPhase::DataFetch);
+            batch = pipeline.acquire();
+        }
+        if (batch == nullptr)
+        {
+            break;
+        }
+        
+        if (batch->epoch != iteration)
+        {
+            iteration = batch->epoch;
+            learnRate *= 0.8f;
+            m_numCorrect = 0;
+        }
+        
+        int batchSize = batch->batchSize;
+        int numChunks = (batchSize + chunkSize - 1) / chunkSize;
+        
+        m_threadPool->parallelFor(batchSize, chunkSize, [&](int begin, int end, int worker)
+        {
+            NetworkBatchData& data = m_chunkData[begin / chunkSize];
+            {
+                Telemetry::ScopedTimer timer(m_telemetry, worker, TelemetryPhase::DataFetch);
+                loadBatch(data, *batch, begin, end - begin);
+            }
+            backwardsPass(data, worker);
+        });
+        
+        int epoch = batch->epoch;
+        bool endOfEpoch = batch->endOfEpoch;
+        
+        pipeline.release();
+        
+        updateGradients(m_chunkData, numChunks, transport);
+        
+        // The gradients are summed over every replica's share of the mini-batch
+        applyGradients(OptimizerStep(m_optimizer, ++m_optimizerSteps, learnRate, batchSize * numReplicas, regularization, momentum));
+        
+        for (int chunk = 0; chunk < numChunks; chunk++)
+        {
+            m_numCorrect += m_chunkData[chunk].numCorrect;
+        }
+        
+        m_telemetry.endBatch(epoch, endOfEpoch);
+        
+        if (endOfEpoch && transport)
+        {
+            checkReplicas(*transport);
+        }
+        
+        // One line per epoch, printing every mini-batch serialized the training loop on stdout
+        if (endOfEpoch && rank == 0 && !m_telemetry.enabled())
+        {
+            std::cout << "[Epoch: " << epoch << "] " << m_numCorrect * 100.0f / numSamples << "%" << std::endl;
+        }
+    }
+}
+
+void Network::setOptimizer(const OptimizerSettings& settings)
+{
+    m_optimizer = settings;
+    m_optimizerSteps = 0;
+    
+    for (Layer& layer : m_layers)
+    {
+        layer.setOptimizer(settings.type);
+    }
+}
+
+void Network::applyGradients(const OptimizerStep& step)
+{
+    struct Block
+    {
+        int layer;
+        int begin;
+        int end;
+    };
+    std::vector<Block> blocks;
+    for (int layer = 0; layer < m_layers.size(); layer++)
+    {
+        int size = m_layers[layer].numParameters();
+        for (int begin = 0; begin < size; begin += kReduceBlockSize)
+        {
+            blocks.push_back({ layer, begin, std::min(begin + kReduceBlockSize, size) });
+        }
+    }
+    
+    m_threadPool->parallelFor((int) blocks.size(), 1, [&](int begin, int end, int worker)
+    {
+        Telemetry::ScopedTimer timer(m_telemetry, worker, TelemetryPhase::ApplyGradient);
+        for (int i = begin; i < end; i++)
+        {
+            m_layers[blocks[i].layer].applyGradient(step, blocks[i].begin, blocks[i].end);
+        }
+    });
+}
+
+void Network::checkReplicas(Transport& transport) const
+{
+    uint64_t checksum = 0;
+    for (const Layer& layer : m_layers)
+    {
+        checksum = checksum * 31 + MappedFile::checksum(reinterpret_cast<const unsigned char*>(layer.parameters()), layer.numParameters() * sizeof(float));
+    }
+    
+    uint64_t rootChecksum = checksum;
+    transport.broadcast(&rootChecksum, sizeof(rootChecksum));
+    
+    if (checksum != rootChecksum)
+    {
+        throw std::runtime_error("Replica " + std::to_string(transport.rank()) + " diverged from rank 0");
+    }
+}
+
+void Network::trainPipelined(int numStages, int numMicroBatches, int iterations, int miniBatchSize, float learnRate, float regularization, float momentum, PipelineSchedule schedule)
+{
+    if (m_data.empty())
+    {
+        std::cerr << "[Network trainPipelined] Invalid dataset";
+        return;
+    }
+    
+    clearQuantization();
+    clearCompression();
+    
+    int numLayers = (int) m_layers.size();
+    numStages = std::clamp(numStages, 1, numLayers);
+    
+    int numSamples = m_data.size();
+    miniBatchSize = std::min(miniBatchSize, numSamples);
+    numMicroBatches = std::clamp(numMicroBatches, 1, miniBatchSize);
+    int microBatchSize = (miniBatchSize + numMicroBatches - 1) / numMicroBatches;
+    
+    // One workspace per micro-batch, its buffers are handed from stage to stage instead of copied
+    m_chunkData.resize(numMicroBatches);
+    for (NetworkBatchData& data : m_chunkData)
+    {
+        reserveWorkspace(data, microBatchSize, true);
+    }
+    
+    std::vector<int> stageBegin = partitionLayers(m_layers, numStages);
+    
+    // forwardQueues[s] carries micro-batch indices from stage s to s + 1, backwardQueues[s] from s + 1 back to s.
+    // Each holds a whole mini-batch, so a stage never blocks on a push.
+    std::vector<std::unique_ptr<SpscQueue<int>>> forwardQueues;
+    std::vector<std::unique_ptr<SpscQueue<int>>> backwardQueues;
+    std::vector<std::unique_ptr<SpscQueue<PipelineStep>>> stepQueues;
+    std::vector<std::unique_ptr<SpscQueue<int>>> doneQueues; // number correct, from the output stage
+    for (int stage = 0; stage < numStages; stage++)
+    {
+        forwardQueues.push_back(std::make_unique<SpscQueue<int>>(numMicroBatches));
+        backwardQueues.push_back(std::make_unique<SpscQueue<int>>(numMicroBatches));
+        stepQueues.push_back(std::make_unique<SpscQueue<PipelineStep>>(1));
+        doneQueues.push_back(std::make_unique<SpscQueue<int>>(1));
+    }
+    
+    // Stage s is telemetry worker s, this thread the one after them
+    int coordinator = numStages;
+    m_telemetry.begin(numStages + 1);
+    
+    auto runStage = [&](int stage)
+    {
+        ThreadPool::pinCurrentThread(stage);
+        
+        int first = stageBegin[stage];
+        int last = stageBegin[stage + 1];
+        bool isInputStage = stage == 0;
+        bool isOutputStage = stage == numStages - 1;
+        
+        while (true)
+        {
+            PipelineStep step = stepQueues[stage]->pop();
+            if (step.batch == nullptr)
+            {
+                break;
+            }
+            
+            int batchSize = step.batch->batchSize;
+            int numMicro = (batchSize + microBatchSize - 1) / microBatchSize;
+            int nextForward = 0;
+            int nextBackward = 0;
+            int numCorrect = 0;
+            
+            for (bool isForward : stageSchedule(schedule, stage, numStages, numMicro))
+            {
+                if (isForward)
+                {
+                    int micro = isInputStage ? nextForward++ : forwardQueues[stage - 1]->pop();
+                    NetworkBatchData& data = m_chunkData[micro];
+                    
+                    if (isInputStage)
+                    {
+                        Telemetry::ScopedTimer timer(m_telemetry, stage, TelemetryPhase::DataFetch);
+                        int begin = micro * microBatchSize;
+                        loadBatch(data, *step.batch, begin, std::min(microBatchSize, batchSize - begin));
+                    }
+                    
+                    {
+                        Telemetry::ScopedTimer timer(m_telemetry, stage, TelemetryPhase::Forward);
+                        const float* inputs = isInputStage ? data.inputRows : data.layerData[first - 1].activations;
+                        for (int layer = first; layer < last; layer++)
+                        {
+                            ActivationType activationType = layer == numLayers - 1 ? ActivationType::Softmax : m_activationType;
+                            if (layer == 0 && sparseInputs(data))
+                            {
+                                inputs = m_layers[layer].CalculateOutputs(data.layerData[layer], inputs, data.sparseInputs, activationType);
+                            }
+                            else
+                            {
+                                inputs = m_layers[layer].CalculateOutputs(data.layerData[layer], inputs, data.batchSize, activationType);
+                            }
+                        }
+                    }
+                    
+                    if (!isOutputStage)
+                    {
+                        forwardQueues[stage]->push(micro);
+                    }
+                }
+                else
+                {
+                    int micro = isOutputStage ? nextBackward++ : backwardQueues[stage]->pop();
+                    NetworkBatchData& data = m_chunkData[micro];
+                    
+                    Telemetry::ScopedTimer timer(m_telemetry, stage, TelemetryPhase::Backward);
+                    
+                    // The next stage already multiplied its node values by its weights into this stage's last layer
+                    if (isOutputStage)
+                    {
+                        m_layers[last - 1].CalculateOutputLayerNodeValues(data.layerData[last - 1], data.expectedOutputs.data(), m_costType, ActivationType::Softmax);
+                    }
+                    else
+                    {
+                        m_layers[last - 1].applyActivationDerivative(data.layerData[last - 1], m_activationType);
+                    }
+                    m_layers[last - 1].updateGradients(data.layerData[last - 1], data.gradients[last - 1]);
+                    
+                    for (int layer = last - 2; layer >= first; layer--)
+                    {
+                        m_layers[layer].CalculateLayerNodeValues(data.layerData[layer], m_layers[layer + 1], data.layerData[layer + 1], m_activationType);
+                        m_layers[layer].updateGradients(data.layerData[layer], data.gradients[layer]);
+                    }
+                    
+                    // So the previous stage never reads this stage's weights
+                    if (!isInputStage)
+                    {
+                        m_layers[first].CalculateInputGradients(data.layerData[first], data.layerData[first - 1].nodeValues);
+                        backwardQueues[stage - 1]->push(micro);
+                    }
+                    
+                    if (isOutputStage)
+                    {
+                        scoreBatch(data, stage);
+                        numCorrect += data.numCorrect;
+                    }
+                }
+            }
+            
+            // Every stage updates its own layers once the whole mini-batch is through, summing the micro-batches in order
+            {
+                Telemetry::ScopedTimer timer(m_telemetry, stage, TelemetryPhase::Reduction);
+                for (int layer = first; layer < last; layer++)
+                {
+                    int size = m_layers[layer].numParameters();
+                    for (int micro = 1; micro < numMicro; micro++)
+                    {
+                        Kernels::axpy(1.0f, m_chunkData[micro].gradients[layer].values, m_chunkData[0].gradients[layer].values, size);
+                    }
+                    m_layers[layer].addGradients(m_chunkData[0].gradients[layer], 0, size);
+                }
+            }
+            {
+                Telemetry::ScopedTimer timer(m_telemetry, stage, TelemetryPhase::ApplyGradient);
+                for (int layer = first; layer < last; layer++)
+                {
+                    m_layers[layer].applyGradient(*step.optimizerStep);
+                }
+            }
+            
+            doneQueues[stage]->push(numCorrect);
+        }
+    };
+    
+    std::vector<std::thread> stages;
+    for (int stage = 0; stage < numStages; stage++)
+    {
+        stages.emplace_back(runStage, stage);
+    }
+    
+    BatchPipeline pipeline(m_data, miniBatchSize, iterations, kInputNoise, kShuffleSeed, 0, -1, m_sparseInputs);
+    
+    int iteration = -1;
+    while (true)
+    {
+        const TrainingBatch* batch;
+        {
+            Telemetry::ScopedTimer timer(m_telemetry, coordinator, TelemetryPhase::DataFetch);
+            batch = pipeline.acquire();
+        }
+        if (batch == nullptr)
+        {
+            break;
+        }
+        
+        if (batch->epoch != iteration)
+        {
+            iteration = batch->epoch;
+            learnRate *= 0.8f;
+            m_numCorrect = 0;
+        }
+        
+        OptimizerStep optimizerStep(m_optimizer, ++m_optimizerSteps, learnRate, batch->batchSize, regularization, momentum);
+        for (int stage = 0; stage < numStages; stage++)
+        {
+            stepQueues[stage]->push({ batch, &optimizerStep });
+        }
+        for (int stage = 0; stage < numStages; stage++)
+        {
+            m_numCorrect += doneQueues[stage]->pop();
+        }
+        
+        int epoch = batch->epoch;
+        bool endOfEpoch = batch->endOfEpoch;
+        
+        pipeline.release();
+        
+        m_telemetry.endBatch(epoch, endOfEpoch);
+        
+        if (endOfEpoch && !m_telemetry.enabled())
+        {
+            std::cout << "[Epoch: " << epoch << "] " << m_numCorrect * 100.0f / numSamples << "%" << std::endl;
+        }
+    }
+    
+    for (int stage = 0; stage < numStages; stage++)
+    {
+        stepQueues[stage]->push({ nullptr, nullptr });
+        stages[stage].join();
+    }
+}
+
+AsyncTrainingStats Network::trainAsync(int iterations, int miniBatchSize, float learnRate, float regularization, float momentum, int maxStaleness)
+{
+    AsyncTrainingStats stats;
+    
+    if (m_data.empty())
+    {
+        std::cerr << "[Network trainAsync] Invalid dataset";
+        return stats;
+    }
+    
+    clearQuantization();
+    clearCompression();
+    
+    // Re-rounding the bfloat16 copies or re-transposing the sparse input weights after every update would
+    // race with the workers reading them
+    bool mixedPrecision = m_mixedPrecision;
+    bool sparse = m_sparseInputs;
+    setMixedPrecision(false);
+    setSparseInputs(false);
+    
+    // The velocities are the only state a relaxed update can keep consistent
+    OptimizerSettings optimizer = m_optimizer;
+    if (optimizer.type != OptimizerType::Momentum)
+    {
+        setOptimizer(OptimizerSettings());
+    }
+    
+    int numSamples = m_data.size();
+    miniBatchSize = std::min(miniBatchSize, numSamples);
+    int stepsPerEpoch = (numSamples + miniBatchSize - 1) / miniBatchSize;
+    int64_t numSteps = (int64_t) stepsPerEpoch * iterations;
+    
+    // Every epoch's order is shuffled up front so no worker ever waits for it
+    std::vector<int> order((size_t) numSamples * iterations);
+    std::mt19937 shuffleGenerator(kShuffleSeed);
+    for (int epoch = 0; epoch < iterations; epoch++)
+    {
+        auto epochOrder = order.begin() + (size_t) epoch * numSamples;
+        std::iota(epochOrder, epochOrder + numSamples, 0);
+        std::shuffle(epochOrder, epochOrder + numSamples, shuffleGenerator);
+    }
+    
+    for (NetworkBatchData& workerData : m_workerData)
+    {
+        reserveWorkspace(workerData, miniBatchSize, true);
+    }
+    
+    int numWorkers = m_threadPool->size();
+    
+    std::atomic<int64_t> nextStep = 0;
+    std::atomic<int64_t> numApplied = 0;
+    std::atomic<int64_t> totalStaleness = 0;
+    std::atomic<int> maxObservedStaleness = 0;
+    std::vector<std::atomic<int>> epochCorrect(iterations);
+    
+    m_telemetry.begin(numWorkers);
+    
+    auto start = std::chrono::steady_clock::now();
+    
+    // One long running loop per worker, each claiming the next step until none are left
+    m_threadPool->parallelFor(numWorkers, 1, [&](int begin, int, int worker)
+    {
+        NetworkBatchData& data = m_workerData[worker];
+        std::mt19937 generator(kShuffleSeed + 1 + begin);
+        bool reporter = begin == 0;
+        
+        while (true)
+        {
+            int64_t step = nextStep.fetch_add(1, std::memory_order_relaxed);
+            if (step >= numSteps)
+            {
+                break;
+            }
+            
+            int64_t applied = numApplied.load(std::memory_order_acquire);
+            while (maxStaleness >= 0 && applied < step - maxStaleness)
+            {
+                std::this_thread::yield();
+                applied = numApplied.load(std::memory_order_acquire);
+            }
+            int staleness = (int) std::max<int64_t>(0, step - applied);
+            
+            int epoch = (int) (step / stepsPerEpoch);
+            int batchStart = (int) (step % stepsPerEpoch) * miniBatchSize;
+            int batchSize = std::min(miniBatchSize, numSamples - batchStart);
+            
+            {
+                Telemetry::ScopedTimer timer(m_telemetry, worker, TelemetryPhase::DataFetch);
+                loadBatch(data, &order[(size_t) epoch * numSamples + batchStart], batchSize, generator);
+            }
+            backwardsPass(data, worker);
+            
+            {
+                // Same per epoch decay as train()
+                float epochLearnRate = learnRate * std::pow(0.8f, (float) (epoch + 1));
+                
+                Telemetry::ScopedTimer timer(m_telemetry, worker, TelemetryPhase::ApplyGradient);
+                for (int j = 0; j < m_layers.size(); j++)
+                {
+                    m_layers[j].applyGradientRelaxed(data.gradients[j], epochLearnRate / batchSize, regularization, momentum);
+                }
+            }
+            numApplied.fetch_add(1, std::memory_order_release);
+            
+            epochCorrect[epoch].fetch_add(data.numCorrect, std::memory_order_relaxed);
+            totalStaleness.fetch_add(staleness, std::memory_order_relaxed);
+            int observed = maxObservedStaleness.load(std::memory_order_relaxed);
+            while (staleness > observed && !maxObservedStaleness.compare_exchange_weak(observed, staleness, std::memory_order_relaxed))
+            {
+            }
+            
+            // Steps are claimed roughly round robin, so this is about the reporter's last one of the epoch
+            if (reporter)
+            {
+                m_telemetry.endBatch(epoch, step + numWorkers >= (int64_t) (epoch + 1) * stepsPerEpoch);
+            }
+        }
+    });
+    
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    stats.numUpdates = numSteps;
+    stats.samplesPerSecond = (double) numSamples * iterations / stats.seconds;
+    stats.meanStaleness = numSteps > 0 ? totalStaleness.load() / (double) numSteps : 0;
+    stats.maxStaleness = maxObservedStaleness.load();
+    
+    for (int epoch = 0; epoch < iterations; epoch++)
+    {
+        stats.epochAccuracy.push_back(epochCorrect[epoch].load() / (float) numSamples);
+        
+        if (!m_telemetry.enabled())
+        {
+            std::cout << "[Epoch: " << epoch << "] " << stats.epochAccuracy[epoch] * 100.0f << "%" << std::endl;
+        }
+    }
+    
+    setMixedPrecision(mixedPrecision);
+    setSparseInputs(sparse);
+    
+    if (optimizer.type != OptimizerType::Momentum)
+    {
+        setOptimizer(optimizer);
     }
+    
+    return stats;
 }
 
-float Network::test()
+void Network::backwardsPass(NetworkBatchData& batchData, int worker)
 {
-    float accuracy = 0;
-    int numCorrect = 0;
-    
-    for (int i = 0; i < m_dataSize; i++)
     {
-        std::vector<float> inputs(m_data[i].begin() + 1, m_data[i].end());
-        int output = maxValueIndex(forwardPass(inputs));
-        if (output == m_data[i][0])
-        {
-            numCorrect += 1;
-        }
+        Telemetry::ScopedTimer timer(m_telemetry, worker, TelemetryPhase::Forward);
+        forwardPass(batchData.inputRows, batchData.batchSize, batchData.layerData, sparseInputs(batchData));
     }
     
-    accuracy = numCorrect / (float) m_dataSize;
+    Telemetry::ScopedTimer timer(m_telemetry, worker, TelemetryPhase::Backward);
     
-    std::cout << numCorrect << "/" << m_dataSize << std::endl;
+    // -- Backpropagation --
+    // Output layer node values and gradients
+    size_t outputLayer = m_layers.size() - 1;
+    m_layers[outputLayer].CalculateOutputLayerNodeValues(batchData.layerData[outputLayer], batchData.expectedOutputs.data(), m_costType, ActivationType::Softmax);
+    m_layers[outputLayer].updateGradients(batchData.layerData[outputLayer], batchData.gradients[outputLayer]);
     
-    std::cout << accuracy * 100.0f << "%" << std::endl;
+    // All hidden layer node values
+    for (int index = (int) m_layers.size() - 2; index >= 0; index--)
+    {
+        m_layers[index].CalculateLayerNodeValues(batchData.layerData[index], m_layers[index + 1], batchData.layerData[index + 1], m_activationType);
+        m_layers[index].updateGradients(batchData.layerData[index], batchData.gradients[index]);
+    }
     
-    return accuracy;
+    scoreBatch(batchData, worker);
 }
 
-void Network::train(int iterations, int miniBatchSize, float learnRate, float regularization, float momentum)
+void Network::scoreBatch(NetworkBatchData& batchData, int worker)
 {
-    if (m_data.size() == 0)
+    int batchSize = batchData.batchSize;
+    size_t outputLayer = m_layers.size() - 1;
+    const float* outputs = batchData.layerData[outputLayer].activations;
+    
+    int numOutputs = m_layerSizes[m_layerSizes.size() - 1];
+    batchData.numCorrect = 0;
+    for (int i = 0; i < batchSize; i++)
     {
-        std::cerr << "[Network train] Invalid dataset";
-        return;
+        if (maxValueIndex(std::span<const float>(&outputs[i * numOutputs], numOutputs)) == batchData.labels[i])
+        {
+            batchData.numCorrect += 1;
+        }
     }
+    
+    // The loss is only needed for the telemetry counters
+    if (m_telemetry.enabled())
+    {
+        const float* weightedInputs = batchData.layerData[outputLayer].weightedInputs;
         
-    for (int iteration = 0; iteration < iterations; iteration++)
+        batchData.loss = 0;
+        for (int i = 0; i < batchSize; i++)
+        {
+            std::span<const float> expected(&batchData.expectedOutputs[i * numOutputs], numOutputs);
+            batchData.loss += Cost::getCost(std::span<const float>(&outputs[i * numOutputs], numOutputs), std::span<const float>(&weightedInputs[i * numOutputs], numOutputs), expected, m_costType, ActivationType::Softmax);
+        }
+        
+        m_telemetry.addSamples(worker, batchSize, batchData.numCorrect, batchData.loss);
+    }
+}
+
+void Network::updateGradients(std::vector<NetworkBatchData>& chunkData, int numChunks, Transport* transport)
+{
+    // A reduction task adds one block of one layer's gradients from chunk src into chunk dst
+    struct ReduceTask
+    {
+        int dst;
+        int src;
+        int layer;
+        int begin;
+        int end;
+    };
+    std::vector<ReduceTask> tasks;
+    
+    auto addBlocks = [&](int dst, int src)
     {
-        learnRate *= 0.8f;
-        for (int batch = 0; batch < m_data.size(); batch += miniBatchSize)
+        for (int layer = 0; layer < m_layers.size(); layer++)
         {
-            m_numCorrect = 0;
-            
-            std::vector<std::thread> thread_group;
-            thread_group.reserve(miniBatchSize);
-            
-            for (int i = 0; i < miniBatchSize; i++)
+            int size = m_layers[layer].numParameters();
+            for (int begin = 0; begin < size; begin += kReduceBlockSize)
             {
-                //std::future<void> EventualValue = std::async(std::launch::async, [this, &learnData, i, batch](){ this->updateGradients(learnData, batch + i); });
-                thread_group.emplace_back([this, i, batch](){ this->updateGradients(batch + i); });
-                //updateGradients(batch + i);
+                tasks.push_back({ dst, src, layer, begin, std::min(begin + kReduceBlockSize, size) });
             }
-            
-            for (auto& thread : thread_group)
-            {
-                thread.join();
-            }
-            
-            for (int j = 0; j < m_layers.size(); j++)
+        }
+    };
+    
+    // Pairwise tree over the chunks, always in the same order so the sum is deterministic
+    for (int stride = 1; stride < numChunks; stride *= 2)
+    {
+        tasks.clear();
+        for (int dst = 0; dst + stride < numChunks; dst += 2 * stride)
+        {
+            addBlocks(dst, dst + stride);
+        }
+        
+        m_threadPool->parallelFor((int) tasks.size(), 1, [&](int begin, int end, int worker)
+        {
+            Telemetry::ScopedTimer timer(m_telemetry, worker, TelemetryPhase::Reduction);
+            for (int i = begin; i < end; i++)
             {
-                m_layers[j].applyGradient(learnRate / miniBatchSize, regularization, momentum);
+                const ReduceTask& task = tasks[i];
+                float* dst = chunkData[task.dst].gradients[task.layer].values;
+                const float* src = chunkData[task.src].gradients[task.layer].values;
+                Kernels::axpy(1.0f, src + task.begin, dst + task.begin, task.end - task.begin);
             }
-            
-            float accuracy = m_numCorrect / (float) miniBatchSize;
-            
-            //std::cout << numCorrect << "/" << miniBatchSize << std::endl;
-            
-            std::cout << "[Epoch: " << iteration << "] " << accuracy * 100.0f << "%" << std::endl;
+        });
+    }
+    
+    // The other replicas' sums, identical on every replica afterwards
+    if (transport)
+    {
+        Telemetry::ScopedTimer timer(m_telemetry, 0, TelemetryPhase::Reduction);
+        for (int layer = 0; layer < m_layers.size(); layer++)
+        {
+            transport->allreduceSum(chunkData[0].gradients[layer].values, m_layers[layer].numParameters());
         }
     }
+    
+    // The root of the tree goes into the layers
+    tasks.clear();
+    addBlocks(0, 0);
+    m_threadPool->parallelFor((int) tasks.size(), 1, [&](int begin, int end, int worker)
+    {
+        Telemetry::ScopedTimer timer(m_telemetry, worker, TelemetryPhase::Reduction);
+        for (int i = begin; i < end; i++)
+        {
+            const ReduceTask& task = tasks[i];
+            m_layers[task.layer].addGradients(chunkData[0].gradients[task.layer], task.begin, task.end);
+        }
+    });
 }
 
-void Network::updateGradients(int batch)
+void Network::loadBatch(NetworkBatchData& batchData, int batchStart, int batchSize)
 {
-    std::vector<LayerLearnData> learnData(m_layers.size());
+    int numInputs = m_layerSizes[0];
     
-    for (int layer = 0; layer < m_layers.size(); layer++)
+    batchData.batchSize = batchSize;
+    batchData.labels.assign(m_data.labels() + batchStart, m_data.labels() + batchStart + batchSize);
+    
+    // Float32 rows are already a batchSize x numInputs matrix inside the dataset
+    batchData.inputRows = m_data.floatRows(batchStart);
+    if (batchData.inputRows == nullptr)
     {
-        learnData[layer].inputs.resize(m_layerSizes[layer]);
-        learnData[layer].weightedInputs.resize(m_layerSizes[layer + 1]);
-        learnData[layer].activations.resize(m_layerSizes[layer + 1]);
-        learnData[layer].nodeValues.resize(m_layerSizes[layer + 1]);
+        batchData.inputs.resize(batchSize * numInputs);
+        m_data.copyRows(batchStart, batchSize, batchData.inputs.data());
+        batchData.inputRows = batchData.inputs.data();
     }
     
-    std::mutex mtx;
-    
-    //std::vector<float> data = m_data[batch];
+    setExpectedOutputs(batchData);
+    compressInputs(batchData);
+}
+
+void Network::loadBatch(NetworkBatchData& batchData, const TrainingBatch& batch, int begin, int count)
+{
+    batchData.batchSize = count;
+    batchData.labels.assign(batch.labels.begin() + begin, batch.labels.begin() + begin + count);
+    batchData.inputRows = &batch.inputs[(size_t) begin * m_layerSizes[0]];
     
-    std::vector<float> inputs(m_data[batch].begin() + 1, m_data[batch].end());
-    std::vector<float> outputs = forwardPass(inputs, learnData);
+    setExpectedOutputs(batchData);
+    compressInputs(batchData);
+}
+
+void Network::loadBatch(NetworkBatchData& batchData, const int* samples, int count, std::mt19937& generator)
+{
+    int numInputs = m_layerSizes[0];
+    std::normal_distribution<float> distribution(0.0f, kInputNoise);
     
-    // -- Backpropagation --
-    // Update output layer gradients
-    std::vector<float> expectedOutputs(m_layerSizes[m_layerSizes.size() - 1]);
-    expectedOutputs[m_data[batch][0]] = 1.0f;
+    batchData.batchSize = count;
+    batchData.labels.resize(count);
+    batchData.inputs.resize((size_t) count * numInputs);
     
-    m_layers[m_layers.size() - 1].CalculateOutputLayerNodeValues(learnData[learnData.size() - 1], expectedOutputs, m_costType);
-    m_layers[m_layers.size() - 1].updateGradients(learnData[learnData.size() - 1]);
+    for (int i = 0; i < count; i++)
+    {
+        float* row = &batchData.inputs[(size_t) i * numInputs];
+        
+        m_data.copyRows(samples[i], 1, row);
+        batchData.labels[i] = m_data.label(samples[i]);
+        
+        for (int input = 0; input < numInputs; input++)
+        {
+            if (!m_sparseInputs || row[input] != 0.0f)
+            {
+                row[input] += distribution(generator);
+            }
+        }
+    }
+    batchData.inputRows = batchData.inputs.data();
     
-    // Update all hidden layer gradients
-    for (int index = m_layers.size() - 2; index >= 0; index--)
+    setExpectedOutputs(batchData);
+    compressInputs(batchData);
+}
+
+void Network::compressInputs(NetworkBatchData& batchData)
+{
+    batchData.useSparseInputs = false;
+    if (!m_sparseInputs)
     {
-        m_layers[index].CalculateLayerNodeValues(learnData[index], m_layers[index + 1], learnData[index + 1].nodeValues,    m_activationType);
-        m_layers[index].updateGradients(learnData[index]);
+        return;
     }
     
-    if (maxValueIndex(outputs) == m_data[batch][0])
+    batchData.sparseInputs.assign(batchData.inputRows, batchData.batchSize, m_layerSizes[0]);
+    batchData.useSparseInputs = batchData.sparseInputs.density() <= kMaxSparseDensity;
+}
+
+void Network::setExpectedOutputs(NetworkBatchData& batchData)
+{
+    int numOutputs = m_layerSizes[m_layerSizes.size() - 1];
+    
+    batchData.expectedOutputs.assign(batchData.batchSize * numOutputs, 0.0f);
+    for (int i = 0; i < batchData.batchSize; i++)
     {
-        mtx.lock();
-        m_numCorrect += 1;
-        mtx.unlock();
+        // Dataset checks every label when it is loaded
+        assert(batchData.labels[i] >= 0 && batchData.labels[i] < numOutputs);
+        batchData.expectedOutputs[i * numOutputs + batchData.labels[i]] = 1.0f;
     }
 }
 
-std::vector<float> Network::forwardPass(std::vector<float> inputs)
+std::vector<float> Network::forwardPass(const std::vector<float>& inputs)
 {
-    for (int i = 0; i < m_layers.size() - 1; i++)
+    std::span<const float> outputs = forwardPass(std::span<const float>(inputs));
+    
+    return std::vector<float>(outputs.begin(), outputs.end());
+}
+
+std::span<const float> Network::forwardPass(std::span<const float> inputs, InferenceWorkspace& workspace) const
+{
+    size_t maxLayerSize = *std::max_element(m_layerSizes.begin() + 1, m_layerSizes.end());
+    for (AlignedVector<float>& buffer : workspace.buffers)
+    {
+        if (buffer.size() < maxLayerSize)
+        {
+            buffer.resize(maxLayerSize);
+        }
+    }
+    
+    for (int i = 0; i < m_layers.size(); i++)
     {
-        inputs = m_layers[i].CalculateOutputs(inputs, m_activationType);
+        std::span<float> outputs(workspace.buffers[i % 2].data(), m_layerSizes[i + 1]);
+        ActivationType activationType = i == m_layers.size() - 1 ? ActivationType::Softmax : m_activationType;
+        
+        if (isQuantized())
+        {
+            m_quantizedLayers[i].CalculateOutputs(inputs, outputs, activationType);
+        }
+        else if (isCompressed())
+        {
+            m_sparseLayers[i].CalculateOutputs(inputs, outputs, activationType);
+        }
+        else
+        {
+            m_layers[i].CalculateOutputs(inputs, outputs, activationType);
+        }
+        
+        inputs = outputs;
     }
     
-    std::vector<float> output = m_layers[m_layers.size() - 1].CalculateOutputs(inputs, ActivationType::Softmax);
+    return inputs;
+}
+
+std::span<const float> Network::forwardPass(std::span<const float> inputs) const
+{
+    thread_local InferenceWorkspace workspace;
     
-    return output;
+    return forwardPass(inputs, workspace);
 }
 
-std::vector<float> Network::forwardPass(std::vector<float> inputs, std::vector<LayerLearnData>& layerData)
+const std::vector<float>& Network::forwardPass(std::span<const float> inputs, std::vector<LayerLearnData>& layerData)
 {
+    layerData.resize(m_layers.size());
+    
     for (int i = 0; i < m_layers.size() - 1; i++)
     {
         inputs = m_layers[i].CalculateOutputs(layerData[i], inputs, m_activationType);
     }
     
-    std::vector<float> output = m_layers[m_layers.size() - 1].CalculateOutputs(layerData[m_layers.size() - 1], inputs, ActivationType::Softmax);
-    
-    return output;
+    return m_layers[m_layers.size() - 1].CalculateOutputs(layerData[m_layers.size() - 1], inputs, ActivationType::Softmax);
 }
 
-void Network::initRandomWeights()
+const float* Network::forwardPass(const float* inputs, int batchSize, std::vector<LayerBatchData>& layerData, const SparseRows* sparseInputs)
 {
-    for (Layer& layer : m_layers)
+    for (int i = 0; i < m_layers.size(); i++)
     {
-        layer.initRandomWeights();
+        ActivationType activationType = i == m_layers.size() - 1 ? ActivationType::Softmax : m_activationType;
+        if (i == 0 && sparseInputs)
+        {
+            inputs = m_layers[i].CalculateOutputs(layerData[i], inputs, *sparseInputs, activationType);
+        }
+        else
+        {
+            inputs = m_layers[i].CalculateOutputs(layerData[i], inputs, batchSize, activationType);
+        }
     }
+    
+    return inputs;
 }
 
-void Network::loadWeights(std::string filePath)
+void Network::forwardPass(const float* inputs, int batchSize, float* outputs)
 {
+    int numInputs = m_layerSizes[0];
+    int numOutputs = m_layerSizes[m_layerSizes.size() - 1];
+    
+    for (NetworkBatchData& workerData : m_workerData)
+    {
+        reserveWorkspace(workerData, kTestBatchSize, false);
+    }
     
+    m_threadPool->parallelFor(batchSize, kTestBatchSize, [&](int begin, int end, int worker)
+    {
+        const float* result = inferencePass(inputs + begin * numInputs, end - begin, m_workerData[worker].layerData);
+        std::copy(result, result + (end - begin) * numOutputs, outputs + begin * numOutputs);
+    });
 }
 
-void saveWeights(std::string filePath)
+const float* Network::inferencePass(const float* inputs, int batchSize, std::vector<LayerBatchData>& layerData, const SparseRows* sparseInputs)
 {
+    if (isCompressed())
+    {
+        for (int i = 0; i < m_sparseLayers.size(); i++)
+        {
+            ActivationType activationType = i == m_sparseLayers.size() - 1 ? ActivationType::Softmax : m_activationType;
+            inputs = m_sparseLayers[i].CalculateOutputs(layerData[i], inputs, batchSize, activationType);
+        }
+        return inputs;
+    }
+    
+    if (!isQuantized())
+    {
+        return forwardPass(inputs, batchSize, layerData, sparseInputs);
+    }
+    
+    for (int i = 0; i < m_quantizedLayers.size() - 1; i++)
+    {
+        inputs = m_quantizedLayers[i].CalculateOutputs(layerData[i], inputs, batchSize, m_activationType);
+    }
     
+    return m_quantizedLayers[m_quantizedLayers.size() - 1].CalculateOutputs(layerData[m_quantizedLayers.size() - 1], inputs, batchSize, ActivationType::Softmax);
 }
 
-void Network::loadData(std::string filePath, int numInputs, int dataSize)
+void Network::quantize(int numSamples)
 {
-    m_dataSize = dataSize;
-    m_numInputs = numInputs;
+    if (m_data.empty())
+    {
+        std::cerr << "[Network quantize] Invalid dataset";
+        return;
+    }
+    
+    clearQuantization();
+    clearCompression();
+    
+    int numInputs = m_layerSizes[0];
+    numSamples = std::min(numSamples, m_data.size());
+    
+    // Evenly spaced samples, so a dataset sorted by label still calibrates on every class
+    std::vector<float> samples((size_t) numSamples * numInputs);
+    for (int i = 0; i < numSamples; i++)
+    {
+        m_data.copyRows((int) ((long long) i * m_data.size() / numSamples), 1, &samples[(size_t) i * numInputs]);
+    }
     
-    m_data.resize(m_dataSize);
+    // Largest |input| each layer sees, the inputs of layer i > 0 are the activations of layer i - 1
+    std::vector<float> maxInputs(m_layers.size(), 0.0f);
     
-    if (m_numInputs != m_layerSizes[0])
+    NetworkBatchData& batchData = m_workerData[0];
+    reserveWorkspace(batchData, kTestBatchSize, false);
+    
+    for (int begin = 0; begin < numSamples; begin += kTestBatchSize)
     {
-        std::cerr << "Input layer resized to " << m_numInputs << " from " << m_layerSizes[0] << std::endl;
+        int batchSize = std::min(kTestBatchSize, numSamples - begin);
+        forwardPass(&samples[(size_t) begin * numInputs], batchSize, batchData.layerData);
         
-        m_layers.clear();
-        m_layers.push_back(Layer(m_numInputs, m_layerSizes[1]));
-        for (int i = 1; i < m_layers.size(); i++)
+        for (int i = 0; i < m_layers.size(); i++)
         {
-            m_layers.push_back(Layer(m_layerSizes[i], m_layerSizes[i + 1]));
+            const float* inputs = batchData.layerData[i].inputs;
+            for (size_t j = 0; j < (size_t) batchSize * m_layerSizes[i]; j++)
+            {
+                maxInputs[i] = std::max(maxInputs[i], std::abs(inputs[j]));
+            }
         }
+    }
+    
+    for (int i = 0; i < m_layers.size(); i++)
+    {
+        m_quantizedLayers.push_back(QuantizedLayer(m_layers[i], maxInputs[i]));
+    }
+}
+
+void Network::setMixedPrecision(bool enabled)
+{
+    m_mixedPrecision = enabled;
+    
+    for (Layer& layer : m_layers)
+    {
+        layer.setMixedPrecision(enabled);
+    }
+}
+
+void Network::setSparseInputs(bool enabled)
+{
+    m_sparseInputs = enabled;
+    
+    // Only the first layer sees raw pixels
+    m_layers[0].setSparseInputs(enabled);
+}
+
+void Network::clearQuantization()
+{
+    m_quantizedLayers.clear();
+}
 
-        m_layerSizes[0] = m_numInputs;
+void Network::prune(float sparsity)
+{
+    clearQuantization();
+    clearCompression();
+    
+    for (Layer& layer : m_layers)
+    {
+        layer.prune(sparsity);
+    }
+}
+
+float Network::weightSparsity() const
+{
+    int64_t numWeights = 0;
+    int64_t numNonZero = 0;
+    for (const Layer& layer : m_layers)
+    {
+        numWeights += (int64_t) layer.numNodesIn() * layer.numNodesOut();
+        numNonZero += layer.numNonZeroWeights();
     }
+    return 1.0f - (float) ((double) numNonZero / numWeights);
+}
+
+void Network::compress()
+{
+    clearQuantization();
+    clearCompression();
     
-    std::string contents;
+    for (const Layer& layer : m_layers)
+    {
+        m_sparseLayers.push_back(SparseLayer(layer));
+    }
+}
+
+void Network::clearCompression()
+{
+    m_sparseLayers.clear();
+}
+
+size_t Network::parameterBytes() const
+{
+    size_t bytes = 0;
+    if (isQuantized())
+    {
+        for (const QuantizedLayer& layer : m_quantizedLayers)
+        {
+            bytes += layer.sizeInBytes();
+        }
+    }
+    else if (isCompressed())
+    {
+        for (const SparseLayer& layer : m_sparseLayers)
+        {
+            bytes += layer.sizeInBytes();
+        }
+    }
+    else
+    {
+        for (const Layer& layer : m_layers)
+        {
+            bytes += layer.numParameters() * sizeof(float);
+        }
+    }
+    return bytes;
+}
+
+void Network::reserveWorkspace(NetworkBatchData& batchData, int capacity, bool withGradients)
+{
+    size_t size = 0;
+    for (const Layer& layer : m_layers)
     {
-        std::fstream file(filePath, std::ios::in);
-        std::stringstream contents_stream;
-        contents_stream << file.rdbuf();
-        file.close();
-        contents = contents_stream.str();
+        size += layer.batchDataSize(capacity) + (withGradients ? layer.gradientsSize() : 0);
     }
     
-    size_t index = 0;
-    int i = 0;
-    int input = 0;
-    std::string buf;
+    if (batchData.arena.size() < size)
+    {
+        batchData.arena.resize(size);
+    }
     
-    std::default_random_engine generator;
-    std::normal_distribution<float> distribution(0.0f, 0.001f);
+    batchData.layerData.resize(m_layers.size());
+    batchData.gradients.resize(withGradients ? m_layers.size() : 0);
     
-    while (index < contents.length() && i <= m_dataSize)
+    float* arena = batchData.arena.data();
+    for (int i = 0; i < m_layers.size(); i++)
     {
-        if (contents.at(index) == ',' || contents.at(index) == '\r')
+        arena = m_layers[i].bindBatchData(batchData.layerData[i], arena, capacity);
+        if (withGradients)
         {
-            if (i > 0)
-            {
-                if (input != 0)
-                    m_data[i - 1].push_back(distribution(generator) + std::stof(buf) / 255.0f); //noise
-                else
-                    m_data[i - 1].push_back(std::stof(buf));
+            arena = m_layers[i].bindGradients(batchData.gradients[i], arena);
+        }
+    }
+}
 
-            }
-            
-            buf.clear();
-            input++;
-            if (input == m_numInputs + 1)
-            {
-                input = 0;
-                i++;
-            }
+void Network::initRandomWeights()
+{
+    for (Layer& layer : m_layers)
+    {
+        layer.initRandomWeights();
+    }
+}
+
+void Network::loadWeights(std::string filePath)
+{
+    ModelFile model = ModelFile::read(filePath);
+    
+    if (model.layerSizes != m_layerSizes)
+    {
+        std::cerr << "[Network loadWeights] Layers resized to match " << filePath << std::endl;
+        
+        m_layerSizes = model.layerSizes;
+        m_layers.clear();
+        for (int i = 0; i < m_layerSizes.size() - 1; i++)
+        {
+            m_layers.push_back(Layer(m_layerSizes[i], m_layerSizes[i + 1]));
         }
-        else
+        setMixedPrecision(m_mixedPrecision);
+        setSparseInputs(m_sparseInputs);
+        
+        // New layers start with momentum sized state, and Adam's bias correction restarts with them
+        setOptimizer(m_optimizer);
+    }
+    
+    m_activationType = model.activationType;
+    m_costType = model.costType;
+    
+    clearQuantization();
+    clearCompression();
+    
+    if (!model.sparse)
+    {
+        for (int i = 0; i < m_layers.size(); i++)
         {
-            buf.push_back(contents.at(index));
+            m_layers[i].aliasParameters(model.file, model.layerParameters(i));
         }
-        index++;
+        return;
+    }
+    
+    // Nothing to alias, the zeros are filled back in and stay pruned if the weights are fine-tuned
+    std::vector<float> parameters;
+    for (int i = 0; i < m_layers.size(); i++)
+    {
+        parameters.resize(m_layers[i].numParameters());
+        model.expandLayerParameters(i, parameters.data());
+        m_layers[i].setParameters(parameters.data());
+        m_layers[i].fixZeroWeights();
+    }
+    
+    compress();
+}
+
+void Network::saveWeights(std::string filePath, bool sparse)
+{
+    std::vector<const float*> layerParameters;
+    for (const Layer& layer : m_layers)
+    {
+        layerParameters.push_back(layer.parameters());
+    }
+    
+    ModelFile::write(filePath, m_layerSizes, m_activationType, m_costType, layerParameters, sparse);
+}
+
+void Network::loadData(std::string filePath, int numInputs, int dataSize, PixelFormat format)
+{
+    if (numInputs != m_layerSizes[0])
+    {
+        std::cerr << "Input layer resized to " << numInputs << " from " << m_layerSizes[0] << std::endl;
+        
+        m_layerSizes[0] = numInputs;
+        m_layers[0] = Layer(m_layerSizes[0], m_layerSizes[1]);
+        m_layers[0].setMixedPrecision(m_mixedPrecision);
+        m_layers[0].setSparseInputs(m_sparseInputs);
+        setOptimizer(m_optimizer);
+    }
+    
+    m_data.loadCsv(filePath, numInputs, m_layerSizes[m_layerSizes.size() - 1], dataSize, format, m_threadPool.get());
+}
+
+void Network::loadDataset(std::string filePath)
+{
+    m_data.load(filePath, m_layerSizes[m_layerSizes.size() - 1]);
+    
+    if (m_data.numInputs() != m_layerSizes[0])
+    {
+        std::cerr << "Input layer resized to " << m_data.numInputs() << " from " << m_layerSizes[0] << std::endl;
+        
+        m_layerSizes[0] = m_data.numInputs();
+        m_layers[0] = Layer(m_layerSizes[0], m_layerSizes[1]);
+        m_layers[0].setMixedPrecision(m_mixedPrecision);
+        m_layers[0].setSparseInputs(m_sparseInputs);
+        setOptimizer(m_optimizer);
     }
 }
 
 void Network::clearData()
 {
     m_data.clear();
-    m_dataSize = 0;
 }
 
-int Network::maxValueIndex(std::vector<float> values)
+int Network::maxValueIndex(std::span<const float> values)
 {
     float maxValue = values[0];
     int index = 0;
@@ -264,6 +1526,6 @@ int Network::maxValueIndex(std::vector<float> values)
             index = i;
         }
     }
-
+    
     return index;
 }
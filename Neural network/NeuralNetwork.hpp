@@ -8,7 +8,85 @@
 #pragma once
 
 #include "Layer.hpp"
+#include "QuantizedLayer.hpp"
+#include "SparseLayer.hpp"
+#include "Dataset.hpp"
+#include "BatchPipeline.hpp"
+#include "ThreadPool.hpp"
+#include "Telemetry.hpp"
+#include "Transport.hpp"
 #include <vector>
+#include <string>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <span>
+
+// Inputs, labels and per-layer buffers for one mini-batch
+struct NetworkBatchData
+{
+    int batchSize = 0;
+    
+    const float* inputRows = nullptr; // batchSize x numInputs, points into the dataset or at inputs
+    std::vector<float> inputs; // staging for datasets that aren't stored as Float32
+    SparseRows sparseInputs; // nonzeros of inputRows, only built with sparse inputs on
+    bool useSparseInputs = false; // sparse enough for the first layer's sparse kernels
+    std::vector<float> expectedOutputs; // batchSize x numOutputs, one-hot
+    std::vector<int> labels;
+    std::vector<LayerBatchData> layerData;
+    std::vector<LayerGradients> gradients; // only used by training chunks
+    
+    AlignedVector<float> arena; // backs every layerData and gradients buffer, see Network::reserveWorkspace
+    
+    int numCorrect = 0;
+    double loss = 0; // summed over the samples, evaluation and training telemetry only
+    std::vector<int> confusionMatrix; // evaluation only, see EvaluationResult
+};
+
+// Everything Network::test measures over the loaded dataset
+struct EvaluationResult
+{
+    int numSamples = 0;
+    int numCorrect = 0;
+    float accuracy = 0;
+    float loss = 0; // mean cost per sample
+    double samplesPerSecond = 0;
+    
+    int numClasses = 0;
+    std::vector<int> confusionMatrix; // numClasses x numClasses, row is the label and column the prediction
+    
+    int confusion(int label, int prediction) const { return confusionMatrix[label * numClasses + prediction]; }
+};
+
+// What Network::trainAsync did. A step's staleness is how many updates claimed before it had not been
+// applied yet when it started reading the weights.
+struct AsyncTrainingStats
+{
+    int64_t numUpdates = 0;
+    double seconds = 0;
+    double samplesPerSecond = 0;
+    
+    double meanStaleness = 0;
+    int maxStaleness = 0;
+    
+    std::vector<float> epochAccuracy; // training accuracy of every epoch
+};
+
+// Two activation buffers, each as wide as the widest layer, that a single sample forward pass
+// alternates between. Once sized by the first call it is reused without allocating.
+struct InferenceWorkspace
+{
+    AlignedVector<float> buffers[2];
+};
+
+// Order in which a pipeline stage runs the micro-batches of a mini-batch. GPipe runs all forward steps and then
+// all backward ones; 1F1B starts backward steps as soon as the output stage has a micro-batch, so fewer
+// micro-batches are in flight and the stages idle less.
+enum class PipelineSchedule
+{
+    GPipe,
+    OneForwardOneBackward
+};
 
 class Network
 {
@@ -17,50 +95,197 @@ public:
     
     void initRandomWeights();
     
+    // Resizes the worker pool used by train, test and batched inference; <= 0 uses every hardware thread
+    void setNumThreads(int numThreads);
+    
+    // Memory maps a file written by saveWeights and has the layers alias it, the file's topology replaces the current one.
+    // Throws std::runtime_error if the file is missing or corrupt.
     void loadWeights(std::string filePath);
     
-    //void saveWeights(std::string filePath);
+    // Sparse writes only the nonzero weights, in compressed sparse rows, for pruned networks. loadWeights reads
+    // either; a sparse file is expanded into the layers, keeps its zeros pruned and is compressed for inference.
+    void saveWeights(std::string filePath, bool sparse = false);
+    
+    // Throws std::runtime_error on a malformed row or a label that is not one of the output nodes
+    void loadData(std::string filePath, int numInputs, int dataSize, PixelFormat format = PixelFormat::Float32);
     
-    void loadData(std::string filePath, int numInputs, int dataSize);
+    // Memory maps a dataset written by Dataset::save or Dataset::convert. Throws std::runtime_error if the
+    // file is corrupt or a label is not one of the output nodes.
+    void loadDataset(std::string filePath);
     void clearData();
     
     void train(int iterations, int miniBatchSize = MAXFLOAT, float learnRate = 0.2f, float regularization = 0.0f, float momentum = 0.0f);
     
-    void updateGradients(int batch);
+    // Update rule of train, trainDataParallel and trainPipelined, momentum SGD unless set. Clears every layer's
+    // velocities or moments and restarts Adam's bias correction.
+    void setOptimizer(const OptimizerSettings& settings);
+    const OptimizerSettings& optimizer() const { return m_optimizer; }
+    
+    // Hogwild: every pool worker trains on its own mini-batches of miniBatchSize and applies them straight to the
+    // shared weights, without a barrier between batches. A worker only starts a batch once all but maxStaleness of
+    // the batches claimed before it have been applied; 0 makes it plain sequential SGD, a negative value removes
+    // the bound. Telemetry reports come from one worker every reportInterval of its own batches.
+    // Mixed precision and sparse inputs are paused while it runs. Steps are always momentum SGD, another optimizer is swapped out
+    // for the run and starts over from cleared state afterwards.
+    // Updates store each weight through a relaxed std::atomic_ref, but the forward and backward passes read the weights
+    // with the plain loads of the GEMM kernels. Those reads race with the stores, which the C++ memory model leaves
+    // undefined; like Hogwild itself this relies on aligned float loads and stores never tearing on the targets built for,
+    // so a read sees either the old or the new value of each weight.
+    AsyncTrainingStats trainAsync(int iterations, int miniBatchSize, float learnRate = 0.2f, float regularization = 0.0f, float momentum = 0.0f, int maxStaleness = 16);
+    
+    // Data parallel training of one replica: this process trains on shard transport.rank() of transport.size()
+    // equal shards of the loaded dataset, with miniBatchSize split across the replicas. Every step's gradients
+    // are summed over all replicas with a ring allreduce, so the replicas stay bit-identical; rank 0's weights
+    // are broadcast first and the replicas are compared at the end of every epoch. Only rank 0 prints.
+    // Throws std::runtime_error if a peer fails or a replica diverges.
+    void trainDataParallel(Transport& transport, int iterations, int miniBatchSize, float learnRate = 0.2f, float regularization = 0.0f, float momentum = 0.0f);
+    
+    // Forks numProcesses - 1 worker processes and runs trainDataParallel in all of them with this process as
+    // rank 0, which keeps the trained weights. The worker pool is split evenly between the processes.
+    // Throws std::runtime_error if a worker process fails.
+    void trainMultiProcess(int numProcesses, int iterations, int miniBatchSize, float learnRate = 0.2f, float regularization = 0.0f, float momentum = 0.0f, TransportType transportType = TransportType::SharedMemory);
+    
+    // Pipeline parallel training: the layers are split into numStages contiguous stages of about equal parameter count,
+    // each run by its own thread pinned to its own core (Linux), so a stage's weights stay in that core's cache.
+    // Every mini-batch is cut into numMicroBatches micro-batches that flow forward and backward through the stages,
+    // handed over through lock-free single producer single consumer queues, and every stage updates its layers once
+    // the whole mini-batch is through. Same steps as train, up to the order gradients are summed in.
+    // Uses its own threads instead of the worker pool; numStages is capped at the number of layers.
+    void trainPipelined(int numStages, int numMicroBatches, int iterations, int miniBatchSize, float learnRate = 0.2f, float regularization = 0.0f, float momentum = 0.0f, PipelineSchedule schedule = PipelineSchedule::OneForwardOneBackward);
+    
+    // Sums the per-chunk gradients of a mini-batch with a parallel tree reduction and adds them to the layers.
+    // With a transport the sums are also allreduced with the other replicas before they reach the layers.
+    void updateGradients(std::vector<NetworkBatchData>& chunkData, int numChunks, Transport* transport = nullptr);
     
-    float test();
+    // Batched forward passes over the loaded dataset, split across the worker pool. Uses the int8 layers when quantized.
+    EvaluationResult test();
+    
+    // Calibrates input ranges on up to numSamples samples spread over the loaded dataset, then runs test() and
+    // the inference forwardPass overloads on per-output-channel int8 weights. Training or loading weights goes back to float.
+    void quantize(int numSamples = 1000);
+    void clearQuantization();
+    bool isQuantized() const { return !m_quantizedLayers.empty(); }
+    
+    // Magnitude pruning: zeros the fraction sparsity of every layer's smallest weights, see Layer::prune. The zeros
+    // are kept through further training, so training afterwards fine-tunes the surviving weights. 0 removes the masks.
+    void prune(float sparsity);
+    
+    // Fraction of all weights that are zero
+    float weightSparsity() const;
+    
+    // Runs test() and the inference forwardPass overloads on compressed sparse row copies of the layers without
+    // their zero weights, which pays off once they are pruned. Training or loading dense weights goes back to the layers.
+    void compress();
+    void clearCompression();
+    bool isCompressed() const { return !m_sparseLayers.empty(); }
+    
+    // bfloat16 weights for the batched forward and backward passes, float master weights and gradients.
+    // Combine with a BFloat16 dataset to also halve the input traffic.
+    void setMixedPrecision(bool enabled);
+    
+    // Runs the first layer's forward and weight gradient passes over the nonzero inputs only, for datasets like
+    // MNIST whose pixels are mostly exactly zero. Batches are compressed as they are loaded and fall back to the
+    // dense kernels when too many inputs are nonzero. Training noise is then only added to nonzero pixels, so
+    // zeros stay zero. Paused by trainAsync.
+    void setSparseInputs(bool enabled);
+    
+    // Bytes of weights and biases inference reads, int8 ones when quantized and only the nonzero ones when compressed
+    size_t parameterBytes() const;
+    
+    // Per-phase timings, throughput and loss of train(), off until enabled. With it off train()
+    // prints a single accuracy line per epoch.
+    Telemetry& telemetry() { return m_telemetry; }
     
     //void learn(std::vector<std::vector<float>> trainingData, float learnRate = 0.2, float regularization = 0, float momentum = 0);
     
     //void updateGradients(std::vector<float> data, std::vector<float> expectedOutputs, NetworkLearnData learnData);
     
-    std::vector<float> forwardPass(std::vector<float> inputs);
+    std::vector<float> forwardPass(const std::vector<float>& inputs);
     
-    std::vector<float> forwardPass(std::vector<float> inputs, std::vector<LayerLearnData>& layerData);
-
+    // Single sample inference, the returned span points into workspace and is valid until its next use
+    std::span<const float> forwardPass(std::span<const float> inputs, InferenceWorkspace& workspace) const;
+    
+    // Same as above with a workspace owned by the calling thread
+    std::span<const float> forwardPass(std::span<const float> inputs) const;
+    
+    // Each layer reads the previous layer's activations in place, layerData is reused between calls
+    const std::vector<float>& forwardPass(std::span<const float> inputs, std::vector<LayerLearnData>& layerData);
+    
+    // Batched inference, returns batchSize x numOutputs activations owned by layerData.
+    // With sparseInputs, the nonzeros of inputs, the first layer uses its sparse kernel.
+    const float* forwardPass(const float* inputs, int batchSize, std::vector<LayerBatchData>& layerData, const SparseRows* sparseInputs = nullptr);
     
-    void backwardsPass(std::vector<float> outputs);
+    // Batched inference split across the worker pool, writes batchSize x numOutputs activations to outputs
+    void forwardPass(const float* inputs, int batchSize, float* outputs);
+    
+    // Forward pass, node values and batchData.gradients for a batch filled by loadBatch.
+    // worker is the pool worker running it, whose telemetry counters it adds to.
+    void backwardsPass(NetworkBatchData& batchData, int worker = 0);
+    
+    static int maxValueIndex(std::span<const float> values);
     
     //std::vector<NetworkLearnData> learnData;
     
 private:
-    int maxValueIndex(std::vector<float> values);
+    
+    // Samples [batchStart, batchStart + batchSize) of the dataset, used for evaluation
+    void loadBatch(NetworkBatchData& batchData, int batchStart, int batchSize);
+    
+    // Rows [begin, begin + count) of a training batch from the pipeline
+    void loadBatch(NetworkBatchData& batchData, const TrainingBatch& batch, int begin, int count);
+    
+    // The listed samples plus fresh input noise, for asynchronous training
+    void loadBatch(NetworkBatchData& batchData, const int* samples, int count, std::mt19937& generator);
+    
+    void setExpectedOutputs(NetworkBatchData& batchData);
+    
+    // Builds batchData.sparseInputs from inputRows when sparse inputs are on
+    void compressInputs(NetworkBatchData& batchData);
+    const SparseRows* sparseInputs(const NetworkBatchData& batchData) const { return batchData.useSparseInputs ? &batchData.sparseInputs : nullptr; }
+    
+    // numCorrect and, with telemetry on, the loss of a batch that went through the output layer; adds them to worker's counters
+    void scoreBatch(NetworkBatchData& batchData, int worker);
+    
+    // Mini-batch training loop shared by train and trainDataParallel, transport is null for a single replica
+    void trainReplica(int iterations, int miniBatchSize, float learnRate, float regularization, float momentum, Transport* transport);
+    
+    // One optimizer step over every layer's accumulated gradients, split into blocks across the worker pool
+    void applyGradients(const OptimizerStep& step);
+    
+    // Throws std::runtime_error on the replicas whose parameters differ from rank 0's
+    void checkReplicas(Transport& transport) const;
+    
+    // Batched forward pass through the int8 layers when quantized, the sparse ones when compressed, the float ones otherwise
+    const float* inferencePass(const float* inputs, int batchSize, std::vector<LayerBatchData>& layerData, const SparseRows* sparseInputs = nullptr);
+    
+    // Carves batch buffers for up to capacity samples (and gradients if requested) for every layer out of
+    // batchData.arena. The arena only grows, so calling this again for the same topology never allocates.
+    void reserveWorkspace(NetworkBatchData& batchData, int capacity, bool withGradients);
     
 private:
     std::vector<Layer> m_layers;
+    std::vector<QuantizedLayer> m_quantizedLayers; // empty unless quantize() was called
+    std::vector<SparseLayer> m_sparseLayers; // empty unless compress() was called
     std::vector<int> m_layerSizes;
     
-    std::vector<std::vector<float>> m_data;
+    std::unique_ptr<ThreadPool> m_threadPool;
+    std::vector<NetworkBatchData> m_workerData; // one per pool worker
+    std::vector<NetworkBatchData> m_chunkData; // one per training chunk, kept between train calls
     
-    int m_numInputs;
-    int m_dataSize;
+    Dataset m_data;
     
     int m_numCorrect;
     
-    //first element is label/correct answer, rest is data
-    
     ActivationType m_activationType;
     
+    bool m_mixedPrecision = false;
+    bool m_sparseInputs = false;
+    
+    OptimizerSettings m_optimizer;
+    int64_t m_optimizerSteps = 0; // since setOptimizer, for Adam's bias correction
+    
+    Telemetry m_telemetry;
+    
     CostType m_costType;
 };
 
@@ -0,0 +1,86 @@
+//
+//  Optimizer.cpp
+//  Neural network
+//
+
+#include "Optimizer.hpp"
+
+#include <cmath>
+
+const char* OptimizerSettings::name(OptimizerType type)
+{
+    switch (type)
+    {
+        case OptimizerType::Momentum: return "momentum";
+        case OptimizerType::Nesterov: return "nesterov";
+        case OptimizerType::Adam: return "adam";
+        case OptimizerType::AdamW: return "adamw";
+        case OptimizerType::RMSProp: return "rmsprop";
+    }
+    return "";
+}
+
+int OptimizerSettings::numStateBuffers(OptimizerType type)
+{
+    return type == OptimizerType::Momentum || type == OptimizerType::Nesterov ? 1 : 2;
+}
+
+OptimizerStep::OptimizerStep(const OptimizerSettings& settings, int64_t stepNumber, float learnRate, int batchSize, float regularization, float momentum)
+: m_type(settings.type)
+{
+    // Same arithmetic as the momentum SGD step always had, so training with it is unchanged
+    m_learnRate = learnRate / batchSize;
+    m_weightDecay = 1.0f - regularization * m_learnRate;
+    m_momentum = momentum;
+    
+    Kernels::AdaptiveUpdate update;
+    update.gradientScale = 1.0f / batchSize;
+    update.stepSize = learnRate;
+    update.epsilon = settings.epsilon;
+    
+    if (m_type == OptimizerType::RMSProp)
+    {
+        // A moment with beta1 = 0 is just the gradient
+        update.beta1 = 0.0f;
+        update.beta2 = settings.rmsDecay;
+    }
+    else
+    {
+        // Adam's bias correction folded into the step size and epsilon
+        double correction1 = 1.0 - std::pow((double) settings.beta1, (double) stepNumber);
+        double correction2 = std::sqrt(1.0 - std::pow((double) settings.beta2, (double) stepNumber));
+        
+        update.beta1 = settings.beta1;
+        update.beta2 = settings.beta2;
+        update.stepSize = (float) (learnRate * correction2 / correction1);
+        update.epsilon = (float) (settings.epsilon * correction2);
+    }
+    
+    m_update = update;
+    m_decayedUpdate = update;
+    if (m_type == OptimizerType::AdamW)
+    {
+        m_decayedUpdate.weightDecay = 1.0f - learnRate * regularization;
+    }
+    else
+    {
+        m_decayedUpdate.l2 = regularization;
+    }
+}
+
+void OptimizerStep::apply(float* values, float* gradients, float* state, size_t stateStride, int n, bool decayed) const
+{
+    switch (m_type)
+    {
+        case OptimizerType::Momentum:
+        case OptimizerType::Nesterov:
+            Kernels::momentumUpdate(values, state, gradients, n, m_learnRate, decayed ? m_weightDecay : 1.0f, m_momentum, m_type == OptimizerType::Nesterov);
+            break;
+        
+        case OptimizerType::Adam:
+        case OptimizerType::AdamW:
+        case OptimizerType::RMSProp:
+            Kernels::adaptiveUpdate(values, gradients, state, state + stateStride, n, decayed ? m_decayedUpdate : m_update);
+            break;
+    }
+}
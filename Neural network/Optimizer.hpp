@@ -0,0 +1,66 @@
+//
+//  Optimizer.hpp
+//  Neural network
+//
+
+#pragma once
+
+#include <cstdint>
+
+#include "Kernels.hpp"
+
+enum class OptimizerType
+{
+    Momentum,  // SGD with momentum, the default
+    Nesterov,
+    Adam,      // L2 regularization added to the gradients
+    AdamW,     // decoupled weight decay
+    RMSProp
+};
+
+// Everything about the update rule that train() doesn't already take. The learn rate, regularization
+// and momentum stay arguments of the training calls; momentum is used by Momentum and Nesterov,
+// Adam and AdamW use beta1 instead and RMSProp has none.
+struct OptimizerSettings
+{
+    OptimizerType type = OptimizerType::Momentum;
+    
+    float beta1 = 0.9f;      // Adam and AdamW first moment decay
+    float beta2 = 0.999f;    // Adam and AdamW second moment decay
+    float rmsDecay = 0.9f;   // RMSProp squared gradient decay
+    float epsilon = 1e-8f;
+    
+    static const char* name(OptimizerType type);
+    
+    // numParameters sized state buffers a layer keeps: velocities, or moments and squared gradients
+    static int numStateBuffers(OptimizerType type);
+};
+
+// The constants of one optimizer step, worked out once per mini-batch and shared by every layer and
+// every block of parameters, so the update itself is a single fused pass over a parameter range.
+class OptimizerStep
+{
+public:
+    // stepNumber counts from 1 and drives Adam's bias correction. The gradients the step consumes are
+    // sums over batchSize samples; Momentum and Nesterov scale learnRate by 1 / batchSize as before,
+    // the adaptive ones average the gradients instead.
+    OptimizerStep(const OptimizerSettings& settings, int64_t stepNumber, float learnRate, int batchSize, float regularization, float momentum);
+    
+    OptimizerType type() const { return m_type; }
+    
+    // Updates values[0, n) from gradients and the state buffers, which start stateStride floats apart, then
+    // clears the gradients. Regularization only applies when decayed, biases pass false.
+    void apply(float* values, float* gradients, float* state, size_t stateStride, int n, bool decayed) const;
+    
+private:
+    OptimizerType m_type;
+    
+    // Momentum and Nesterov
+    float m_learnRate;
+    float m_weightDecay;
+    float m_momentum;
+    
+    // Adam, AdamW and RMSProp, with and without regularization
+    Kernels::AdaptiveUpdate m_decayedUpdate;
+    Kernels::AdaptiveUpdate m_update;
+};
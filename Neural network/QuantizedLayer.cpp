@@ -0,0 +1,130 @@
+//
+//  QuantizedLayer.cpp
+//  Neural network
+//
+
+#include "QuantizedLayer.hpp"
+#include "Kernels.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+    constexpr float kInt8Max = 127.0f; // symmetric, -128 is never used
+    constexpr int kBlockNodes = 16; // weight rows kept hot across a batch
+    
+    // Rounds half away from zero without a libm call, so the loop over a row vectorizes
+    int8_t quantize(float value, float inverseScale)
+    {
+        float scaled = std::clamp(value * inverseScale, -kInt8Max, kInt8Max);
+        return (int8_t) (scaled + (scaled >= 0 ? 0.5f : -0.5f));
+    }
+}
+
+QuantizedLayer::QuantizedLayer(const Layer& layer, float maxInput)
+: m_numNodesIn(layer.numNodesIn()), m_numNodesOut(layer.numNodesOut())
+{
+    m_rowStride = (int) roundToCacheLine<int8_t>(m_numNodesIn);
+    m_inputScale = maxInput > 0 ? maxInput / kInt8Max : 1.0f;
+    
+    m_weights.assign((size_t) m_numNodesOut * m_rowStride, 0);
+    m_outputScales.resize(m_numNodesOut);
+    
+    const float* weights = layer.parameters();
+    const float* biases = weights + (size_t) m_numNodesIn * m_numNodesOut;
+    m_biases.assign(biases, biases + m_numNodesOut);
+    
+    for (int nodeOut = 0; nodeOut < m_numNodesOut; nodeOut++)
+    {
+        const float* row = weights + (size_t) nodeOut * m_numNodesIn;
+        
+        float maxWeight = 0;
+        for (int nodeIn = 0; nodeIn < m_numNodesIn; nodeIn++)
+        {
+            maxWeight = std::max(maxWeight, std::abs(row[nodeIn]));
+        }
+        float weightScale = maxWeight > 0 ? maxWeight / kInt8Max : 1.0f;
+        
+        int8_t* quantizedRow = &m_weights[(size_t) nodeOut * m_rowStride];
+        for (int nodeIn = 0; nodeIn < m_numNodesIn; nodeIn++)
+        {
+            quantizedRow[nodeIn] = quantize(row[nodeIn], 1.0f / weightScale);
+        }
+        
+        m_outputScales[nodeOut] = m_inputScale * weightScale;
+    }
+}
+
+void QuantizedLayer::weightedInputs(const float* inputs, float* outputs, int batchSize) const
+{
+    // Quantized input rows, one buffer per thread. Rows are as long as the padded weight rows so the kernels
+    // never see a tail, whatever sits in the padding is multiplied by zero weights.
+    thread_local AlignedVector<int8_t> quantizedInputs;
+    if (quantizedInputs.size() < (size_t) batchSize * m_rowStride)
+    {
+        quantizedInputs.resize((size_t) batchSize * m_rowStride);
+    }
+    
+    float inverseScale = 1.0f / m_inputScale;
+    for (int sample = 0; sample < batchSize; sample++)
+    {
+        const float* row = inputs + (size_t) sample * m_numNodesIn;
+        int8_t* quantizedRow = &quantizedInputs[(size_t) sample * m_rowStride];
+        for (int nodeIn = 0; nodeIn < m_numNodesIn; nodeIn++)
+        {
+            quantizedRow[nodeIn] = quantize(row[nodeIn], inverseScale);
+        }
+    }
+    
+    // A block of weight rows stays in L1 while every sample of the batch passes over it
+    for (int blockStart = 0; blockStart < m_numNodesOut; blockStart += kBlockNodes)
+    {
+        int blockEnd = std::min(blockStart + kBlockNodes, m_numNodesOut);
+        for (int sample = 0; sample < batchSize; sample++)
+        {
+            const int8_t* quantizedRow = &quantizedInputs[(size_t) sample * m_rowStride];
+            float* outputRow = outputs + (size_t) sample * m_numNodesOut;
+            for (int nodeOut = blockStart; nodeOut < blockEnd; nodeOut++)
+            {
+                int32_t sum = Kernels::dotInt8(quantizedRow, &m_weights[(size_t) nodeOut * m_rowStride], m_rowStride);
+                outputRow[nodeOut] = sum * m_outputScales[nodeOut] + m_biases[nodeOut];
+            }
+        }
+    }
+}
+
+void QuantizedLayer::CalculateOutputs(std::span<const float> inputs, std::span<float> outputs, ActivationType activationType) const
+{
+    weightedInputs(inputs.data(), outputs.data(), 1);
+    
+    Activation::activate(outputs.first(m_numNodesOut), activationType);
+}
+
+const float* QuantizedLayer::CalculateOutputs(LayerBatchData& batchData, const float* inputs, int batchSize, ActivationType activationType) const
+{
+    if (batchSize > batchData.capacity)
+    {
+        throw std::runtime_error("[QuantizedLayer CalculateOutputs] Batch of " + std::to_string(batchSize) + " exceeds workspace capacity " + std::to_string(batchData.capacity));
+    }
+    
+    batchData.batchSize = batchSize;
+    batchData.inputs = inputs;
+    
+    weightedInputs(inputs, batchData.weightedInputs, batchSize);
+    
+    std::copy(batchData.weightedInputs, batchData.weightedInputs + batchSize * m_numNodesOut, batchData.activations);
+    for (int sample = 0; sample < batchSize; sample++)
+    {
+        Activation::activate(std::span<float>(&batchData.activations[sample * m_numNodesOut], m_numNodesOut), activationType);
+    }
+    
+    return batchData.activations;
+}
+
+size_t QuantizedLayer::sizeInBytes() const
+{
+    return m_weights.size() * sizeof(int8_t) + (m_outputScales.size() + m_biases.size()) * sizeof(float);
+}
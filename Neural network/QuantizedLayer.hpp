@@ -0,0 +1,51 @@
+//
+//  QuantizedLayer.hpp
+//  Neural network
+//
+
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "AlignedAllocator.hpp"
+#include "Activation.hpp"
+#include "Layer.hpp"
+
+// Inference only copy of a Layer with symmetric int8 weights, one scale per output node.
+// Inputs are quantized with a single scale found by calibration, the int32 dot products
+// are dequantized back to float before the bias and the activation.
+class QuantizedLayer
+{
+public:
+    // maxInput is the largest |input| the layer saw during calibration
+    QuantizedLayer(const Layer& layer, float maxInput);
+    
+    // Single sample, outputs.size() == numNodesOut()
+    void CalculateOutputs(std::span<const float> inputs, std::span<float> outputs, ActivationType activationType) const;
+    
+    // Same contract as the batched Layer::CalculateOutputs, so test() can read weightedInputs for the loss
+    const float* CalculateOutputs(LayerBatchData& batchData, const float* inputs, int batchSize, ActivationType activationType) const;
+    
+    int numNodesIn() const { return m_numNodesIn; }
+    int numNodesOut() const { return m_numNodesOut; }
+    
+    // Weights, scales and biases
+    size_t sizeInBytes() const;
+    
+private:
+    // outputs[batchSize x numNodesOut] = dequantized inputs * weights^T + biases, no activation
+    void weightedInputs(const float* inputs, float* outputs, int batchSize) const;
+    
+private:
+    int m_numNodesIn;
+    int m_numNodesOut;
+    int m_rowStride; // numNodesIn padded to a cache line, the padding is zero
+    
+    float m_inputScale;
+    
+    AlignedVector<int8_t> m_weights; // numNodesOut x m_rowStride
+    std::vector<float> m_outputScales; // inputScale * weight scale, per output node
+    std::vector<float> m_biases;
+};
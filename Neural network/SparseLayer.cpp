@@ -0,0 +1,142 @@
+//
+//  SparseLayer.cpp
+//  Neural network
+//
+
+#include "SparseLayer.hpp"
+#include "Kernels.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+    constexpr int kMinTransposedBatch = 8; // smaller batches take the row by row gather kernel
+    constexpr int kTileSamples = 64; // samples transposed at a time
+}
+
+SparseLayer::SparseLayer(const Layer& layer)
+: m_numNodesIn(layer.numNodesIn()), m_numNodesOut(layer.numNodesOut())
+{
+    if (m_numNodesIn > std::numeric_limits<uint16_t>::max() + 1)
+    {
+        throw std::runtime_error("[SparseLayer] " + std::to_string(m_numNodesIn) + " inputs do not fit 16 bit indices");
+    }
+    
+    const float* weights = layer.parameters();
+    const float* biases = weights + (size_t) m_numNodesIn * m_numNodesOut;
+    m_biases.assign(biases, biases + m_numNodesOut);
+    
+    int numNonZero = layer.numNonZeroWeights();
+    m_columns.reserve(numNonZero);
+    m_values.reserve(numNonZero);
+    
+    m_rowOffsets.resize(m_numNodesOut + 1);
+    for (int nodeOut = 0; nodeOut < m_numNodesOut; nodeOut++)
+    {
+        m_rowOffsets[nodeOut] = (int) m_values.size();
+        
+        const float* row = weights + (size_t) nodeOut * m_numNodesIn;
+        for (int nodeIn = 0; nodeIn < m_numNodesIn; nodeIn++)
+        {
+            if (row[nodeIn] != 0.0f)
+            {
+                m_columns.push_back((uint16_t) nodeIn);
+                m_values.push_back(row[nodeIn]);
+            }
+        }
+    }
+    m_rowOffsets[m_numNodesOut] = (int) m_values.size();
+}
+
+void SparseLayer::weightedInputs(const float* inputs, float* outputs, int batchSize) const
+{
+    if (batchSize < kMinTransposedBatch)
+    {
+        for (int sample = 0; sample < batchSize; sample++)
+        {
+            const float* inputRow = inputs + (size_t) sample * m_numNodesIn;
+            float* outputRow = outputs + (size_t) sample * m_numNodesOut;
+            for (int nodeOut = 0; nodeOut < m_numNodesOut; nodeOut++)
+            {
+                int begin = m_rowOffsets[nodeOut];
+                outputRow[nodeOut] = Kernels::sparseDot(&m_values[begin], &m_columns[begin], m_rowOffsets[nodeOut + 1] - begin, inputRow) + m_biases[nodeOut];
+            }
+        }
+        return;
+    }
+    
+    // Transposed, a kept weight scales one contiguous row of a tile of samples instead of gathering one
+    // input per sample. A tile of transposed inputs stays in L2 and its outputs in L1. One pair of buffers per thread.
+    thread_local AlignedVector<float> transposedInputs;
+    thread_local AlignedVector<float> transposedOutputs;
+    transposedInputs.resize((size_t) kTileSamples * m_numNodesIn);
+    transposedOutputs.resize((size_t) kTileSamples * m_numNodesOut);
+    
+    for (int tileStart = 0; tileStart < batchSize; tileStart += kTileSamples)
+    {
+        int tileSize = std::min(kTileSamples, batchSize - tileStart);
+        
+        // Written row by row, the tile's input rows are only a cache line each per 16 inputs
+        const float* tileInputs = inputs + (size_t) tileStart * m_numNodesIn;
+        for (int nodeIn = 0; nodeIn < m_numNodesIn; nodeIn++)
+        {
+            float* row = &transposedInputs[(size_t) nodeIn * tileSize];
+            for (int sample = 0; sample < tileSize; sample++)
+            {
+                row[sample] = tileInputs[(size_t) sample * m_numNodesIn + nodeIn];
+            }
+        }
+        
+        for (int nodeOut = 0; nodeOut < m_numNodesOut; nodeOut++)
+        {
+            std::fill_n(&transposedOutputs[(size_t) nodeOut * tileSize], tileSize, m_biases[nodeOut]);
+        }
+        Kernels::sparseGemmNN(m_numNodesOut, tileSize, m_rowOffsets.data(), m_columns.data(), m_values.data(), transposedInputs.data(), transposedOutputs.data());
+        
+        for (int sample = 0; sample < tileSize; sample++)
+        {
+            float* outputRow = outputs + (size_t) (tileStart + sample) * m_numNodesOut;
+            for (int nodeOut = 0; nodeOut < m_numNodesOut; nodeOut++)
+            {
+                outputRow[nodeOut] = transposedOutputs[(size_t) nodeOut * tileSize + sample];
+            }
+        }
+    }
+}
+
+void SparseLayer::CalculateOutputs(std::span<const float> inputs, std::span<float> outputs, ActivationType activationType) const
+{
+    weightedInputs(inputs.data(), outputs.data(), 1);
+    
+    Activation::activate(outputs.first(m_numNodesOut), activationType);
+}
+
+const float* SparseLayer::CalculateOutputs(LayerBatchData& batchData, const float* inputs, int batchSize, ActivationType activationType) const
+{
+    if (batchSize > batchData.capacity)
+    {
+        throw std::runtime_error("[SparseLayer CalculateOutputs] Batch of " + std::to_string(batchSize) + " exceeds workspace capacity " + std::to_string(batchData.capacity));
+    }
+    
+    batchData.batchSize = batchSize;
+    batchData.inputs = inputs;
+    batchData.sparseInputs = nullptr;
+    
+    weightedInputs(inputs, batchData.weightedInputs, batchSize);
+    
+    std::copy(batchData.weightedInputs, batchData.weightedInputs + batchSize * m_numNodesOut, batchData.activations);
+    for (int sample = 0; sample < batchSize; sample++)
+    {
+        Activation::activate(std::span<float>(&batchData.activations[sample * m_numNodesOut], m_numNodesOut), activationType);
+    }
+    
+    return batchData.activations;
+}
+
+size_t SparseLayer::sizeInBytes() const
+{
+    return m_rowOffsets.size() * sizeof(int) + m_columns.size() * sizeof(uint16_t) + (m_values.size() + m_biases.size()) * sizeof(float);
+}
@@ -0,0 +1,50 @@
+//
+//  SparseLayer.hpp
+//  Neural network
+//
+
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "AlignedAllocator.hpp"
+#include "Activation.hpp"
+#include "Layer.hpp"
+
+// Inference only copy of a pruned Layer that keeps just the nonzero weights, in compressed sparse
+// rows with one row per output node and 16 bit input indices. Memory and multiplications shrink
+// with the sparsity; the outputs match the Layer's up to the order of the sums.
+class SparseLayer
+{
+public:
+    // Drops the zero weights of layer. Throws std::runtime_error if the layer has more inputs than 16 bits can index.
+    explicit SparseLayer(const Layer& layer);
+    
+    // Single sample, outputs.size() == numNodesOut()
+    void CalculateOutputs(std::span<const float> inputs, std::span<float> outputs, ActivationType activationType) const;
+    
+    // Same contract as the batched Layer::CalculateOutputs, so test() can read weightedInputs for the loss
+    const float* CalculateOutputs(LayerBatchData& batchData, const float* inputs, int batchSize, ActivationType activationType) const;
+    
+    int numNodesIn() const { return m_numNodesIn; }
+    int numNodesOut() const { return m_numNodesOut; }
+    int numNonZeroWeights() const { return (int) m_values.size(); }
+    
+    // Row offsets, indices, weights and biases
+    size_t sizeInBytes() const;
+    
+private:
+    // outputs[batchSize x numNodesOut] = inputs * weights^T + biases, no activation
+    void weightedInputs(const float* inputs, float* outputs, int batchSize) const;
+    
+private:
+    int m_numNodesIn;
+    int m_numNodesOut;
+    
+    std::vector<int> m_rowOffsets; // numNodesOut + 1, row nodeOut is [m_rowOffsets[nodeOut], m_rowOffsets[nodeOut + 1])
+    AlignedVector<uint16_t> m_columns; // input node of every kept weight
+    AlignedVector<float> m_values;
+    std::vector<float> m_biases;
+};
@@ -0,0 +1,112 @@
+//
+//  SpscQueue.hpp
+//  Neural network
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+#include "AlignedAllocator.hpp"
+
+// Bounded lock-free queue between exactly one producer thread and one consumer thread.
+// Each side's counter sits on its own cache line and each side keeps a copy of the other's,
+// so a push or pop only reads the shared counter when its copy says the queue looks full or empty.
+template <typename T>
+class SpscQueue
+{
+public:
+    // capacity is rounded up to a power of two
+    explicit SpscQueue(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity)
+        {
+            size *= 2;
+        }
+        m_slots.resize(size);
+        m_mask = size - 1;
+    }
+    
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+    
+    // Producer only, false when full
+    bool tryPush(const T& value)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_cachedHead > m_mask)
+        {
+            m_cachedHead = m_head.load(std::memory_order_acquire);
+            if (tail - m_cachedHead > m_mask)
+            {
+                return false;
+            }
+        }
+        
+        m_slots[tail & m_mask] = value;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+    
+    // Consumer only, false when empty
+    bool tryPop(T& value)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_cachedTail)
+        {
+            m_cachedTail = m_tail.load(std::memory_order_acquire);
+            if (head == m_cachedTail)
+            {
+                return false;
+            }
+        }
+        
+        value = m_slots[head & m_mask];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+    
+    // Blocking versions, spin for a while and then yield the core
+    void push(const T& value)
+    {
+        for (int spins = 0; !tryPush(value); spins++)
+        {
+            backOff(spins);
+        }
+    }
+    
+    T pop()
+    {
+        T value;
+        for (int spins = 0; !tryPop(value); spins++)
+        {
+            backOff(spins);
+        }
+        return value;
+    }
+    
+private:
+    static constexpr int kSpinsBeforeYield = 1024;
+    
+    static void backOff(int spins)
+    {
+        if (spins >= kSpinsBeforeYield)
+        {
+            std::this_thread::yield();
+        }
+    }
+    
+private:
+    std::vector<T> m_slots;
+    size_t m_mask = 0;
+    
+    alignas(kCacheLineSize) std::atomic<size_t> m_head { 0 }; // next slot to pop, written by the consumer
+    size_t m_cachedTail = 0; // consumer's copy of m_tail
+    
+    alignas(kCacheLineSize) std::atomic<size_t> m_tail { 0 }; // next slot to push, written by the producer
+    size_t m_cachedHead = 0; // producer's copy of m_head
+};
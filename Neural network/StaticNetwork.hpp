@@ -0,0 +1,250 @@
+//
+//  StaticNetwork.hpp
+//  Neural network
+//
+
+#pragma once
+
+#include <array>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "AlignedAllocator.hpp"
+#include "Activation.hpp"
+#include "ModelFile.hpp"
+
+// One layer of a StaticNetwork: weights (NumOutputs x NumInputs) followed by biases, the same layout
+// as Layer and ModelFile, with every loop bound a compile time constant
+template <int NumInputs, int NumOutputs>
+struct StaticLayer
+{
+    static constexpr int kNumParameters = NumInputs * NumOutputs + NumOutputs;
+    
+    alignas(kCacheLineSize) std::array<float, kNumParameters> parameters{};
+    
+    const float* weights() const { return parameters.data(); }
+    const float* biases() const { return parameters.data() + NumInputs * NumOutputs; }
+    
+    // outputs = weights * inputs + biases, four rows at a time so every input load feeds four rows.
+    // Each of the kLanes partial sums only ever adds its own column, so the compiler keeps them in
+    // vector registers without reassociating floats. The vector width is whatever the build targets.
+    void weightedInputs(const float* inputs, float* outputs) const
+    {
+        constexpr int kRows = 4;
+        constexpr int kLanes = 16;
+        constexpr int kBody = NumInputs / kLanes * kLanes;
+        
+        constexpr int kBlockedOutputs = NumOutputs / kRows * kRows;
+        
+        for (int nodeOut = 0; nodeOut < kBlockedOutputs; nodeOut += kRows)
+        {
+            const float* rows = weights() + nodeOut * NumInputs;
+            
+            // lane loop innermost so each row's accumulators stay in vector registers
+            float lanes[kRows][kLanes] = {};
+            for (int nodeIn = 0; nodeIn < kBody; nodeIn += kLanes)
+            {
+                const float* x = inputs + nodeIn;
+                const float* w0 = rows + nodeIn;
+                const float* w1 = w0 + NumInputs;
+                const float* w2 = w1 + NumInputs;
+                const float* w3 = w2 + NumInputs;
+                
+                for (int lane = 0; lane < kLanes; lane++)
+                {
+                    lanes[0][lane] += w0[lane] * x[lane];
+                    lanes[1][lane] += w1[lane] * x[lane];
+                    lanes[2][lane] += w2[lane] * x[lane];
+                    lanes[3][lane] += w3[lane] * x[lane];
+                }
+            }
+            
+            for (int row = 0; row < kRows; row++)
+            {
+                outputs[nodeOut + row] = finish(lanes[row], rows + row * NumInputs, inputs, biases()[nodeOut + row]);
+            }
+        }
+        
+        for (int nodeOut = kBlockedOutputs; nodeOut < NumOutputs; nodeOut++)
+        {
+            const float* row = weights() + nodeOut * NumInputs;
+            
+            float lanes[kLanes] = {};
+            for (int nodeIn = 0; nodeIn < kBody; nodeIn += kLanes)
+            {
+                for (int lane = 0; lane < kLanes; lane++)
+                {
+                    lanes[lane] += row[nodeIn + lane] * inputs[nodeIn + lane];
+                }
+            }
+            
+            outputs[nodeOut] = finish(lanes, row, inputs, biases()[nodeOut]);
+        }
+    }
+    
+private:
+    // Adds the columns past the last full group of lanes, then the lanes themselves
+    template <int Lanes>
+    static float finish(const float (&lanes)[Lanes], const float* row, const float* inputs, float bias)
+    {
+        constexpr int kBody = NumInputs / Lanes * Lanes;
+        
+        float sum = bias;
+        for (int nodeIn = kBody; nodeIn < NumInputs; nodeIn++)
+        {
+            sum += row[nodeIn] * inputs[nodeIn];
+        }
+        for (int lane = 0; lane < Lanes; lane++)
+        {
+            sum += lanes[lane];
+        }
+        return sum;
+    }
+};
+
+// Inference only network with the topology and hidden activation fixed at compile time, e.g.
+// StaticNetwork<ActivationType::Sigmoid, 784, 100, 100, 10>. The output layer is softmax like Network's,
+// and weights are read from and written to the ModelFile format Network uses.
+// The parameters live inline, so allocate large topologies on the heap (std::make_unique).
+template <ActivationType HiddenActivation, int... LayerSizes>
+class StaticNetwork
+{
+    static_assert(sizeof...(LayerSizes) >= 2, "StaticNetwork needs an input and an output layer");
+    
+    static constexpr std::array<int, sizeof...(LayerSizes)> kLayerSizes = { LayerSizes... };
+    
+public:
+    static constexpr int kNumLayers = (int) sizeof...(LayerSizes) - 1;
+    static constexpr int kNumInputs = kLayerSizes[0];
+    static constexpr int kNumOutputs = kLayerSizes[kNumLayers];
+    
+    // Reads dense and sparse (version 2) files alike, a sparse one with its zeros filled back in.
+    // Throws std::runtime_error if the file is invalid or was saved from a different topology or activation
+    void loadWeights(const std::string& filePath)
+    {
+        ModelFile model = ModelFile::read(filePath);
+        
+        if (model.layerSizes != std::vector<int>(kLayerSizes.begin(), kLayerSizes.end()))
+        {
+            throw std::runtime_error(filePath + " does not match the compiled layer sizes");
+        }
+        if (model.activationType != HiddenActivation)
+        {
+            throw std::runtime_error(filePath + " was trained with a different activation");
+        }
+        
+        forEachLayer([&](auto& layer, int index)
+        {
+            if (model.sparse)
+            {
+                model.expandLayerParameters(index, layer.parameters.data());
+            }
+            else
+            {
+                std::memcpy(layer.parameters.data(), model.layerParameters(index), sizeof(layer.parameters));
+            }
+        });
+    }
+    
+    void saveWeights(const std::string& filePath, CostType costType = CostType::CrossEntropy) const
+    {
+        std::vector<const float*> layerParameters;
+        forEachLayer([&](const auto& layer, int)
+        {
+            layerParameters.push_back(layer.parameters.data());
+        });
+        
+        ModelFile::write(filePath, std::vector<int>(kLayerSizes.begin(), kLayerSizes.end()), HiddenActivation, costType, layerParameters);
+    }
+    
+    // Single sample, no heap allocation: intermediate activations live on the stack
+    void forwardPass(std::span<const float, kNumInputs> inputs, std::span<float, kNumOutputs> outputs) const
+    {
+        forwardPass(inputs.data(), outputs.data(), std::make_index_sequence<kNumLayers>());
+    }
+    
+    int classify(std::span<const float, kNumInputs> inputs) const
+    {
+        std::array<float, kNumOutputs> outputs;
+        forwardPass(inputs, outputs);
+        
+        int index = 0;
+        for (int i = 1; i < kNumOutputs; i++)
+        {
+            if (outputs[i] > outputs[index])
+            {
+                index = i;
+            }
+        }
+        return index;
+    }
+    
+private:
+    static constexpr int maxHiddenSize()
+    {
+        int size = 1;
+        for (int i = 1; i < kNumLayers; i++)
+        {
+            size = std::max(size, kLayerSizes[i]);
+        }
+        return size;
+    }
+    
+    template <typename Sequence>
+    struct LayerTuple;
+    
+    template <size_t... Index>
+    struct LayerTuple<std::index_sequence<Index...>>
+    {
+        using type = std::tuple<StaticLayer<kLayerSizes[Index], kLayerSizes[Index + 1]>...>;
+    };
+    
+    template <typename Fn>
+    void forEachLayer(Fn&& fn)
+    {
+        std::apply([&](auto&... layers)
+        {
+            int index = 0;
+            (fn(layers, index++), ...);
+        }, m_layers);
+    }
+    
+    template <typename Fn>
+    void forEachLayer(Fn&& fn) const
+    {
+        std::apply([&](const auto&... layers)
+        {
+            int index = 0;
+            (fn(layers, index++), ...);
+        }, m_layers);
+    }
+    
+    template <size_t... Index>
+    void forwardPass(const float* inputs, float* outputs, std::index_sequence<Index...>) const
+    {
+        alignas(kCacheLineSize) float buffers[2][maxHiddenSize()];
+        
+        const float* layerInputs = inputs;
+        (forwardLayer<Index>(layerInputs, Index == kNumLayers - 1 ? outputs : buffers[Index % 2]), ...);
+    }
+    
+    template <size_t Index>
+    void forwardLayer(const float*& inputs, float* outputs) const
+    {
+        constexpr int kSize = kLayerSizes[Index + 1];
+        constexpr ActivationType kActivation = Index == kNumLayers - 1 ? ActivationType::Softmax : HiddenActivation;
+        
+        std::get<Index>(m_layers).weightedInputs(inputs, outputs);
+        Activation::activate(std::span<float>(outputs, kSize), kActivation);
+        
+        inputs = outputs;
+    }
+    
+private:
+    typename LayerTuple<std::make_index_sequence<kNumLayers>>::type m_layers;
+};
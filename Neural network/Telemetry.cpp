@@ -0,0 +1,174 @@
+//
+//  Telemetry.cpp
+//  Neural network
+//
+
+#include "Telemetry.hpp"
+
+#include <algorithm>
+#include <ostream>
+
+void Telemetry::enable(std::ostream* output, Callback callback, int reportInterval)
+{
+    m_enabled = true;
+    m_output = output;
+    m_callback = std::move(callback);
+    m_reportInterval = std::max(1, reportInterval);
+}
+
+void Telemetry::disable()
+{
+    m_enabled = false;
+    m_output = nullptr;
+    m_callback = nullptr;
+}
+
+const char* Telemetry::phaseName(TelemetryPhase phase)
+{
+    switch (phase)
+    {
+        case TelemetryPhase::DataFetch: return "data_fetch";
+        case TelemetryPhase::Forward: return "forward";
+        case TelemetryPhase::Backward: return "backward";
+        case TelemetryPhase::Reduction: return "reduction";
+        case TelemetryPhase::ApplyGradient: return "apply_gradient";
+    }
+    return "";
+}
+
+void Telemetry::begin(int numWorkers)
+{
+    if (!enabled())
+    {
+        return;
+    }
+    
+    m_workers = std::make_unique<WorkerCounters[]>(numWorkers);
+    m_numWorkers = numWorkers;
+    
+    m_batch = 0;
+    m_reported = Totals();
+    m_reported.busyNanoseconds.assign(numWorkers, 0);
+    m_reportedTime = std::chrono::steady_clock::now();
+}
+
+void Telemetry::addTime(int worker, TelemetryPhase phase, std::chrono::steady_clock::duration elapsed)
+{
+    // enabled outside of train(), or the pool grew since begin
+    if (worker >= m_numWorkers)
+    {
+        return;
+    }
+    
+    add<int64_t>(m_workers[worker].nanoseconds[(int) phase], std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+void Telemetry::addSamples(int worker, int numSamples, int numCorrect, double loss)
+{
+    if (worker >= m_numWorkers)
+    {
+        return;
+    }
+    
+    WorkerCounters& counters = m_workers[worker];
+    add<int64_t>(counters.numSamples, numSamples);
+    add<int64_t>(counters.numCorrect, numCorrect);
+    add<double>(counters.loss, loss);
+}
+
+Telemetry::Totals Telemetry::totals() const
+{
+    Totals totals;
+    totals.busyNanoseconds.assign(m_numWorkers, 0);
+    
+    for (int worker = 0; worker < m_numWorkers; worker++)
+    {
+        const WorkerCounters& counters = m_workers[worker];
+        for (int phase = 0; phase < kNumTelemetryPhases; phase++)
+        {
+            int64_t nanoseconds = counters.nanoseconds[phase].load(std::memory_order_relaxed);
+            totals.nanoseconds[phase] += nanoseconds;
+            totals.busyNanoseconds[worker] += nanoseconds;
+        }
+        totals.numSamples += counters.numSamples.load(std::memory_order_relaxed);
+        totals.numCorrect += counters.numCorrect.load(std::memory_order_relaxed);
+        totals.loss += counters.loss.load(std::memory_order_relaxed);
+    }
+    
+    return totals;
+}
+
+void Telemetry::endBatch(int epoch, bool endOfEpoch)
+{
+    if (!enabled())
+    {
+        return;
+    }
+    
+    m_batch++;
+    if (m_batch % m_reportInterval != 0 && !endOfEpoch)
+    {
+        return;
+    }
+    
+    auto now = std::chrono::steady_clock::now();
+    Totals current = totals();
+    
+    TelemetryReport report;
+    report.epoch = epoch;
+    report.batch = m_batch;
+    report.endOfEpoch = endOfEpoch;
+    report.seconds = std::chrono::duration<double>(now - m_reportedTime).count();
+    report.numSamples = current.numSamples - m_reported.numSamples;
+    report.samplesPerSecond = report.numSamples / std::max(report.seconds, 1e-9);
+    
+    if (report.numSamples > 0)
+    {
+        report.accuracy = (current.numCorrect - m_reported.numCorrect) / (float) report.numSamples;
+        report.loss = (float) ((current.loss - m_reported.loss) / report.numSamples);
+    }
+    
+    for (int phase = 0; phase < kNumTelemetryPhases; phase++)
+    {
+        report.phaseSeconds[phase] = (current.nanoseconds[phase] - m_reported.nanoseconds[phase]) * 1e-9;
+    }
+    
+    report.threadUtilization.resize(m_numWorkers);
+    for (int worker = 0; worker < m_numWorkers; worker++)
+    {
+        double busy = (current.busyNanoseconds[worker] - m_reported.busyNanoseconds[worker]) * 1e-9;
+        report.threadUtilization[worker] = (float) (busy / std::max(report.seconds, 1e-9));
+    }
+    
+    m_reported = std::move(current);
+    m_reportedTime = now;
+    
+    this->report(report);
+}
+
+void Telemetry::report(const TelemetryReport& report) const
+{
+    if (m_output)
+    {
+        std::ostream& out = *m_output;
+        out << "{\"epoch\":" << report.epoch << ",\"batch\":" << report.batch << ",\"end_of_epoch\":" << (report.endOfEpoch ? "true" : "false");
+        out << ",\"seconds\":" << report.seconds << ",\"samples\":" << report.numSamples << ",\"samples_per_second\":" << report.samplesPerSecond;
+        out << ",\"accuracy\":" << report.accuracy << ",\"loss\":" << report.loss << ",\"phase_seconds\":{";
+        for (int phase = 0; phase < kNumTelemetryPhases; phase++)
+        {
+            out << (phase ? "," : "") << "\"" << phaseName((TelemetryPhase) phase) << "\":" << report.phaseSeconds[phase];
+        }
+        out << "},\"thread_utilization\":[";
+        for (int worker = 0; worker < report.threadUtilization.size(); worker++)
+        {
+            out << (worker ? "," : "") << report.threadUtilization[worker];
+        }
+        out << "]}\n";
+        out.flush();
+    }
+    
+    if (m_callback)
+    {
+        m_callback(report);
+    }
+}
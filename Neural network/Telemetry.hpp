@@ -0,0 +1,152 @@
+//
+//  Telemetry.hpp
+//  Neural network
+//
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <vector>
+
+#include "AlignedAllocator.hpp"
+
+// Build with NN_TELEMETRY=0 to compile every timer and counter out of the training loop
+#ifndef NN_TELEMETRY
+#define NN_TELEMETRY 1
+#endif
+
+enum class TelemetryPhase
+{
+    DataFetch,     // waiting on the batch pipeline and slicing batches into chunks
+    Forward,
+    Backward,      // node values and per-chunk gradients
+    Reduction,     // summing chunk gradients into the layers
+    ApplyGradient
+};
+
+constexpr int kNumTelemetryPhases = 5;
+
+// Training statistics over the mini-batches since the previous report
+struct TelemetryReport
+{
+    int epoch = 0;
+    int64_t batch = 0; // mini-batches trained so far in this train() call
+    bool endOfEpoch = false;
+    
+    double seconds = 0; // wall time covered
+    int64_t numSamples = 0;
+    double samplesPerSecond = 0;
+    float accuracy = 0;
+    float loss = 0; // mean cost per sample
+    
+    std::array<double, kNumTelemetryPhases> phaseSeconds{}; // summed over the workers
+    std::vector<float> threadUtilization; // per pool worker, share of seconds spent inside a phase
+};
+
+// Per-phase timers and loss/accuracy counters for Network::train. Every pool worker owns one
+// cache line of relaxed atomics that only it writes, so the hot path never locks or contends;
+// the training thread folds them into a report every few mini-batches and at each epoch's end.
+class Telemetry
+{
+public:
+    using Callback = std::function<void(const TelemetryReport&)>;
+    
+    static constexpr bool kCompiled = NN_TELEMETRY != 0;
+    
+    // Reports are written to output as JSON lines and/or passed to callback, either may be null
+    void enable(std::ostream* output, Callback callback = nullptr, int reportInterval = 100);
+    void disable();
+    bool enabled() const { return kCompiled && m_enabled; }
+    
+    static const char* phaseName(TelemetryPhase phase);
+    
+    // Starts the clock and clears the counters, one slot per pool worker. Times and samples from
+    // workers without a slot, e.g. before the first begin, are dropped.
+    void begin(int numWorkers);
+    
+    void addTime(int worker, TelemetryPhase phase, std::chrono::steady_clock::duration elapsed);
+    void addSamples(int worker, int numSamples, int numCorrect, double loss);
+    
+    // Training thread, once the mini-batch's parallel work is done
+    void endBatch(int epoch, bool endOfEpoch);
+    
+    // Adds the time until it goes out of scope to phase, free when telemetry is off
+    class ScopedTimer
+    {
+    public:
+        ScopedTimer(Telemetry& telemetry, int worker, TelemetryPhase phase)
+        : m_telemetry(telemetry.enabled() ? &telemetry : nullptr), m_worker(worker), m_phase(phase)
+        {
+            if (m_telemetry)
+            {
+                m_start = std::chrono::steady_clock::now();
+            }
+        }
+        
+        ~ScopedTimer()
+        {
+            if (m_telemetry)
+            {
+                m_telemetry->addTime(m_worker, m_phase, std::chrono::steady_clock::now() - m_start);
+            }
+        }
+        
+        ScopedTimer(const ScopedTimer&) = delete;
+        ScopedTimer& operator=(const ScopedTimer&) = delete;
+    
+    private:
+        Telemetry* m_telemetry;
+        int m_worker;
+        TelemetryPhase m_phase;
+        std::chrono::steady_clock::time_point m_start;
+    };
+    
+private:
+    struct alignas(kCacheLineSize) WorkerCounters
+    {
+        std::array<std::atomic<int64_t>, kNumTelemetryPhases> nanoseconds{};
+        std::atomic<int64_t> numSamples{0};
+        std::atomic<int64_t> numCorrect{0};
+        std::atomic<double> loss{0};
+    };
+    
+    // Sums over the workers, so a report can subtract the previous one
+    struct Totals
+    {
+        std::array<int64_t, kNumTelemetryPhases> nanoseconds{};
+        std::vector<int64_t> busyNanoseconds;
+        int64_t numSamples = 0;
+        int64_t numCorrect = 0;
+        double loss = 0;
+    };
+    
+    Totals totals() const;
+    void report(const TelemetryReport& report) const;
+    
+    // Single writer, so a relaxed load and store is enough
+    template <typename T>
+    static void add(std::atomic<T>& counter, T value)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+    
+private:
+    bool m_enabled = false;
+    std::ostream* m_output = nullptr;
+    Callback m_callback;
+    int m_reportInterval = 100;
+    
+    std::unique_ptr<WorkerCounters[]> m_workers;
+    int m_numWorkers = 0;
+    
+    // Only touched by the training thread
+    int64_t m_batch = 0;
+    Totals m_reported;
+    std::chrono::steady_clock::time_point m_reportedTime;
+};
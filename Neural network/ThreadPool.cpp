@@ -0,0 +1,197 @@
+//
+//  ThreadPool.cpp
+//  Neural network
+//
+
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace
+{
+    // index of the pool worker running on this thread, -1 outside of a job
+    thread_local int t_workerIndex = -1;
+}
+
+ThreadPool::ThreadPool(int numThreads)
+{
+    if (numThreads <= 0)
+    {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    
+    for (int i = 0; i < numThreads; i++)
+    {
+        m_queues.push_back(std::make_unique<WorkerQueue>());
+    }
+    
+    // worker 0 is whichever thread calls parallelFor
+    for (int i = 1; i < numThreads; i++)
+    {
+        m_threads.emplace_back([this, i](){ this->workerLoop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    
+    for (auto& thread : m_threads)
+    {
+        thread.join();
+    }
+}
+
+void ThreadPool::parallelFor(int count, int grain, const std::function<void(int, int, int)>& fn)
+{
+    if (count <= 0)
+    {
+        return;
+    }
+    
+    grain = std::max(1, grain);
+    int numChunks = (count + grain - 1) / grain;
+    
+    if (t_workerIndex >= 0 || m_threads.empty() || numChunks == 1)
+    {
+        int workerIndex = std::max(0, t_workerIndex);
+        for (int begin = 0; begin < count; begin += grain)
+        {
+            fn(begin, std::min(begin + grain, count), workerIndex);
+        }
+        return;
+    }
+    
+    std::lock_guard<std::mutex> submitLock(m_submitMutex);
+    
+    m_job = &fn;
+    m_remaining.store(numChunks);
+    
+    // contiguous runs of chunks per worker, so un-stolen work stays local
+    for (int chunk = 0; chunk < numChunks; chunk++)
+    {
+        int worker = (int) ((long) chunk * size() / numChunks);
+        int begin = chunk * grain;
+        
+        std::lock_guard<std::mutex> lock(m_queues[worker]->mutex);
+        m_queues[worker]->chunks.emplace_back(begin, std::min(begin + grain, count));
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_generation++;
+    }
+    m_wake.notify_all();
+    
+    t_workerIndex = 0;
+    runChunks(0);
+    t_workerIndex = -1;
+    
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this](){ return m_remaining.load() == 0; });
+    m_job = nullptr;
+}
+
+void ThreadPool::workerLoop(int workerIndex)
+{
+    unsigned long seenGeneration = 0;
+    
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [&](){ return m_stop || m_generation != seenGeneration; });
+            
+            if (m_stop)
+            {
+                return;
+            }
+            seenGeneration = m_generation;
+        }
+        
+        t_workerIndex = workerIndex;
+        runChunks(workerIndex);
+        t_workerIndex = -1;
+    }
+}
+
+void ThreadPool::runChunks(int workerIndex)
+{
+    std::pair<int, int> chunk;
+    while (popChunk(workerIndex, chunk))
+    {
+        (*m_job)(chunk.first, chunk.second, workerIndex);
+        
+        if (m_remaining.fetch_sub(1) == 1)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_done.notify_all();
+        }
+    }
+}
+
+bool ThreadPool::popChunk(int workerIndex, std::pair<int, int>& chunk)
+{
+    {
+        WorkerQueue& own = *m_queues[workerIndex];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.chunks.empty())
+        {
+            chunk = own.chunks.front();
+            own.chunks.pop_front();
+            return true;
+        }
+    }
+    
+    // steal from the back of the other queues
+    for (int offset = 1; offset < size(); offset++)
+    {
+        WorkerQueue& victim = *m_queues[(workerIndex + offset) % size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.chunks.empty())
+        {
+            chunk = victim.chunks.back();
+            victim.chunks.pop_back();
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+bool ThreadPool::pinCurrentThread(int index)
+{
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0)
+    {
+        return false;
+    }
+    
+    index %= CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed) && index-- == 0)
+        {
+            cpu_set_t target;
+            CPU_ZERO(&target);
+            CPU_SET(cpu, &target);
+            return pthread_setaffinity_np(pthread_self(), sizeof(target), &target) == 0;
+        }
+    }
+    return false;
+#else
+    (void) index;
+    return false;
+#endif
+}
@@ -0,0 +1,65 @@
+//
+//  ThreadPool.hpp
+//  Neural network
+//
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent worker pool. parallelFor splits a range into chunks, deals them out
+// to per-worker queues and lets idle workers steal from the back of busy ones.
+// The calling thread takes part as worker 0, so a pool of size 1 runs inline.
+class ThreadPool
+{
+public:
+    // numThreads <= 0 sizes the pool to the hardware
+    ThreadPool(int numThreads = 0);
+    ~ThreadPool();
+    
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    
+    int size() const { return (int) m_queues.size(); }
+    
+    // Calls fn(begin, end, workerIndex) for every chunk of [0, count) and blocks until all are done.
+    // Nested calls from inside a job run inline on the calling worker.
+    void parallelFor(int count, int grain, const std::function<void(int, int, int)>& fn);
+    
+    // Pins the calling thread to the index-th (mod count) CPU the process may run on.
+    // Returns false where affinity isn't supported (anything but Linux) or it failed.
+    static bool pinCurrentThread(int index);
+    
+private:
+    struct WorkerQueue
+    {
+        std::mutex mutex;
+        std::deque<std::pair<int, int>> chunks;
+    };
+    
+    void workerLoop(int workerIndex);
+    void runChunks(int workerIndex);
+    bool popChunk(int workerIndex, std::pair<int, int>& chunk);
+    
+private:
+    std::vector<std::thread> m_threads;
+    std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+    
+    std::mutex m_submitMutex;
+    
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    
+    const std::function<void(int, int, int)>* m_job = nullptr;
+    unsigned long m_generation = 0;
+    std::atomic<int> m_remaining { 0 };
+    bool m_stop = false;
+};
@@ -0,0 +1,404 @@
+//
+//  Transport.cpp
+//  Neural network
+//
+
+#include "Transport.hpp"
+#include "Kernels.hpp"
+#include "AlignedAllocator.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+    constexpr int kSpinsBeforeYield = 1024;
+    
+    struct SegmentHeader
+    {
+        alignas(kCacheLineSize) std::atomic<bool> aborted;
+    };
+    
+    size_t segmentIndex(size_t count, int segment, int numSegments)
+    {
+        return count * segment / numSegments;
+    }
+}
+
+// -- Collectives --
+
+void Transport::allreduceSum(float* data, size_t count)
+{
+    int numRanks = size();
+    if (numRanks == 1 || count == 0)
+    {
+        return;
+    }
+    
+    m_scratch.resize(count / numRanks + 1);
+    
+    // Reduce-scatter: after numRanks - 1 steps this rank holds the full sum of segment rank + 1
+    for (int step = 0; step < numRanks - 1; step++)
+    {
+        int sendSegment = (rank() - step + numRanks) % numRanks;
+        int receiveSegment = (rank() - step - 1 + numRanks) % numRanks;
+        
+        size_t sendBegin = segmentIndex(count, sendSegment, numRanks);
+        size_t sendCount = segmentIndex(count, sendSegment + 1, numRanks) - sendBegin;
+        size_t receiveBegin = segmentIndex(count, receiveSegment, numRanks);
+        size_t receiveCount = segmentIndex(count, receiveSegment + 1, numRanks) - receiveBegin;
+        
+        sendReceive(data + sendBegin, sendCount * sizeof(float), m_scratch.data(), receiveCount * sizeof(float));
+        Kernels::axpy(1.0f, m_scratch.data(), data + receiveBegin, (int) receiveCount);
+    }
+    
+    // Allgather: pass the finished segments around the ring
+    for (int step = 0; step < numRanks - 1; step++)
+    {
+        int sendSegment = (rank() + 1 - step + numRanks) % numRanks;
+        int receiveSegment = (rank() - step + numRanks) % numRanks;
+        
+        size_t sendBegin = segmentIndex(count, sendSegment, numRanks);
+        size_t sendCount = segmentIndex(count, sendSegment + 1, numRanks) - sendBegin;
+        size_t receiveBegin = segmentIndex(count, receiveSegment, numRanks);
+        size_t receiveCount = segmentIndex(count, receiveSegment + 1, numRanks) - receiveBegin;
+        
+        sendReceive(data + sendBegin, sendCount * sizeof(float), data + receiveBegin, receiveCount * sizeof(float));
+    }
+}
+
+void Transport::broadcast(void* data, size_t bytes, int root)
+{
+    int numRanks = size();
+    
+    // The copy moves one hop along the ring per step, everyone else passes empty messages
+    int distance = (rank() - root + numRanks) % numRanks;
+    for (int step = 0; step < numRanks - 1; step++)
+    {
+        sendReceive(data, distance == step ? bytes : 0, data, distance == step + 1 ? bytes : 0);
+    }
+}
+
+// -- Shared memory --
+
+struct SharedMemoryTransport::Slot
+{
+    alignas(kCacheLineSize) std::atomic<uint64_t> written; // pieces the owner has published
+    alignas(kCacheLineSize) std::atomic<uint64_t> read; // pieces the next rank has copied out
+    
+    unsigned char* data() { return reinterpret_cast<unsigned char*>(this + 1); }
+};
+
+SharedMemoryTransport::SharedMemoryTransport(int numRanks, size_t slotBytes)
+: m_numRanks(numRanks), m_slotBytes(roundToCacheLine<unsigned char>(slotBytes))
+{
+    m_segmentSize = sizeof(SegmentHeader) + numRanks * (sizeof(Slot) + m_slotBytes);
+    
+    // Unlinked straight away, the mapping lives on in this process and every child forked from it
+    std::string name = "/nn-transport-" + std::to_string(getpid()) + "-" + std::to_string((uintptr_t) this);
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Could not create shared memory " + name);
+    }
+    shm_unlink(name.c_str());
+    
+    if (ftruncate(fd, (off_t) m_segmentSize) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("Could not size shared memory " + name);
+    }
+    
+    void* segment = mmap(nullptr, m_segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED)
+    {
+        throw std::runtime_error("Could not map shared memory " + name);
+    }
+    m_segment = static_cast<unsigned char*>(segment);
+    
+    new (m_segment) SegmentHeader{ false };
+    for (int i = 0; i < numRanks; i++)
+    {
+        Slot* newSlot = new (&slot(i)) Slot;
+        newSlot->written.store(0);
+        newSlot->read.store(0);
+    }
+}
+
+SharedMemoryTransport::~SharedMemoryTransport()
+{
+    munmap(m_segment, m_segmentSize);
+}
+
+SharedMemoryTransport::Slot& SharedMemoryTransport::slot(int rank) const
+{
+    return *reinterpret_cast<Slot*>(m_segment + sizeof(SegmentHeader) + rank * (sizeof(Slot) + m_slotBytes));
+}
+
+void SharedMemoryTransport::abort()
+{
+    reinterpret_cast<SegmentHeader*>(m_segment)->aborted.store(true, std::memory_order_release);
+}
+
+void SharedMemoryTransport::waitFor(const void* counter, uint64_t value) const
+{
+    const std::atomic<uint64_t>& sequence = *static_cast<const std::atomic<uint64_t>*>(counter);
+    const SegmentHeader& header = *reinterpret_cast<const SegmentHeader*>(m_segment);
+    
+    for (int spins = 0; sequence.load(std::memory_order_acquire) < value; spins++)
+    {
+        if (header.aborted.load(std::memory_order_relaxed))
+        {
+            throw std::runtime_error("[SharedMemoryTransport] A peer process failed");
+        }
+        if (spins >= kSpinsBeforeYield)
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void SharedMemoryTransport::sendReceive(const void* sendData, size_t sendBytes, void* receiveData, size_t receiveBytes)
+{
+    Slot& outgoing = slot(m_rank);
+    Slot& incoming = slot((m_rank + m_numRanks - 1) % m_numRanks);
+    
+    // Messages larger than a slot go in pieces, alternating sends and receives so neither side can stall the ring
+    size_t numSendPieces = (sendBytes + m_slotBytes - 1) / m_slotBytes;
+    size_t numReceivePieces = (receiveBytes + m_slotBytes - 1) / m_slotBytes;
+    
+    for (size_t piece = 0; piece < std::max(numSendPieces, numReceivePieces); piece++)
+    {
+        size_t offset = piece * m_slotBytes;
+        
+        if (piece < numSendPieces)
+        {
+            waitFor(&outgoing.read, m_numSent);
+            std::memcpy(outgoing.data(), static_cast<const unsigned char*>(sendData) + offset, std::min(m_slotBytes, sendBytes - offset));
+            outgoing.written.store(++m_numSent, std::memory_order_release);
+        }
+        
+        if (piece < numReceivePieces)
+        {
+            waitFor(&incoming.written, m_numReceived + 1);
+            std::memcpy(static_cast<unsigned char*>(receiveData) + offset, incoming.data(), std::min(m_slotBytes, receiveBytes - offset));
+            incoming.read.store(++m_numReceived, std::memory_order_release);
+        }
+    }
+}
+
+// -- TCP --
+
+namespace
+{
+    void splitEndpoint(const std::string& endpoint, std::string& host, std::string& port)
+    {
+        size_t colon = endpoint.rfind(':');
+        if (colon == std::string::npos)
+        {
+            throw std::runtime_error("Endpoint " + endpoint + " is not host:port");
+        }
+        host = endpoint.substr(0, colon);
+        port = endpoint.substr(colon + 1);
+    }
+    
+    addrinfo* resolve(const std::string& endpoint, bool passive)
+    {
+        std::string host, port;
+        splitEndpoint(endpoint, host, port);
+        
+        addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = passive ? AI_PASSIVE : 0;
+        
+        addrinfo* result = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0)
+        {
+            throw std::runtime_error("Could not resolve " + endpoint);
+        }
+        return result;
+    }
+    
+    void setNoDelay(int socket)
+    {
+        int one = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+}
+
+TcpTransport::TcpTransport(int rank, const std::vector<std::string>& endpoints, int timeoutSeconds)
+: m_rank(rank), m_numRanks((int) endpoints.size())
+{
+    if (m_numRanks == 1)
+    {
+        return;
+    }
+    
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSeconds);
+    
+    addrinfo* local = resolve(endpoints[rank], true);
+    int listener = socket(local->ai_family, local->ai_socktype, local->ai_protocol);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    bool listening = listener >= 0 && bind(listener, local->ai_addr, local->ai_addrlen) == 0 && listen(listener, 1) == 0;
+    freeaddrinfo(local);
+    if (!listening)
+    {
+        close(listener);
+        throw std::runtime_error("Could not listen on " + endpoints[rank]);
+    }
+    
+    // The next rank may not be listening yet
+    const std::string& next = endpoints[(rank + 1) % m_numRanks];
+    addrinfo* remote = resolve(next, false);
+    while (true)
+    {
+        m_nextSocket = socket(remote->ai_family, remote->ai_socktype, remote->ai_protocol);
+        if (connect(m_nextSocket, remote->ai_addr, remote->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(m_nextSocket);
+        m_nextSocket = -1;
+        
+        if (std::chrono::steady_clock::now() > deadline)
+        {
+            freeaddrinfo(remote);
+            close(listener);
+            throw std::runtime_error("Could not connect to " + next);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    freeaddrinfo(remote);
+    
+    pollfd waiting = { listener, POLLIN, 0 };
+    int timeout = (int) std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    if (poll(&waiting, 1, std::max(timeout, 0)) == 1)
+    {
+        m_previousSocket = accept(listener, nullptr, nullptr);
+    }
+    close(listener);
+    
+    if (m_previousSocket < 0)
+    {
+        close(m_nextSocket);
+        throw std::runtime_error("No connection from the previous rank on " + endpoints[rank]);
+    }
+    
+    setNoDelay(m_nextSocket);
+    setNoDelay(m_previousSocket);
+}
+
+TcpTransport::~TcpTransport()
+{
+    if (m_nextSocket >= 0)
+    {
+        close(m_nextSocket);
+    }
+    if (m_previousSocket >= 0)
+    {
+        close(m_previousSocket);
+    }
+}
+
+void TcpTransport::sendReceive(const void* sendData, size_t sendBytes, void* receiveData, size_t receiveBytes)
+{
+    if (m_numRanks == 1)
+    {
+        std::memcpy(receiveData, sendData, std::min(sendBytes, receiveBytes));
+        return;
+    }
+    
+    // Both directions at once, or two ranks sending more than the socket buffers hold would wait on each other
+    size_t sent = 0;
+    size_t received = 0;
+    while (sent < sendBytes || received < receiveBytes)
+    {
+        pollfd sockets[2] = {
+            { m_nextSocket, (short) (sent < sendBytes ? POLLOUT : 0), 0 },
+            { m_previousSocket, (short) (received < receiveBytes ? POLLIN : 0), 0 }
+        };
+        if (poll(sockets, 2, -1) < 0)
+        {
+            throw std::runtime_error("[TcpTransport] poll failed");
+        }
+        
+        if (sockets[0].revents & (POLLERR | POLLHUP))
+        {
+            throw std::runtime_error("[TcpTransport] Lost the connection to the next rank");
+        }
+        if (sockets[0].revents & POLLOUT)
+        {
+            ssize_t count = send(m_nextSocket, static_cast<const unsigned char*>(sendData) + sent, sendBytes - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                throw std::runtime_error("[TcpTransport] Lost the connection to the next rank");
+            }
+            sent += std::max<ssize_t>(count, 0);
+        }
+        
+        if (sockets[1].revents & (POLLIN | POLLERR | POLLHUP))
+        {
+            ssize_t count = recv(m_previousSocket, static_cast<unsigned char*>(receiveData) + received, receiveBytes - received, MSG_DONTWAIT);
+            if (count == 0 || (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                throw std::runtime_error("[TcpTransport] Lost the connection to the previous rank");
+            }
+            received += std::max<ssize_t>(count, 0);
+        }
+    }
+}
+
+std::vector<std::string> TcpTransport::loopbackEndpoints(int numRanks)
+{
+    // Ports the kernel hands out for binding to port 0, all held until the end so none repeats
+    std::vector<std::string> endpoints;
+    std::vector<int> probes;
+    for (int i = 0; i < numRanks; i++)
+    {
+        int probe = socket(AF_INET, SOCK_STREAM, 0);
+        probes.push_back(probe);
+        
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        
+        if (probe < 0 || bind(probe, (sockaddr*) &address, sizeof(address)) != 0 || getsockname(probe, (sockaddr*) &address, &length) != 0)
+        {
+            endpoints.clear();
+            break;
+        }
+        
+        endpoints.push_back("127.0.0.1:" + std::to_string(ntohs(address.sin_port)));
+    }
+    
+    for (int probe : probes)
+    {
+        close(probe);
+    }
+    
+    if (endpoints.empty())
+    {
+        throw std::runtime_error("Could not find a free loopback port");
+    }
+    return endpoints;
+}
@@ -0,0 +1,111 @@
+//
+//  Transport.hpp
+//  Neural network
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class TransportType
+{
+    SharedMemory, // processes on this machine
+    Tcp           // loopback here, or other machines
+};
+
+// Point to point link between the replicas of a data parallel run, arranged in a ring. Backends only
+// move bytes to the next rank and from the previous one; the collectives are built on top of that.
+class Transport
+{
+public:
+    virtual ~Transport() = default;
+    
+    virtual int rank() const = 0;
+    virtual int size() const = 0;
+    
+    // Sends sendBytes to rank + 1 while receiving receiveBytes from rank - 1 (mod size), blocks until both are done.
+    // Either size may be 0, as long as the peer on the other end passes the same size.
+    // Throws std::runtime_error if a peer fails.
+    virtual void sendReceive(const void* sendData, size_t sendBytes, void* receiveData, size_t receiveBytes) = 0;
+    
+    // Ring allreduce: reduce-scatter then allgather. Every element's sum is computed on one rank in a fixed
+    // order and copied to the others, so all ranks end up with bit-identical results.
+    void allreduceSum(float* data, size_t count);
+    
+    // Overwrites data on every rank with root's copy
+    void broadcast(void* data, size_t bytes, int root = 0);
+    
+private:
+    std::vector<float> m_scratch; // one received segment of allreduceSum
+};
+
+// Ring over a POSIX shared memory segment. Construct it before fork() so every process inherits the
+// mapping, then call setRank in each of them. Every rank owns an outgoing slot that only its next rank
+// reads, handed over with a pair of sequence counters, so no locks are involved.
+class SharedMemoryTransport : public Transport
+{
+public:
+    SharedMemoryTransport(int numRanks, size_t slotBytes = 1 << 20);
+    ~SharedMemoryTransport();
+    
+    SharedMemoryTransport(const SharedMemoryTransport&) = delete;
+    SharedMemoryTransport& operator=(const SharedMemoryTransport&) = delete;
+    
+    void setRank(int rank) { m_rank = rank; }
+    
+    int rank() const override { return m_rank; }
+    int size() const override { return m_numRanks; }
+    
+    void sendReceive(const void* sendData, size_t sendBytes, void* receiveData, size_t receiveBytes) override;
+    
+    // Makes every rank's pending and future sendReceive throw, for when a process died
+    void abort();
+    
+private:
+    struct Slot;
+    
+    Slot& slot(int rank) const;
+    void waitFor(const void* counter, uint64_t value) const;
+    
+private:
+    int m_numRanks;
+    int m_rank = 0;
+    size_t m_slotBytes;
+    
+    unsigned char* m_segment = nullptr;
+    size_t m_segmentSize = 0;
+    
+    uint64_t m_numSent = 0; // pieces this rank has written to its slot
+    uint64_t m_numReceived = 0; // pieces it has read from the previous rank's
+};
+
+// Ring over TCP, for replicas on other machines or a loopback stand-in for them.
+// endpoints[i] is "host:port" of rank i; this rank listens on its own port, connects to the next rank
+// and accepts the previous one. Connecting retries for timeoutSeconds before throwing std::runtime_error.
+class TcpTransport : public Transport
+{
+public:
+    TcpTransport(int rank, const std::vector<std::string>& endpoints, int timeoutSeconds = 30);
+    ~TcpTransport();
+    
+    TcpTransport(const TcpTransport&) = delete;
+    TcpTransport& operator=(const TcpTransport&) = delete;
+    
+    int rank() const override { return m_rank; }
+    int size() const override { return m_numRanks; }
+    
+    void sendReceive(const void* sendData, size_t sendBytes, void* receiveData, size_t receiveBytes) override;
+    
+    // numRanks free loopback endpoints, for running every rank on this machine
+    static std::vector<std::string> loopbackEndpoints(int numRanks);
+    
+private:
+    int m_rank;
+    int m_numRanks;
+    
+    int m_nextSocket = -1; // to rank + 1
+    int m_previousSocket = -1; // from rank - 1
+};
@@ -6,6 +6,8 @@
 //
 
 #include <iostream>
+#include <fstream>
+#include <iomanip>
 #include <vector>
 #include <cmath>
 //#include <distance>
@@ -19,21 +21,45 @@ int main(int argc, const char * argv[])
 {
     Network network( {784, 100, 100, 10}, ActivationType::Sigmoid, CostType::CrossEntropy );
     
-    network.initRandomWeights();
+    // directory with mnist_train.csv and mnist_test.csv, the trained weights are cached there as mnist.nnwt
+    const std::string datasetPath = argc > 1 ? argv[1] : "/Users/nathan/Downloads/mnist dataset";
     
-    network.loadData("/Users/nathan/Downloads/mnist dataset/mnist_train.csv", 784, 60000);
+    const std::string weightsPath = datasetPath + "/mnist.nnwt";
     
-    network.train(10, 100, 1.0f, 0.1f, 0.9f);
+    if (std::ifstream(weightsPath).good())
+    {
+        network.loadWeights(weightsPath);
+    }
+    else
+    {
+        network.initRandomWeights();
+        
+        network.loadData(datasetPath + "/mnist_train.csv", 784, 60000);
+        
+        network.train(10, 100, 1.0f, 0.1f, 0.9f);
+        
+        network.clearData();
+        
+        network.saveWeights(weightsPath);
+    }
 
-    network.clearData();
-
-    network.loadData("/Users/nathan/Downloads/mnist dataset/mnist_test.csv", 784, 10000);
+    network.loadData(datasetPath + "/mnist_test.csv", 784, 10000);
+    
+    EvaluationResult result = network.test();
     
-    network.test();
+    std::cout << result.numCorrect << "/" << result.numSamples << std::endl;
+    std::cout << result.accuracy * 100.0f << "%, loss " << result.loss << ", " << (int) result.samplesPerSecond << " samples/s" << std::endl;
     
-    network.loadWeights("/../..");
+    // rows are labels, columns predictions
+    for (int label = 0; label < result.numClasses; label++)
+    {
+        for (int prediction = 0; prediction < result.numClasses; prediction++)
+        {
+            std::cout << std::setw(6) << result.confusion(label, prediction);
+        }
+        std::cout << std::endl;
+    }
     
-    //network.saveWeights("/../..");
     //
     //network.calculateOutput( {1, 1, 1} ); //max value instead of whole vector
     //
@@ -0,0 +1,1865 @@
+//
+//  Tests.cpp
+//  Neural network
+//
+
+// Behaviour checks run by CTest. Every fast path is held to a plain float64 reference or to the per-sample path
+// it replaces: the kernels to naive loops, the batched layers to a reference forward and backward pass, and the
+// network to a forward pass over the weights file it saves. The data is synthetic and lives in a temp directory.
+//
+//   nn_tests [check ...]    runs the named checks, or all of them
+//
+// NN_KERNELS=scalar|sse|avx2|avx512 picks the kernels as usual; CMake registers the kernel check once per set.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <span>
+#include <array>
+#include <tuple>
+#include <memory>
+#include <random>
+#include <algorithm>
+#include <limits>
+#include <functional>
+#include <filesystem>
+#include <stdexcept>
+#include <atomic>
+#include <thread>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <unistd.h>
+
+#include "Activation.hpp"
+#include "BatchPipeline.hpp"
+#include "BFloat16.hpp"
+#include "Cost.hpp"
+#include "Dataset.hpp"
+#include "Kernels.hpp"
+#include "Layer.hpp"
+#include "MappedFile.hpp"
+#include "ModelFile.hpp"
+#include "NeuralNetwork.hpp"
+#include "Optimizer.hpp"
+#include "StaticNetwork.hpp"
+#include "Telemetry.hpp"
+#include "ThreadPool.hpp"
+
+// Counts the heap allocations, for the paths that promise to make none. Kept out of line so the compiler
+// never pairs an inlined free with a new it cannot see through.
+namespace
+{
+    std::atomic<long> numAllocations { 0 };
+}
+
+__attribute__((noinline)) void* operator new(std::size_t size)
+{
+    numAllocations++;
+    if (void* memory = std::malloc(size ? size : 1))
+    {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+namespace
+{
+    constexpr int kNumInputs = 64;
+    constexpr int kNumHidden = 32;
+    constexpr int kNumClasses = 10;
+    constexpr int kNumTrainSamples = 3000;
+    constexpr int kNumTestSamples = 500;
+    constexpr int kMiniBatchSize = 50;
+    constexpr float kLearnRate = 1.0f;
+    constexpr float kMomentum = 0.9f;
+    constexpr float kMinAccuracy = 0.9f; // the synthetic classes are well apart, every training path gets there
+    
+    // Relative to the sum of the magnitudes of the terms, so sums of any length and sign are held to the same standard
+    constexpr double kSumTolerance = 1e-5;
+    
+    void expect(bool condition, const std::string& what)
+    {
+        if (!condition)
+        {
+            throw std::runtime_error(what);
+        }
+    }
+    
+    // actual[i] against expected[i], which is off by at most tolerance * scale[i] (or tolerance without scales)
+    void expectClose(const float* actual, const double* expected, const double* scale, size_t count, double tolerance, const std::string& what)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            double allowed = tolerance * (scale ? scale[i] + 1e-30 : 1.0);
+            if (!(std::abs(actual[i] - expected[i]) <= allowed))
+            {
+                std::ostringstream message;
+                message << what << ": element " << i << " is " << std::setprecision(9) << actual[i] << ", expected " << expected[i] << " within " << allowed;
+                throw std::runtime_error(message.str());
+            }
+        }
+    }
+    
+    std::vector<float> randomValues(size_t count, float low, float high, unsigned seed, float zeroFraction = 0.0f)
+    {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> distribution(low, high);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        
+        std::vector<float> values(count);
+        for (float& value : values)
+        {
+            value = unit(rng) < zeroFraction ? 0.0f : distribution(rng);
+        }
+        return values;
+    }
+    
+    // -- Data --
+    
+    struct Samples
+    {
+        std::vector<float> inputs; // size() x kNumInputs, the pixels over 255
+        std::vector<int> labels;
+        
+        int size() const { return (int) labels.size(); }
+        const float* row(int sample) const { return &inputs[(size_t) sample * kNumInputs]; }
+    };
+    
+    // Each class is noise around its own prototype, and like MNIST most pixels are exactly zero
+    std::vector<std::vector<int>> syntheticPixels(int numSamples, unsigned seed, std::vector<int>& labels)
+    {
+        std::mt19937 prototypeRng(5489);
+        std::uniform_int_distribution<int> pixel(64, 255);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        
+        std::vector<std::vector<int>> prototypes(kNumClasses, std::vector<int>(kNumInputs));
+        for (std::vector<int>& prototype : prototypes)
+        {
+            for (int& value : prototype)
+            {
+                value = unit(prototypeRng) < 0.6f ? 0 : pixel(prototypeRng);
+            }
+        }
+        
+        std::mt19937 rng(seed);
+        std::uniform_int_distribution<int> label(0, kNumClasses - 1);
+        std::normal_distribution<float> noise(0.0f, 40.0f);
+        
+        std::vector<std::vector<int>> rows(numSamples);
+        labels.resize(numSamples);
+        for (int sample = 0; sample < numSamples; sample++)
+        {
+            labels[sample] = label(rng);
+            for (int value : prototypes[labels[sample]])
+            {
+                rows[sample].push_back(value == 0 ? 0 : std::clamp((int) (value + noise(rng)), 1, 255));
+            }
+        }
+        return rows;
+    }
+    
+    // A CSV in the MNIST layout, CRLF line endings like the MNIST files, and the samples it holds
+    Samples writeSyntheticCsv(const std::string& filePath, int numSamples, unsigned seed)
+    {
+        Samples samples;
+        std::vector<std::vector<int>> rows = syntheticPixels(numSamples, seed, samples.labels);
+        
+        std::ofstream file(filePath, std::ios::binary);
+        file << "label";
+        for (int i = 0; i < kNumInputs; i++)
+        {
+            file << ",pixel" << i;
+        }
+        file << "\r\n";
+        
+        for (int sample = 0; sample < numSamples; sample++)
+        {
+            file << samples.labels[sample];
+            for (int value : rows[sample])
+            {
+                file << ',' << value;
+                samples.inputs.push_back(value / 255.0f);
+            }
+            file << "\r\n";
+        }
+        return samples;
+    }
+    
+    // Scratch directory with the training and test CSVs, removed at exit
+    struct TestFiles
+    {
+        std::filesystem::path directory;
+        std::string trainCsv;
+        std::string testCsv;
+        Samples testSamples;
+        
+        TestFiles()
+        {
+            directory = std::filesystem::temp_directory_path() / ("nn_tests_" + std::to_string(getpid()));
+            std::filesystem::create_directories(directory);
+            trainCsv = path("train.csv");
+            testCsv = path("test.csv");
+            writeSyntheticCsv(trainCsv, kNumTrainSamples, 1);
+            testSamples = writeSyntheticCsv(testCsv, kNumTestSamples, 2);
+        }
+        
+        ~TestFiles()
+        {
+            std::error_code error;
+            std::filesystem::remove_all(directory, error);
+        }
+        
+        std::string path(const std::string& name) const { return (directory / name).string(); }
+    };
+    
+    const TestFiles& files()
+    {
+        static TestFiles testFiles;
+        return testFiles;
+    }
+    
+    // A network trained on the training CSV and left with the test CSV loaded
+    Network trainedNetwork(int epochs = 2)
+    {
+        Network network({kNumInputs, kNumHidden, kNumClasses}, ActivationType::Sigmoid, CostType::CrossEntropy);
+        network.initRandomWeights();
+        network.loadData(files().trainCsv, kNumInputs, kNumTrainSamples);
+        network.train(epochs, kMiniBatchSize, kLearnRate, 0.0f, kMomentum);
+        network.clearData();
+        network.loadData(files().testCsv, kNumInputs, kNumTestSamples);
+        return network;
+    }
+    
+    // -- Reference --
+    
+    std::vector<float> layerParameters(const Layer& layer)
+    {
+        return std::vector<float>(layer.parameters(), layer.parameters() + layer.numParameters());
+    }
+    
+    // float64 forward and backward pass of a stack of sigmoid layers under the mean square error, or with a
+    // softmax output layer under the cross entropy
+    struct ReferenceStack
+    {
+        std::vector<int> sizes;
+        std::vector<std::vector<float>> parameters;
+        bool softmaxCrossEntropy = false;
+        
+        std::vector<std::vector<double>> activations; // per layer, batch x layer size
+        std::vector<std::vector<double>> gradients; // laid out like the parameters, summed over the batch
+        std::vector<std::vector<double>> gradientScale; // magnitude the float rounding of each gradient is relative to
+        
+        void run(const float* inputs, const float* expectedOutputs, int batchSize)
+        {
+            int numLayers = (int) parameters.size();
+            activations.assign(numLayers + 1, {});
+            activations[0].assign(inputs, inputs + (size_t) batchSize * sizes[0]);
+            
+            for (int layer = 0; layer < numLayers; layer++)
+            {
+                int numIn = sizes[layer];
+                int numOut = sizes[layer + 1];
+                const float* weights = parameters[layer].data();
+                const float* biases = weights + (size_t) numIn * numOut;
+                
+                activations[layer + 1].resize((size_t) batchSize * numOut);
+                for (int sample = 0; sample < batchSize; sample++)
+                {
+                    for (int nodeOut = 0; nodeOut < numOut; nodeOut++)
+                    {
+                        double sum = biases[nodeOut];
+                        for (int nodeIn = 0; nodeIn < numIn; nodeIn++)
+                        {
+                            sum += (double) weights[(size_t) nodeOut * numIn + nodeIn] * activations[layer][(size_t) sample * numIn + nodeIn];
+                        }
+                        activations[layer + 1][(size_t) sample * numOut + nodeOut] = 1.0 / (1.0 + std::exp(-sum));
+                        if (softmaxCrossEntropy && layer == numLayers - 1)
+                        {
+                            activations[layer + 1][(size_t) sample * numOut + nodeOut] = sum;
+                        }
+                    }
+                    
+                    if (softmaxCrossEntropy && layer == numLayers - 1)
+                    {
+                        double* row = &activations[layer + 1][(size_t) sample * numOut];
+                        double maxValue = *std::max_element(row, row + numOut);
+                        double expSum = 0;
+                        for (int nodeOut = 0; nodeOut < numOut; nodeOut++)
+                        {
+                            row[nodeOut] = std::exp(row[nodeOut] - maxValue);
+                            expSum += row[nodeOut];
+                        }
+                        for (int nodeOut = 0; nodeOut < numOut; nodeOut++)
+                        {
+                            row[nodeOut] /= expSum;
+                        }
+                    }
+                }
+            }
+            
+            gradients.assign(numLayers, {});
+            gradientScale.assign(numLayers, {});
+            
+            // Next to every node value the magnitude float rounding is relative to: a - y cancels when a is close to y,
+            // and so do the sums of the backward pass
+            std::vector<double> nodeValues((size_t) batchSize * sizes[numLayers]);
+            std::vector<double> nodeScales(nodeValues.size());
+            for (size_t i = 0; i < nodeValues.size(); i++)
+            {
+                double a = activations[numLayers][i];
+                double derivative = softmaxCrossEntropy ? 1.0 : a * (1 - a);
+                nodeValues[i] = (a - expectedOutputs[i]) * derivative;
+                nodeScales[i] = (std::abs(a) + std::abs(expectedOutputs[i])) * derivative;
+            }
+            
+            for (int layer = numLayers - 1; layer >= 0; layer--)
+            {
+                int numIn = sizes[layer];
+                int numOut = sizes[layer + 1];
+                const float* weights = parameters[layer].data();
+                gradients[layer].assign(parameters[layer].size(), 0.0);
+                gradientScale[layer].assign(parameters[layer].size(), 0.0);
+                
+                std::vector<double> previousNodeValues((size_t) batchSize * numIn, 0.0);
+                std::vector<double> previousNodeScales((size_t) batchSize * numIn, 0.0);
+                for (int sample = 0; sample < batchSize; sample++)
+                {
+                    for (int nodeOut = 0; nodeOut < numOut; nodeOut++)
+                    {
+                        double nodeValue = nodeValues[(size_t) sample * numOut + nodeOut];
+                        double nodeScale = nodeScales[(size_t) sample * numOut + nodeOut];
+                        for (int nodeIn = 0; nodeIn < numIn; nodeIn++)
+                        {
+                            double input = activations[layer][(size_t) sample * numIn + nodeIn];
+                            double weight = weights[(size_t) nodeOut * numIn + nodeIn];
+                            gradients[layer][(size_t) nodeOut * numIn + nodeIn] += nodeValue * input;
+                            gradientScale[layer][(size_t) nodeOut * numIn + nodeIn] += nodeScale * std::abs(input);
+                            previousNodeValues[(size_t) sample * numIn + nodeIn] += nodeValue * weight;
+                            previousNodeScales[(size_t) sample * numIn + nodeIn] += nodeScale * std::abs(weight);
+                        }
+                        gradients[layer][(size_t) numIn * numOut + nodeOut] += nodeValue;
+                        gradientScale[layer][(size_t) numIn * numOut + nodeOut] += nodeScale;
+                    }
+                }
+                
+                for (size_t i = 0; i < previousNodeValues.size(); i++)
+                {
+                    double a = activations[layer][i];
+                    previousNodeValues[i] *= a * (1 - a);
+                    previousNodeScales[i] *= a * (1 - a);
+                }
+                nodeValues = previousNodeValues;
+                nodeScales = previousNodeScales;
+            }
+        }
+    };
+    
+    // The gradients a layer accumulated, read back from a plain SGD step. The large power of two learn rate keeps the
+    // step well above the rounding of the parameters and divides out exactly.
+    std::vector<float> appliedGradients(Layer& layer, const std::vector<float>& parameters)
+    {
+        constexpr float kStepScale = 1024.0f;
+        layer.applyGradient(OptimizerStep(OptimizerSettings(), 1, kStepScale, 1, 0.0f, 0.0f));
+        std::vector<float> stepped = layerParameters(layer);
+        
+        std::vector<float> gradients(parameters.size());
+        for (size_t i = 0; i < parameters.size(); i++)
+        {
+            gradients[i] = (parameters[i] - stepped[i]) / kStepScale;
+        }
+        return gradients;
+    }
+    
+    // Dense float64 forward pass over the parameters of a weights file: sigmoid hidden layers and a softmax output
+    struct Reference
+    {
+        ModelFile model;
+        
+        explicit Reference(const std::string& filePath)
+        : model(ModelFile::read(filePath))
+        {
+        }
+        
+        // Softmax outputs, and the weighted inputs of the output layer in logits
+        std::vector<double> forward(const float* input, std::vector<double>* logits = nullptr)
+        {
+            std::vector<double> activations(input, input + model.layerSizes[0]);
+            int numLayers = (int) model.layerSizes.size() - 1;
+            
+            for (int layer = 0; layer < numLayers; layer++)
+            {
+                int numIn = model.layerSizes[layer];
+                int numOut = model.layerSizes[layer + 1];
+                const float* weights = model.layerParameters(layer);
+                const float* biases = weights + (size_t) numIn * numOut;
+                
+                std::vector<double> weighted(numOut);
+                for (int nodeOut = 0; nodeOut < numOut; nodeOut++)
+                {
+                    double sum = biases[nodeOut];
+                    for (int nodeIn = 0; nodeIn < numIn; nodeIn++)
+                    {
+                        sum += (double) weights[(size_t) nodeOut * numIn + nodeIn] * activations[nodeIn];
+                    }
+                    weighted[nodeOut] = sum;
+                }
+                
+                if (layer < numLayers - 1)
+                {
+                    for (double& value : weighted)
+                    {
+                        value = 1.0 / (1.0 + std::exp(-value));
+                    }
+                    activations = weighted;
+                    continue;
+                }
+                
+                if (logits)
+                {
+                    *logits = weighted;
+                }
+                double maxValue = *std::max_element(weighted.begin(), weighted.end());
+                double sum = 0;
+                for (double& value : weighted)
+                {
+                    value = std::exp(value - maxValue);
+                    sum += value;
+                }
+                for (double& value : weighted)
+                {
+                    value /= sum;
+                }
+                activations = weighted;
+            }
+            return activations;
+        }
+        
+        // Counts, mean softmax cross entropy and confusion matrix over samples, the way test() reports them
+        EvaluationResult evaluate(const Samples& samples)
+        {
+            EvaluationResult result;
+            result.numSamples = samples.size();
+            result.numClasses = kNumClasses;
+            result.confusionMatrix.assign(kNumClasses * kNumClasses, 0);
+            
+            double loss = 0;
+            for (int sample = 0; sample < samples.size(); sample++)
+            {
+                std::vector<double> logits;
+                std::vector<double> outputs = forward(samples.row(sample), &logits);
+                
+                int label = samples.labels[sample];
+                int prediction = (int) (std::max_element(outputs.begin(), outputs.end()) - outputs.begin());
+                result.numCorrect += prediction == label;
+                result.confusionMatrix[label * kNumClasses + prediction]++;
+                
+                double maxValue = *std::max_element(logits.begin(), logits.end());
+                double sum = 0;
+                for (double value : logits)
+                {
+                    sum += std::exp(value - maxValue);
+                }
+                loss += maxValue + std::log(sum) - logits[label];
+            }
+            result.accuracy = (float) result.numCorrect / result.numSamples;
+            result.loss = (float) (loss / result.numSamples);
+            return result;
+        }
+    };
+    
+    Reference saveReference(Network& network, const std::string& name)
+    {
+        std::string filePath = files().path(name);
+        network.saveWeights(filePath);
+        return Reference(filePath);
+    }
+    
+    void expectMatchesReference(Network& network, Reference& reference, const Samples& samples, double tolerance, const std::string& what)
+    {
+        std::vector<float> outputs((size_t) samples.size() * kNumClasses);
+        network.forwardPass(samples.inputs.data(), samples.size(), outputs.data());
+        
+        for (int sample = 0; sample < samples.size(); sample++)
+        {
+            std::vector<double> expected = reference.forward(samples.row(sample));
+            expectClose(&outputs[(size_t) sample * kNumClasses], expected.data(), nullptr, kNumClasses, tolerance, what + " batched, sample " + std::to_string(sample));
+            
+            std::span<const float> single = network.forwardPass(std::span<const float>(samples.row(sample), kNumInputs));
+            expectClose(single.data(), expected.data(), nullptr, kNumClasses, tolerance, what + " single sample, sample " + std::to_string(sample));
+        }
+    }
+    
+    float testAccuracy(Network& network)
+    {
+        return network.test().accuracy;
+    }
+    
+    // -- Checks --
+    
+    void checkKernels()
+    {
+        std::cout << "kernels: " << Kernels::isaName() << std::endl;
+        
+        // Odd sizes reach every tail, the last one the blocking of the GEMM kernels
+        const int shapes[][3] = { {1, 1, 1}, {3, 5, 7}, {17, 33, 65}, {8, 64, 16}, {37, 130, 300} };
+        for (const auto& shape : shapes)
+        {
+            int M = shape[0], N = shape[1], K = shape[2];
+            std::string name = std::to_string(M) + "x" + std::to_string(N) + "x" + std::to_string(K);
+            
+            std::vector<float> A = randomValues((size_t) M * K, -1.0f, 1.0f, 1);
+            std::vector<float> B = randomValues((size_t) K * N, -1.0f, 1.0f, 2);
+            std::vector<float> C0 = randomValues((size_t) M * N, -1.0f, 1.0f, 3);
+            
+            std::vector<bfloat16> B16(B.size());
+            for (size_t i = 0; i < B.size(); i++)
+            {
+                B16[i] = toBFloat16(B[i]);
+            }
+            
+            // C = A * B with B read as K x N (NN) or as its transpose N x K (NT), A^T read from a K x lda matrix (TN)
+            auto reference = [&](std::function<double(int, int, int)> term, bool accumulate, std::vector<double>& expected, std::vector<double>& scale)
+            {
+                expected.assign((size_t) M * N, 0.0);
+                scale.assign((size_t) M * N, 0.0);
+                for (int m = 0; m < M; m++)
+                {
+                    for (int n = 0; n < N; n++)
+                    {
+                        double sum = accumulate ? C0[(size_t) m * N + n] : 0.0;
+                        double magnitude = std::abs(sum);
+                        for (int k = 0; k < K; k++)
+                        {
+                            double value = term(m, n, k);
+                            sum += value;
+                            magnitude += std::abs(value);
+                        }
+                        expected[(size_t) m * N + n] = sum;
+                        scale[(size_t) m * N + n] = magnitude;
+                    }
+                }
+            };
+            
+            int lda = M + 3;
+            std::vector<float> At = randomValues((size_t) K * lda, -1.0f, 1.0f, 4);
+            
+            for (bool accumulate : { false, true })
+            {
+                std::string mode = name + (accumulate ? " accumulate" : "");
+                std::vector<double> expected, scale;
+                std::vector<float> C;
+                
+                reference([&](int m, int n, int k) { return (double) A[(size_t) m * K + k] * B[(size_t) k * N + n]; }, accumulate, expected, scale);
+                C = C0;
+                Kernels::gemmNN(M, N, K, A.data(), B.data(), C.data(), accumulate);
+                expectClose(C.data(), expected.data(), scale.data(), C.size(), kSumTolerance, "gemmNN " + mode);
+                
+                reference([&](int m, int n, int k) { return (double) A[(size_t) m * K + k] * fromBFloat16(B16[(size_t) k * N + n]); }, accumulate, expected, scale);
+                C = C0;
+                Kernels::gemmNN(M, N, K, A.data(), B16.data(), C.data(), accumulate);
+                expectClose(C.data(), expected.data(), scale.data(), C.size(), kSumTolerance, "bfloat16 gemmNN " + mode);
+                
+                // The same B buffer read as N x K
+                reference([&](int m, int n, int k) { return (double) A[(size_t) m * K + k] * B[(size_t) n * K + k]; }, accumulate, expected, scale);
+                C = C0;
+                Kernels::gemmNT(M, N, K, A.data(), B.data(), C.data(), accumulate);
+                expectClose(C.data(), expected.data(), scale.data(), C.size(), kSumTolerance, "gemmNT " + mode);
+                
+                reference([&](int m, int n, int k) { return (double) A[(size_t) m * K + k] * fromBFloat16(B16[(size_t) n * K + k]); }, accumulate, expected, scale);
+                C = C0;
+                Kernels::gemmNT(M, N, K, A.data(), B16.data(), C.data(), accumulate);
+                expectClose(C.data(), expected.data(), scale.data(), C.size(), kSumTolerance, "bfloat16 gemmNT " + mode);
+                
+                reference([&](int m, int n, int k) { return (double) At[(size_t) k * lda + m] * B[(size_t) k * N + n]; }, accumulate, expected, scale);
+                C = C0;
+                Kernels::gemmTN(M, N, K, At.data(), lda, B.data(), C.data(), accumulate);
+                expectClose(C.data(), expected.data(), scale.data(), C.size(), kSumTolerance, "gemmTN " + mode);
+            }
+            
+            // The first N - 1 columns of C0, rows N apart
+            std::vector<float> sums = randomValues(N - 1, -1.0f, 1.0f, 5);
+            std::vector<double> expectedSums(N - 1), sumScale(N - 1);
+            for (int n = 0; n < N - 1; n++)
+            {
+                expectedSums[n] = sums[n];
+                sumScale[n] = std::abs(sums[n]);
+                for (int m = 0; m < M; m++)
+                {
+                    expectedSums[n] += C0[(size_t) m * N + n];
+                    sumScale[n] += std::abs(C0[(size_t) m * N + n]);
+                }
+            }
+            Kernels::sumRows(M, N - 1, C0.data(), N, sums.data());
+            expectClose(sums.data(), expectedSums.data(), sumScale.data(), N - 1, kSumTolerance, "sumRows " + name);
+            
+            std::vector<float> rows((size_t) M * N);
+            std::vector<double> expectedRows((size_t) M * N);
+            for (size_t i = 0; i < rows.size(); i++)
+            {
+                expectedRows[i] = B[i % N];
+            }
+            Kernels::broadcastRows(M, N, B.data(), rows.data());
+            expectClose(rows.data(), expectedRows.data(), nullptr, rows.size(), 0.0, "broadcastRows " + name);
+            
+            // A with about 70% zeros in compressed sparse rows, both column widths
+            std::vector<float> sparseA = randomValues((size_t) M * K, -1.0f, 1.0f, 6, 0.7f);
+            SparseRows sparseRows;
+            sparseRows.assign(sparseA.data(), M, K);
+            std::vector<uint16_t> columns16(sparseRows.columns.begin(), sparseRows.columns.end());
+            
+            std::vector<double> expected, scale;
+            reference([&](int m, int n, int k) { return (double) sparseA[(size_t) m * K + k] * B[(size_t) k * N + n]; }, true, expected, scale);
+            std::vector<float> C = C0;
+            Kernels::sparseGemmNN(M, N, sparseRows.rowOffsets.data(), sparseRows.columns.data(), sparseRows.values.data(), B.data(), C.data());
+            expectClose(C.data(), expected.data(), scale.data(), C.size(), kSumTolerance, "sparseGemmNN " + name);
+            
+            C = C0;
+            Kernels::sparseGemmNN(M, N, sparseRows.rowOffsets.data(), columns16.data(), sparseRows.values.data(), B.data(), C.data());
+            expectClose(C.data(), expected.data(), scale.data(), C.size(), kSumTolerance, "16 bit sparseGemmNN " + name);
+            
+            // C[K x N] += sparseA^T * B[M x N]
+            std::vector<float> Bm = randomValues((size_t) M * N, -1.0f, 1.0f, 7);
+            std::vector<float> Ck = randomValues((size_t) K * N, -1.0f, 1.0f, 8);
+            std::vector<double> expectedTN((size_t) K * N), scaleTN((size_t) K * N);
+            for (int k = 0; k < K; k++)
+            {
+                for (int n = 0; n < N; n++)
+                {
+                    double sum = Ck[(size_t) k * N + n];
+                    double magnitude = std::abs(sum);
+                    for (int m = 0; m < M; m++)
+                    {
+                        double value = (double) sparseA[(size_t) m * K + k] * Bm[(size_t) m * N + n];
+                        sum += value;
+                        magnitude += std::abs(value);
+                    }
+                    expectedTN[(size_t) k * N + n] = sum;
+                    scaleTN[(size_t) k * N + n] = magnitude;
+                }
+            }
+            Kernels::sparseGemmTN(M, N, sparseRows.rowOffsets.data(), sparseRows.columns.data(), sparseRows.values.data(), Bm.data(), Ck.data());
+            expectClose(Ck.data(), expectedTN.data(), scaleTN.data(), Ck.size(), kSumTolerance, "sparseGemmTN " + name);
+        }
+        
+        // Halfway between two bfloat16 values rounds to the even one
+        expect(toBFloat16(1.00390625f) == 0x3F80 && toBFloat16(1.01171875f) == 0x3F82, "toBFloat16 does not round ties to even");
+        
+        // Vector primitives over lengths around every vector width
+        for (int n : { 1, 3, 4, 7, 8, 15, 16, 17, 31, 33, 64, 100, 257 })
+        {
+            std::string name = " n=" + std::to_string(n);
+            std::vector<float> x = randomValues(n, -1.0f, 1.0f, 10 + n);
+            std::vector<float> y = randomValues(n, -1.0f, 1.0f, 20 + n);
+            
+            double sum = 0, magnitude = 0;
+            for (int i = 0; i < n; i++)
+            {
+                sum += (double) x[i] * y[i];
+                magnitude += std::abs((double) x[i] * y[i]);
+            }
+            float dot = Kernels::dot(x.data(), y.data(), n);
+            expectClose(&dot, &sum, &magnitude, 1, kSumTolerance, "dot" + name);
+            
+            std::vector<double> expected(n), scale(n);
+            std::vector<float> z = y;
+            for (int i = 0; i < n; i++)
+            {
+                expected[i] = y[i] + 0.5 * x[i];
+                scale[i] = std::abs(y[i]) + std::abs(0.5 * x[i]);
+            }
+            Kernels::axpy(0.5f, x.data(), z.data(), n);
+            expectClose(z.data(), expected.data(), scale.data(), n, kSumTolerance, "axpy" + name);
+            
+            // gathers from a vector longer than the row
+            std::vector<float> wide = randomValues(1000, -1.0f, 1.0f, 30 + n);
+            std::vector<uint16_t> columns(n);
+            for (int i = 0; i < n; i++)
+            {
+                columns[i] = (uint16_t) ((i * 37 + 11) % 1000);
+            }
+            sum = 0;
+            magnitude = 0;
+            for (int i = 0; i < n; i++)
+            {
+                sum += (double) x[i] * wide[columns[i]];
+                magnitude += std::abs((double) x[i] * wide[columns[i]]);
+            }
+            float sparseDot = Kernels::sparseDot(x.data(), columns.data(), n, wide.data());
+            expectClose(&sparseDot, &sum, &magnitude, 1, kSumTolerance, "sparseDot" + name);
+            
+            
+            std::vector<int8_t> a(n), b(n);
+            int32_t exact = 0;
+            for (int i = 0; i < n; i++)
+            {
+                a[i] = (int8_t) ((i * 53) % 255 - 127);
+                b[i] = (int8_t) ((i * 91 + 7) % 255 - 127);
+                exact += a[i] * b[i];
+            }
+            expect(Kernels::dotInt8(a.data(), b.data(), n) == exact, "dotInt8" + name + " is not exact");
+            
+            std::vector<bfloat16> rounded(n);
+            Kernels::toBFloat16(x.data(), rounded.data(), n);
+            for (int i = 0; i < n; i++)
+            {
+                expect(rounded[i] == toBFloat16(x[i]), "toBFloat16" + name + " does not round to nearest even");
+            }
+            
+            // One step of each update rule against the formulas in Kernels.hpp
+            for (bool nesterov : { false, true })
+            {
+                std::vector<float> values = x, velocities = y, gradients = randomValues(n, -1.0f, 1.0f, 40 + n);
+                for (int i = 0; i < n; i++)
+                {
+                    double velocity = velocities[i] * 0.9 - gradients[i] * 0.1;
+                    double step = nesterov ? velocity * 0.9 - gradients[i] * 0.1 : velocity;
+                    expected[i] = values[i] * 0.99 + step;
+                    scale[i] = std::abs(values[i]) + 1.0;
+                }
+                Kernels::momentumUpdate(values.data(), velocities.data(), gradients.data(), n, 0.1f, 0.99f, 0.9f, nesterov);
+                expectClose(values.data(), expected.data(), scale.data(), n, kSumTolerance, "momentumUpdate" + name);
+                expect(std::all_of(gradients.begin(), gradients.end(), [](float g) { return g == 0.0f; }), "momentumUpdate" + name + " left gradients");
+            }
+            
+            Kernels::AdaptiveUpdate update;
+            update.gradientScale = 0.5f;
+            update.l2 = 0.01f;
+            update.beta1 = 0.9f;
+            update.beta2 = 0.999f;
+            update.stepSize = 0.01f;
+            update.epsilon = 1e-8f;
+            update.weightDecay = 0.999f;
+            
+            std::vector<float> values = x, gradients = y, moments = randomValues(n, -0.1f, 0.1f, 50 + n), squares = randomValues(n, 0.0f, 0.1f, 60 + n);
+            for (int i = 0; i < n; i++)
+            {
+                double gradient = gradients[i] * 0.5 + 0.01 * values[i];
+                double moment = moments[i] * 0.9 + gradient * 0.1;
+                double square = squares[i] * 0.999 + gradient * gradient * 0.001;
+                expected[i] = values[i] * 0.999 - 0.01 * moment / (std::sqrt(square) + 1e-8);
+                scale[i] = std::abs(values[i]) + 0.01;
+            }
+            Kernels::adaptiveUpdate(values.data(), gradients.data(), moments.data(), squares.data(), n, update);
+            expectClose(values.data(), expected.data(), scale.data(), n, 1e-4, "adaptiveUpdate" + name);
+        }
+    }
+    
+    // A sigmoid hidden layer and an output layer, sigmoid under the mean square error or softmax under the cross
+    // entropy, through the batched and the per-sample paths. The softmax stack also with bfloat16 weights, sparse
+    // inputs or both.
+    void checkLayerPaths()
+    {
+        constexpr int kNumIn = 77;
+        constexpr int kNumOut = 13;
+        constexpr int kBatch = 37;
+        
+        std::vector<float> inputs = randomValues((size_t) kBatch * kNumIn, 0.0f, 1.0f, 1, 0.7f);
+        std::vector<float> expectedOutputs((size_t) kBatch * kNumOut, 0.0f);
+        for (int sample = 0; sample < kBatch; sample++)
+        {
+            expectedOutputs[(size_t) sample * kNumOut + sample % kNumOut] = 1.0f;
+        }
+        
+        const std::tuple<bool, bool, bool> variants[] = {
+            {false, false, false},
+            {true, false, false},
+            {true, true, false},
+            {true, false, true},
+            {true, true, true},
+        };
+        for (auto [softmax, bfloat16Weights, sparseInputs] : variants)
+        {
+            std::string name = std::string(bfloat16Weights ? "bfloat16 " : "") + (sparseInputs ? "sparse input " : "") + (softmax ? "softmax cross entropy " : "sigmoid mean square error ");
+            ActivationType outputActivation = softmax ? ActivationType::Softmax : ActivationType::Sigmoid;
+            CostType costType = softmax ? CostType::CrossEntropy : CostType::MeanSquareError;
+            
+            Layer hidden(kNumIn, kNumHidden);
+            Layer output(kNumHidden, kNumOut);
+            hidden.initRandomWeights();
+            output.initRandomWeights();
+            hidden.setMixedPrecision(bfloat16Weights);
+            output.setMixedPrecision(bfloat16Weights);
+            hidden.setSparseInputs(sparseInputs);
+            
+            // The float parameters are the master copy the gradient step applies to, the passes see the rounded weights.
+            // Except the sparse input kernels, which read their own float copy.
+            std::vector<std::vector<float>> parameters = { layerParameters(hidden), layerParameters(output) };
+            ReferenceStack reference;
+            reference.sizes = { kNumIn, kNumHidden, kNumOut };
+            reference.parameters = parameters;
+            for (int layer = sparseInputs ? 1 : 0; layer < 2 && bfloat16Weights; layer++)
+            {
+                for (int i = 0; i < reference.sizes[layer] * reference.sizes[layer + 1]; i++)
+                {
+                    reference.parameters[layer][i] = fromBFloat16(toBFloat16(parameters[layer][i]));
+                }
+            }
+            reference.softmaxCrossEntropy = softmax;
+            reference.run(inputs.data(), expectedOutputs.data(), kBatch);
+            
+            // Every buffer carved out of one arena, the way the network's workers hold them
+            AlignedVector<float> arena(hidden.batchDataSize(kBatch) + output.batchDataSize(kBatch) + hidden.gradientsSize() + output.gradientsSize());
+            LayerBatchData hiddenData, outputData;
+            LayerGradients hiddenGradientSums, outputGradientSums;
+            float* slice = hidden.bindBatchData(hiddenData, arena.data(), kBatch);
+            slice = output.bindBatchData(outputData, slice, kBatch);
+            slice = hidden.bindGradients(hiddenGradientSums, slice);
+            slice = output.bindGradients(outputGradientSums, slice);
+            expect(slice <= arena.data() + arena.size(), name + "bound past the end of the arena");
+            
+            SparseRows sparseRows;
+            sparseRows.assign(inputs.data(), kBatch, kNumIn);
+            const float* hiddenActivations = sparseInputs
+                ? hidden.CalculateOutputs(hiddenData, inputs.data(), sparseRows, ActivationType::Sigmoid)
+                : hidden.CalculateOutputs(hiddenData, inputs.data(), kBatch, ActivationType::Sigmoid);
+            const float* outputs = output.CalculateOutputs(outputData, hiddenActivations, kBatch, outputActivation);
+            expectClose(hiddenActivations, reference.activations[1].data(), nullptr, reference.activations[1].size(), 1e-5, name + "batched hidden activations");
+            expectClose(outputs, reference.activations[2].data(), nullptr, reference.activations[2].size(), 1e-5, name + "batched outputs");
+            
+            // The gradients added in two blocks, the way the network's reduction splits them across workers
+            
+            output.CalculateOutputLayerNodeValues(outputData, expectedOutputs.data(), costType, outputActivation);
+            output.updateGradients(outputData, outputGradientSums);
+            hidden.CalculateLayerNodeValues(hiddenData, output, outputData, ActivationType::Sigmoid);
+            hidden.updateGradients(hiddenData, hiddenGradientSums);
+            
+            output.addGradients(outputGradientSums, 0, 100);
+            output.addGradients(outputGradientSums, 100, output.numParameters());
+            hidden.addGradients(hiddenGradientSums, 0, 1000);
+            hidden.addGradients(hiddenGradientSums, 1000, hidden.numParameters());
+            
+            std::vector<float> outputGradients = appliedGradients(output, parameters[1]);
+            std::vector<float> hiddenGradients = appliedGradients(hidden, parameters[0]);
+            expectClose(outputGradients.data(), reference.gradients[1].data(), reference.gradientScale[1].data(), outputGradients.size(), 1e-4, name + "batched output gradients");
+            expectClose(hiddenGradients.data(), reference.gradients[0].data(), reference.gradientScale[0].data(), hiddenGradients.size(), 1e-4, name + "batched hidden gradients");
+        }
+        
+        // Both stacks again, one sample at a time through the per-sample path
+        for (bool softmax : { false, true })
+        {
+            std::string name = softmax ? "softmax cross entropy " : "sigmoid mean square error ";
+            ActivationType outputActivation = softmax ? ActivationType::Softmax : ActivationType::Sigmoid;
+            CostType costType = softmax ? CostType::CrossEntropy : CostType::MeanSquareError;
+            
+            Layer hidden(kNumIn, kNumHidden);
+            Layer output(kNumHidden, kNumOut);
+            hidden.initRandomWeights();
+            output.initRandomWeights();
+            
+            ReferenceStack reference;
+            reference.sizes = { kNumIn, kNumHidden, kNumOut };
+            reference.parameters = { layerParameters(hidden), layerParameters(output) };
+            reference.softmaxCrossEntropy = softmax;
+            reference.run(inputs.data(), expectedOutputs.data(), kBatch);
+            
+            LayerLearnData hiddenData, outputData;
+            for (auto [layerData, numNodes] : { std::pair(&hiddenData, kNumHidden), std::pair(&outputData, kNumOut) })
+            {
+                layerData->weightedInputs.resize(numNodes);
+                layerData->activations.resize(numNodes);
+                layerData->nodeValues.resize(numNodes);
+            }
+            
+            for (int sample = 0; sample < kBatch; sample++)
+            {
+                const std::vector<float>& hiddenActivations = hidden.CalculateOutputs(hiddenData, std::span<const float>(&inputs[(size_t) sample * kNumIn], kNumIn), ActivationType::Sigmoid);
+                const std::vector<float>& outputs = output.CalculateOutputs(outputData, hiddenActivations, outputActivation);
+                expectClose(outputs.data(), &reference.activations[2][(size_t) sample * kNumOut], nullptr, kNumOut, 1e-5, name + "per-sample outputs");
+                
+                output.CalculateOutputLayerNodeValues(outputData, std::span<const float>(&expectedOutputs[(size_t) sample * kNumOut], kNumOut), costType, outputActivation);
+                output.updateGradients(outputData);
+                hidden.CalculateLayerNodeValues(hiddenData, output, outputData.nodeValues, ActivationType::Sigmoid);
+                hidden.updateGradients(hiddenData);
+            }
+            
+            std::vector<float> outputGradients = appliedGradients(output, reference.parameters[1]);
+            std::vector<float> hiddenGradients = appliedGradients(hidden, reference.parameters[0]);
+            expectClose(outputGradients.data(), reference.gradients[1].data(), reference.gradientScale[1].data(), outputGradients.size(), 1e-4, name + "per-sample output gradients");
+            expectClose(hiddenGradients.data(), reference.gradients[0].data(), reference.gradientScale[0].data(), hiddenGradients.size(), 1e-4, name + "per-sample hidden gradients");
+        }
+    }
+    
+    // The log-sum-exp cross entropy against float64, finite where the softmax saturates, and the loss getCost reports
+    // for softmax and for other output layers
+    void checkCost()
+    {
+        for (float offset : { 0.0f, 40.0f, -40.0f })
+        {
+            std::vector<float> logits = randomValues(kNumClasses, -8.0f, 8.0f, 3);
+            logits[2] += offset;
+            
+            for (int label = 0; label < kNumClasses; label++)
+            {
+                std::vector<float> expectedOutputs(kNumClasses, 0.0f);
+                expectedOutputs[label] = 1.0f;
+                
+                double maxValue = *std::max_element(logits.begin(), logits.end());
+                double expSum = 0;
+                for (float z : logits)
+                {
+                    expSum += std::exp(z - maxValue);
+                }
+                double expected = maxValue + std::log(expSum) - logits[label];
+                double scale = 1.0 + std::abs(expected);
+                
+                std::string name = "logit offset " + std::to_string(offset) + ", label " + std::to_string(label);
+                float cost = Cost::softmaxCrossEntropy(logits, expectedOutputs);
+                expectClose(&cost, &expected, &scale, 1, 1e-6, "softmax cross entropy, " + name);
+                
+                // The loss test() reports for a softmax output layer
+                std::vector<float> outputs(kNumClasses);
+                for (int i = 0; i < kNumClasses; i++)
+                {
+                    outputs[i] = (float) (std::exp(logits[i] - maxValue) / expSum);
+                }
+                float reported = Cost::getCost(outputs, logits, expectedOutputs, CostType::CrossEntropy, ActivationType::Softmax);
+                expect(reported == cost, "getCost is not the softmax cross entropy, " + name);
+            }
+        }
+        
+        // Under any other output activation the cross entropy is per output, and Cost::derivative is its gradient
+        std::vector<float> outputs = randomValues(kNumClasses, 0.05f, 0.95f, 4);
+        std::vector<float> expectedOutputs(kNumClasses, 0.0f);
+        expectedOutputs[3] = 1.0f;
+        
+        double expected = 0;
+        for (int i = 0; i < kNumClasses; i++)
+        {
+            double x = outputs[i], y = expectedOutputs[i];
+            expected -= y * std::log(x) + (1 - y) * std::log(1 - x);
+        }
+        double scale = 1.0 + expected;
+        float cost = Cost::getCost(outputs, std::span<const float>(), expectedOutputs, CostType::CrossEntropy, ActivationType::Sigmoid);
+        expectClose(&cost, &expected, &scale, 1, 1e-6, "sigmoid cross entropy");
+        
+        constexpr float kStep = 1e-3f;
+        for (int i = 0; i < kNumClasses; i++)
+        {
+            std::vector<float> above = outputs, below = outputs;
+            above[i] += kStep;
+            below[i] -= kStep;
+            double slope = ((double) Cost::getCost(above, std::span<const float>(), expectedOutputs, CostType::CrossEntropy, ActivationType::Sigmoid)
+                - Cost::getCost(below, std::span<const float>(), expectedOutputs, CostType::CrossEntropy, ActivationType::Sigmoid)) / (above[i] - below[i]);
+            double slopeScale = 1.0 + std::abs(slope);
+            float derivative = Cost::derivative(outputs[i], expectedOutputs[i], CostType::CrossEntropy);
+            expectClose(&derivative, &slope, &slopeScale, 1, 1e-2, "sigmoid cross entropy derivative " + std::to_string(i));
+        }
+    }
+    
+    // Batched and single sample inference and the test() metrics of a trained network, and its sparse input and bfloat16 variants
+    void checkNetworkInference()
+    {
+        Network network = trainedNetwork();
+        Reference reference = saveReference(network, "inference.nnw");
+        const Samples& samples = files().testSamples;
+        
+        expectMatchesReference(network, reference, samples, 1e-5, "float");
+        
+        EvaluationResult expected = reference.evaluate(samples);
+        EvaluationResult result = network.test();
+        expect(result.numSamples == samples.size(), "test() saw " + std::to_string(result.numSamples) + " samples");
+        expect(result.numCorrect == expected.numCorrect, "test() counted " + std::to_string(result.numCorrect) + " correct, the reference " + std::to_string(expected.numCorrect));
+        expect(result.accuracy == expected.accuracy, "test() accuracy " + std::to_string(result.accuracy));
+        expect(std::abs(result.loss - expected.loss) <= 1e-4 * (1 + expected.loss), "test() loss " + std::to_string(result.loss) + ", the reference " + std::to_string(expected.loss));
+        expect(result.confusionMatrix == expected.confusionMatrix, "test() confusion matrix differs from the reference");
+        expect(result.samplesPerSecond > 0, "test() measured no throughput");
+        expect(result.accuracy >= kMinAccuracy, "trained to only " + std::to_string(result.accuracy));
+        
+        // The evaluation workers keep their arenas, only the confusion matrix of the result is allocated
+        long allocationsBefore = numAllocations.load();
+        network.test();
+        long allocations = numAllocations.load() - allocationsBefore;
+        expect(allocations <= 1, "a second test() made " + std::to_string(allocations) + " heap allocations");
+        
+        network.setSparseInputs(true);
+        EvaluationResult sparseResult = network.test();
+        expect(sparseResult.numCorrect == expected.numCorrect, "test() with sparse inputs counted " + std::to_string(sparseResult.numCorrect) + " correct, the reference " + std::to_string(expected.numCorrect));
+        expect(std::abs(sparseResult.loss - expected.loss) <= 1e-4 * (1 + expected.loss), "test() loss with sparse inputs " + std::to_string(sparseResult.loss));
+        network.setSparseInputs(false);
+        
+        network.setMixedPrecision(true);
+        float mixedAccuracy = testAccuracy(network);
+        expect(std::abs(mixedAccuracy - result.accuracy) <= 0.01f, "bfloat16 accuracy " + std::to_string(mixedAccuracy) + " vs " + std::to_string(result.accuracy));
+        
+        // Trained from the start on bfloat16 weights and features
+        Network mixed({kNumInputs, kNumHidden, kNumClasses}, ActivationType::Sigmoid, CostType::CrossEntropy);
+        mixed.initRandomWeights();
+        mixed.setMixedPrecision(true);
+        mixed.loadData(files().trainCsv, kNumInputs, kNumTrainSamples, PixelFormat::BFloat16);
+        mixed.train(2, kMiniBatchSize, kLearnRate, 0.0f, kMomentum);
+        mixed.clearData();
+        mixed.loadData(files().testCsv, kNumInputs, kNumTestSamples, PixelFormat::BFloat16);
+        mixedAccuracy = testAccuracy(mixed);
+        expect(mixedAccuracy >= kMinAccuracy, "bfloat16 training reached only " + std::to_string(mixedAccuracy));
+        
+        // And on sparse inputs, whose noise only goes to the nonzero pixels
+        Network sparse({kNumInputs, kNumHidden, kNumClasses}, ActivationType::Sigmoid, CostType::CrossEntropy);
+        sparse.initRandomWeights();
+        sparse.setSparseInputs(true);
+        sparse.loadData(files().trainCsv, kNumInputs, kNumTrainSamples);
+        sparse.train(2, kMiniBatchSize, kLearnRate, 0.0f, kMomentum);
+        sparse.clearData();
+        sparse.loadData(files().testCsv, kNumInputs, kNumTestSamples);
+        float sparseAccuracy = testAccuracy(sparse);
+        expect(sparseAccuracy >= kMinAccuracy, "sparse input training reached only " + std::to_string(sparseAccuracy));
+    }
+    
+    // Single sample inference into a workspace allocates nothing once the workspace is sized, and scorers on
+    // several threads each get their own thread local workspace
+    void checkSpanInference()
+    {
+        Network network = trainedNetwork();
+        const Samples& samples = files().testSamples;
+        
+        std::vector<float> expected((size_t) samples.size() * kNumClasses);
+        network.forwardPass(samples.inputs.data(), samples.size(), expected.data());
+        std::vector<double> expectedValues(expected.begin(), expected.end());
+        
+        InferenceWorkspace workspace;
+        network.forwardPass(std::span<const float>(samples.row(0), kNumInputs), workspace);
+        
+        std::vector<float> outputs((size_t) samples.size() * kNumClasses);
+        std::vector<int> predictions(samples.size());
+        long allocationsBefore = numAllocations.load();
+        for (int sample = 0; sample < samples.size(); sample++)
+        {
+            std::span<const float> single = network.forwardPass(std::span<const float>(samples.row(sample), kNumInputs), workspace);
+            std::copy(single.begin(), single.end(), &outputs[(size_t) sample * kNumClasses]);
+            predictions[sample] = Network::maxValueIndex(single);
+        }
+        long allocations = numAllocations.load() - allocationsBefore;
+        expect(allocations == 0, "single sample inference made " + std::to_string(allocations) + " heap allocations");
+        expectClose(outputs.data(), expectedValues.data(), nullptr, outputs.size(), 1e-5, "single sample outputs");
+        
+        for (int sample = 0; sample < samples.size(); sample++)
+        {
+            const float* row = &expected[(size_t) sample * kNumClasses];
+            expect(predictions[sample] == std::max_element(row, row + kNumClasses) - row, "maxValueIndex of sample " + std::to_string(sample));
+        }
+        
+        std::atomic<int> numMismatches { 0 };
+        std::vector<std::thread> scorers;
+        for (int t = 0; t < 4; t++)
+        {
+            scorers.emplace_back([&]()
+            {
+                for (int sample = 0; sample < samples.size(); sample++)
+                {
+                    std::span<const float> single = network.forwardPass(std::span<const float>(samples.row(sample), kNumInputs));
+                    numMismatches += !std::equal(single.begin(), single.end(), &outputs[(size_t) sample * kNumClasses]);
+                }
+            });
+        }
+        for (std::thread& scorer : scorers)
+        {
+            scorer.join();
+        }
+        expect(numMismatches.load() == 0, std::to_string(numMismatches.load()) + " outputs differed between concurrent scorers");
+    }
+    
+    // Dense and sparse weights files load back to the same outputs, damaged ones are refused
+    void checkModelFiles()
+    {
+        Network network = trainedNetwork();
+        const Samples& samples = files().testSamples;
+        std::string densePath = files().path("model.nnw");
+        network.saveWeights(densePath);
+        Reference reference(densePath);
+        
+        Network loaded({1, 1});
+        loaded.loadWeights(densePath);
+        expectMatchesReference(loaded, reference, samples, 1e-5, "loaded");
+        
+        network.prune(0.5f);
+        network.compress();
+        Reference prunedReference = saveReference(network, "pruned.nnw");
+        std::string sparsePath = files().path("pruned_sparse.nnw");
+        network.saveWeights(sparsePath, true);
+        expect(std::filesystem::file_size(sparsePath) < std::filesystem::file_size(densePath), "the sparse file is not smaller");
+        
+        Network loadedSparse({1, 1});
+        loadedSparse.loadWeights(sparsePath);
+        expect(loadedSparse.isCompressed(), "a sparse file did not load compressed");
+        expect(std::abs(loadedSparse.weightSparsity() - network.weightSparsity()) < 1e-6f, "a sparse file lost its zeros");
+        expectMatchesReference(loadedSparse, prunedReference, samples, 1e-5, "loaded sparse");
+        
+        std::ifstream file(densePath, std::ios::binary);
+        std::vector<char> contents((std::istreambuf_iterator<char>(file)), {});
+        
+        auto expectRefused = [&](const std::vector<char>& bytes, const std::string& what)
+        {
+            std::string badPath = files().path("bad.nnw");
+            std::ofstream(badPath, std::ios::binary).write(bytes.data(), bytes.size());
+            try
+            {
+                ModelFile::read(badPath);
+            }
+            catch (const std::runtime_error&)
+            {
+                return;
+            }
+            throw std::runtime_error("a " + what + " weights file was accepted");
+        };
+        
+        expectRefused(std::vector<char>(contents.begin(), contents.end() - 4), "truncated");
+        std::vector<char> flipped = contents;
+        flipped[flipped.size() / 2] ^= 1;
+        expectRefused(flipped, "damaged");
+        
+        // Files that pass their checksum but describe something impossible
+        auto rewritten = [](const std::vector<char>& bytes, size_t offset, auto value)
+        {
+            std::vector<char> changed = bytes;
+            std::memcpy(changed.data() + offset, &value, sizeof(value));
+            ModelFileHeader header;
+            std::memcpy(&header, changed.data(), sizeof(header));
+            header.checksum = MappedFile::checksum(reinterpret_cast<const unsigned char*>(changed.data()) + sizeof(header), changed.size() - sizeof(header));
+            std::memcpy(changed.data(), &header, sizeof(header));
+            return changed;
+        };
+        expectRefused(rewritten(contents, sizeof(ModelFileHeader) + sizeof(uint32_t), uint32_t(0)), "zero node layer");
+        expectRefused(rewritten(contents, offsetof(ModelFileHeader, activationType), (uint32_t) ActivationType::Softmax + 1), "corrupt activation type");
+        expectRefused(rewritten(contents, offsetof(ModelFileHeader, costType), (uint32_t) CostType::CrossEntropy + 1), "corrupt cost type");
+        
+        std::ifstream sparseFile(sparsePath, std::ios::binary);
+        std::vector<char> sparseContents((std::istreambuf_iterator<char>(sparseFile)), {});
+        ModelFile sparseModel = ModelFile::read(sparsePath);
+        size_t rowOffsets = sparseModel.layerOffsets[0] + sizeof(uint32_t);
+        size_t columns = rowOffsets + (sparseModel.layerSizes[1] + 1) * sizeof(uint32_t);
+        expectRefused(rewritten(sparseContents, rowOffsets + sparseModel.layerSizes[1] * sizeof(uint32_t), uint32_t(1)), "wrong row offset");
+        expectRefused(rewritten(sparseContents, columns, uint16_t(kNumInputs)), "corrupt column");
+    }
+    
+    // int8 inference stays close to float
+    void checkQuantized()
+    {
+        Network network = trainedNetwork();
+        Reference reference = saveReference(network, "quantized.nnw");
+        const Samples& samples = files().testSamples;
+        
+        float accuracy = testAccuracy(network);
+        size_t floatBytes = network.parameterBytes();
+        
+        network.quantize(kNumTestSamples);
+        expect(network.isQuantized(), "quantize() did not quantize");
+        expect(network.parameterBytes() < floatBytes / 2, "int8 weights are not smaller");
+        expectMatchesReference(network, reference, samples, 0.05, "int8");
+        
+        float quantizedAccuracy = testAccuracy(network);
+        expect(std::abs(quantizedAccuracy - accuracy) <= 0.02f, "int8 accuracy " + std::to_string(quantizedAccuracy) + " vs " + std::to_string(accuracy));
+        
+        network.loadWeights(files().path("quantized.nnw"));
+        expect(!network.isQuantized(), "loading weights kept the int8 layers");
+    }
+    
+    // Pruned zeros survive training and the compressed layers compute what the dense ones do
+    void checkPruning()
+    {
+        Network network = trainedNetwork();
+        const Samples& samples = files().testSamples;
+        
+        network.prune(0.8f);
+        float sparsity = network.weightSparsity();
+        expect(std::abs(sparsity - 0.8f) < 0.01f, "pruned to " + std::to_string(sparsity));
+        
+        Reference reference = saveReference(network, "pruning.nnw");
+        network.compress();
+        expectMatchesReference(network, reference, samples, 1e-5, "compressed");
+        
+        network.clearData();
+        network.loadData(files().trainCsv, kNumInputs, kNumTrainSamples);
+        network.train(1, kMiniBatchSize, kLearnRate, 0.0f, kMomentum);
+        expect(!network.isCompressed(), "training kept a stale compressed copy");
+        expect(network.weightSparsity() >= sparsity, "fine-tuning moved pruned weights, sparsity " + std::to_string(network.weightSparsity()));
+        
+        network.clearData();
+        network.loadData(files().testCsv, kNumInputs, kNumTestSamples);
+        Reference fineTuned = saveReference(network, "fine_tuned.nnw");
+        network.compress();
+        expectMatchesReference(network, fineTuned, samples, 1e-5, "fine-tuned compressed");
+        expect(testAccuracy(network) >= kMinAccuracy, "fine-tuned to only " + std::to_string(testAccuracy(network)));
+    }
+    
+    // The compiled network computes what the file's float64 reference does, also from a sparse file, writes the file
+    // back unchanged and refuses files of another topology or activation
+    void checkStaticNetwork()
+    {
+        Network network = trainedNetwork();
+        std::string filePath = files().path("static.nnw");
+        network.saveWeights(filePath);
+        Reference reference(filePath);
+        const Samples& samples = files().testSamples;
+        
+        auto staticNetwork = std::make_unique<StaticNetwork<ActivationType::Sigmoid, kNumInputs, kNumHidden, kNumClasses>>();
+        staticNetwork->loadWeights(filePath);
+        
+        std::array<float, kNumClasses> outputs;
+        for (int sample = 0; sample < samples.size(); sample++)
+        {
+            std::span<const float, kNumInputs> inputs(samples.row(sample), kNumInputs);
+            staticNetwork->forwardPass(inputs, outputs);
+            
+            std::vector<double> expected = reference.forward(samples.row(sample));
+            expectClose(outputs.data(), expected.data(), nullptr, kNumClasses, 1e-5, "static network sample " + std::to_string(sample));
+            expect(staticNetwork->classify(inputs) == std::max_element(expected.begin(), expected.end()) - expected.begin(), "static network classified sample " + std::to_string(sample) + " differently");
+        }
+        
+        std::string savedPath = files().path("static_saved.nnw");
+        staticNetwork->saveWeights(savedPath);
+        Network loaded({1, 1});
+        loaded.loadWeights(savedPath);
+        expectMatchesReference(loaded, reference, samples, 1e-5, "saved by the static network");
+        
+        // A sparse file of the pruned network, expanded into the inline parameters
+        network.prune(0.5f);
+        Reference prunedReference = saveReference(network, "static_pruned.nnw");
+        std::string sparsePath = files().path("static_sparse.nnw");
+        network.saveWeights(sparsePath, true);
+        auto sparseNetwork = std::make_unique<StaticNetwork<ActivationType::Sigmoid, kNumInputs, kNumHidden, kNumClasses>>();
+        sparseNetwork->loadWeights(sparsePath);
+        for (int sample = 0; sample < samples.size(); sample++)
+        {
+            std::span<const float, kNumInputs> inputs(samples.row(sample), kNumInputs);
+            sparseNetwork->forwardPass(inputs, outputs);
+            
+            std::vector<double> expected = prunedReference.forward(samples.row(sample));
+            expectClose(outputs.data(), expected.data(), nullptr, kNumClasses, 1e-5, "static network from a sparse file, sample " + std::to_string(sample));
+        }
+        
+        auto expectRefused = [&](auto&& other, const std::string& what)
+        {
+            try
+            {
+                other->loadWeights(filePath);
+            }
+            catch (const std::runtime_error&)
+            {
+                return;
+            }
+            throw std::runtime_error("a static network with " + what + " loaded the file");
+        };
+        expectRefused(std::make_unique<StaticNetwork<ActivationType::Sigmoid, kNumInputs, kNumHidden + 1, kNumClasses>>(), "other layer sizes");
+        expectRefused(std::make_unique<StaticNetwork<ActivationType::TanH, kNumInputs, kNumHidden, kNumClasses>>(), "another activation");
+    }
+    
+    // Datasets parsed from CSV, converted to the binary format and memory mapped hold the same samples, and a
+    // network trains on a mapped file after rebuilding its input layer to match it. Malformed rows, headers whose
+    // sizes wrap around and labels outside the classes are refused.
+    void checkDatasets()
+    {
+        const Samples& samples = files().testSamples;
+        std::vector<double> expectedValues(samples.inputs.begin(), samples.inputs.end());
+        
+        Dataset csv;
+        csv.loadCsv(files().testCsv, kNumInputs, kNumClasses, kNumTestSamples);
+        expect(csv.size() == samples.size() && csv.numInputs() == kNumInputs, "the CSV has the wrong shape");
+        expect(std::equal(samples.labels.begin(), samples.labels.end(), csv.labels()), "the CSV labels differ");
+        expectClose(csv.floatRows(0), expectedValues.data(), nullptr, expectedValues.size(), 1e-6, "CSV features");
+        
+        // The same rows with \n endings, blank lines, no final newline and a pixel written as a decimal, split across a pool
+        std::string contents;
+        {
+            std::ifstream file(files().testCsv, std::ios::binary);
+            contents.assign(std::istreambuf_iterator<char>(file), {});
+        }
+        std::string variant;
+        for (size_t i = 0; i < contents.size(); i++)
+        {
+            if (contents[i] == '\r')
+            {
+                continue;
+            }
+            variant += contents[i];
+            if (contents[i] == '\n' && variant.size() % 7 == 0)
+            {
+                variant += '\n';
+            }
+        }
+        while (variant.back() == '\n')
+        {
+            variant.pop_back();
+        }
+        size_t decimal = variant.find(",0", variant.find('\n'));
+        variant.insert(decimal + 2, ".0e0");
+        
+        std::string variantPath = files().path("variant.csv");
+        std::ofstream(variantPath, std::ios::binary) << variant;
+        
+        ThreadPool threadPool(4);
+        Dataset parsed;
+        parsed.loadCsv(variantPath, kNumInputs, kNumClasses, kNumTestSamples, PixelFormat::Float32, &threadPool);
+        expect(parsed.size() == samples.size(), "the variant CSV has " + std::to_string(parsed.size()) + " rows");
+        expect(std::equal(samples.labels.begin(), samples.labels.end(), parsed.labels()), "the variant CSV labels differ");
+        expectClose(parsed.floatRows(0), expectedValues.data(), nullptr, expectedValues.size(), 1e-6, "variant CSV features");
+        
+        const std::pair<const char*, const char*> malformed[] = {
+            {"extra column", "label,a,b\n3,1,2,4\n"},
+            {"missing column", "label,a,b\n3,1\n"},
+            {"fractional label", "label,a,b\n3.5,1,2\n"},
+            {"label outside the classes", "label,a,b\n10,1,2\n"},
+            {"negative label", "label,a,b\n-1,1,2\n"},
+            {"junk", "label,a,b\n3,1x,2\n"},
+            {"junk ending", "label,a,b\n3,1,2x\n"},
+        };
+        for (const auto& [name, rows] : malformed)
+        {
+            std::string csvPath = files().path("malformed.csv");
+            std::ofstream(csvPath) << rows;
+            
+            Dataset dataset;
+            try
+            {
+                dataset.loadCsv(csvPath, 2, kNumClasses, 10);
+            }
+            catch (const std::runtime_error&)
+            {
+                continue;
+            }
+            throw std::runtime_error(std::string("a row with a ") + name + " was accepted");
+        }
+        
+        for (PixelFormat format : { PixelFormat::Float32, PixelFormat::UInt8, PixelFormat::BFloat16 })
+        {
+            std::string name = "format " + std::to_string((int) format);
+            std::string binaryPath = files().path("test.nnds");
+            Dataset::convert(files().testCsv, binaryPath, kNumInputs, kNumClasses, kNumTestSamples, format);
+            
+            Dataset binary;
+            binary.load(binaryPath, kNumClasses);
+            expect(binary.size() == samples.size() && binary.numInputs() == kNumInputs && binary.format() == format, name + " has the wrong shape");
+            expect(std::equal(samples.labels.begin(), samples.labels.end(), binary.labels()), name + " labels differ");
+            
+            std::vector<float> values((size_t) binary.size() * kNumInputs);
+            binary.copyRows(0, binary.size(), values.data());
+            expectClose(values.data(), expectedValues.data(), nullptr, values.size(), format == PixelFormat::BFloat16 ? 4e-3 : 1e-6, name + " features");
+            
+            try
+            {
+                binary.load(binaryPath, kNumClasses - 1);
+                throw std::logic_error(name + " accepted labels outside the classes");
+            }
+            catch (const std::runtime_error&)
+            {
+            }
+        }
+        
+        std::string trainPath = files().path("train.nnds");
+        std::string testPath = files().path("test.nnds");
+        Dataset::convert(files().trainCsv, trainPath, kNumInputs, kNumClasses, kNumTrainSamples, PixelFormat::UInt8);
+        Dataset::convert(files().testCsv, testPath, kNumInputs, kNumClasses, kNumTestSamples, PixelFormat::UInt8);
+        
+        // A header whose sample count makes the array sizes wrap around to the real ones
+        {
+            std::ifstream file(testPath, std::ios::binary);
+            contents.assign(std::istreambuf_iterator<char>(file), {});
+        }
+        DatasetFileHeader header;
+        std::memcpy(&header, contents.data(), sizeof(header));
+        header.numSamples += uint64_t(1) << 62;
+        std::memcpy(contents.data(), &header, sizeof(header));
+        std::string wrappedPath = files().path("wrapped.nnds");
+        std::ofstream(wrappedPath, std::ios::binary) << contents;
+        try
+        {
+            Dataset().load(wrappedPath, kNumClasses);
+            throw std::logic_error("a header with wrapping sizes was accepted");
+        }
+        catch (const std::runtime_error&)
+        {
+        }
+        
+        Network network({1, kNumHidden, kNumClasses}, ActivationType::Sigmoid, CostType::CrossEntropy);
+        network.loadDataset(trainPath);
+        network.initRandomWeights();
+        network.train(2, kMiniBatchSize, kLearnRate, 0.0f, kMomentum);
+        network.clearData();
+        network.loadDataset(testPath);
+        float accuracy = testAccuracy(network);
+        expect(accuracy >= kMinAccuracy, "training on a mapped dataset reached only " + std::to_string(accuracy));
+    }
+    
+    // Every epoch of the pipeline hands out each sample once, in a new order, and the same seed gives the same batches
+    void checkBatchPipeline()
+    {
+        constexpr int kNumSamples = 250;
+        constexpr int kBatchSize = 32;
+        constexpr int kNumEpochs = 3;
+        
+        // The first pixel names the sample
+        std::string csvPath = files().path("indexed.csv");
+        {
+            std::ofstream file(csvPath);
+            file << "label,index,label\n";
+            for (int sample = 0; sample < kNumSamples; sample++)
+            {
+                file << sample % kNumClasses << ',' << sample << ',' << sample % kNumClasses << '\n';
+            }
+        }
+        Dataset data;
+        data.loadCsv(csvPath, 2, kNumClasses, kNumSamples, PixelFormat::UInt8);
+        
+        auto run = [&](float noise)
+        {
+            std::vector<std::vector<float>> epochs(kNumEpochs);
+            BatchPipeline pipeline(data, kBatchSize, kNumEpochs, noise, 7);
+            while (const TrainingBatch* batch = pipeline.acquire())
+            {
+                expect(batch->batchSize == std::min(kBatchSize, kNumSamples - (int) epochs[batch->epoch].size() / 2), "a batch of " + std::to_string(batch->batchSize) + " samples");
+                for (int i = 0; i < batch->batchSize; i++)
+                {
+                    const float* row = &batch->inputs[(size_t) i * 2];
+                    expect(noise > 0.0f || batch->labels[i] == (int) std::lround(row[0] * 255.0f) % kNumClasses, "a label was separated from its row");
+                    epochs[batch->epoch].insert(epochs[batch->epoch].end(), row, row + 2);
+                }
+                pipeline.release();
+            }
+            return epochs;
+        };
+        
+        std::vector<std::vector<float>> epochs = run(0.0f);
+        for (int epoch = 0; epoch < kNumEpochs; epoch++)
+        {
+            std::vector<int> seen(kNumSamples, 0);
+            for (size_t i = 0; i < epochs[epoch].size(); i += 2)
+            {
+                seen[std::lround(epochs[epoch][i] * 255.0f)]++;
+            }
+            expect(std::all_of(seen.begin(), seen.end(), [](int count) { return count == 1; }), "epoch " + std::to_string(epoch) + " did not hand out every sample once");
+        }
+        expect(epochs[0] != epochs[1], "the order was not reshuffled between epochs");
+        expect(run(0.0f) == epochs, "the same seed gave different batches");
+        
+        // Noise small enough that the nearest pixel level still names the sample
+        constexpr float kNoise = 3e-4f;
+        std::vector<std::vector<float>> noisy = run(kNoise);
+        double noiseSum = 0;
+        double noiseSquares = 0;
+        for (const std::vector<float>& epoch : noisy)
+        {
+            for (float value : epoch)
+            {
+                double noise = value - std::lround(value * 255.0f) / 255.0;
+                noiseSum += noise;
+                noiseSquares += noise * noise;
+            }
+        }
+        double numValues = kNumEpochs * kNumSamples * 2;
+        expect(std::abs(noiseSum / numValues) < 0.1 * kNoise && std::abs(std::sqrt(noiseSquares / numValues) - kNoise) < 0.1 * kNoise, "the pixel noise is not the requested Gaussian");
+    }
+    
+    // Reports come every few mini-batches and at each epoch's end, and between them account for every sample
+    void checkTelemetry()
+    {
+        if (!Telemetry::kCompiled)
+        {
+            std::cout << "telemetry compiled out" << std::endl;
+            return;
+        }
+        
+        constexpr int kNumThreads = 3;
+        constexpr int kReportInterval = 7;
+        constexpr int kEpochs = 2;
+        constexpr int kBatchesPerEpoch = kNumTrainSamples / kMiniBatchSize;
+        
+        Network network({kNumInputs, kNumHidden, kNumClasses}, ActivationType::Sigmoid, CostType::CrossEntropy);
+        network.setNumThreads(kNumThreads);
+        network.initRandomWeights();
+        network.loadData(files().trainCsv, kNumInputs, kNumTrainSamples);
+        
+        std::vector<TelemetryReport> reports;
+        std::ostringstream json;
+        network.telemetry().enable(&json, [&](const TelemetryReport& report) { reports.push_back(report); }, kReportInterval);
+        network.train(kEpochs, kMiniBatchSize, kLearnRate, 0.0f, kMomentum);
+        network.telemetry().disable();
+        
+        int expectedReports = 0;
+        for (int batch = 1; batch <= kEpochs * kBatchesPerEpoch; batch++)
+        {
+            expectedReports += batch % kReportInterval == 0 || batch % kBatchesPerEpoch == 0;
+        }
+        expect((int) reports.size() == expectedReports, std::to_string(reports.size()) + " reports, expected " + std::to_string(expectedReports));
+        
+        int64_t numSamples = 0;
+        for (const TelemetryReport& report : reports)
+        {
+            numSamples += report.numSamples;
+            expect(report.endOfEpoch == (report.batch % kBatchesPerEpoch == 0), "report after batch " + std::to_string(report.batch) + " has the wrong end of epoch flag");
+            expect(report.accuracy >= 0 && report.accuracy <= 1 && std::isfinite(report.loss) && report.loss > 0, "report after batch " + std::to_string(report.batch) + " has accuracy " + std::to_string(report.accuracy) + " and loss " + std::to_string(report.loss));
+            expect((int) report.threadUtilization.size() == kNumThreads, "report has " + std::to_string(report.threadUtilization.size()) + " worker utilizations");
+            for (float utilization : report.threadUtilization)
+            {
+                expect(utilization >= 0 && utilization <= 1.01f, "worker utilization " + std::to_string(utilization));
+            }
+            for (double seconds : report.phaseSeconds)
+            {
+                expect(seconds >= 0, "a phase took negative time");
+            }
+        }
+        expect(numSamples == (int64_t) kEpochs * kNumTrainSamples, "the reports counted " + std::to_string(numSamples) + " samples");
+        expect(reports.back().accuracy > reports.front().accuracy, "training accuracy did not improve between the first and last report");
+        
+        int numLines = 0;
+        std::istringstream lines(json.str());
+        for (std::string line; std::getline(lines, line); numLines++)
+        {
+            expect(line.front() == '{' && line.back() == '}', "report line is not a JSON object: " + line);
+        }
+        expect(numLines == expectedReports, std::to_string(numLines) + " JSON lines for " + std::to_string(expectedReports) + " reports");
+        
+        // Off again, nothing is reported
+        size_t jsonSize = json.str().size();
+        network.train(1, kMiniBatchSize, kLearnRate, 0.0f, kMomentum);
+        expect((int) reports.size() == expectedReports && json.str().size() == jsonSize, "disabled telemetry still reported");
+    }
+    
+    // Every update rule trains, including after a new input size rebuilt the first layer
+    void checkOptimizers()
+    {
+        const std::pair<OptimizerType, float> optimizers[] = {
+            {OptimizerType::Momentum, kLearnRate},
+            {OptimizerType::Nesterov, kLearnRate},
+            {OptimizerType::Adam, 0.01f},
+            {OptimizerType::AdamW, 0.01f},
+            {OptimizerType::RMSProp, 0.01f},
+        };
+        
+        for (const auto& [type, learnRate] : optimizers)
+        {
+            OptimizerSettings settings;
+            settings.type = type;
+            
+            // Starts at a different input size so loadData rebuilds the first layer
+            Network network({kNumInputs / 2, kNumHidden, kNumClasses}, ActivationType::Sigmoid, CostType::CrossEntropy);
+            network.setOptimizer(settings);
+            network.initRandomWeights();
+            network.loadData(files().trainCsv, kNumInputs, kNumTrainSamples);
+            network.train(2, kMiniBatchSize, learnRate, 0.0f, kMomentum);
+            
+            network.clearData();
+            network.loadData(files().testCsv, kNumInputs, kNumTestSamples);
+            float accuracy = testAccuracy(network);
+            expect(accuracy >= kMinAccuracy, std::string(OptimizerSettings::name(type)) + " trained to only " + std::to_string(accuracy));
+        }
+    }
+    
+    // The pipeline takes the same steps as train(), up to the order of the gradient sums
+    void checkPipelined()
+    {
+        Network network({kNumInputs, kNumHidden, kNumHidden, kNumClasses}, ActivationType::Sigmoid, CostType::CrossEntropy);
+        network.initRandomWeights();
+        std::string initialPath = files().path("pipeline_initial.nnw");
+        network.saveWeights(initialPath);
+        network.loadData(files().trainCsv, kNumInputs, kNumTrainSamples);
+        
+        network.train(1, kMiniBatchSize, kLearnRate, 0.0f, 0.0f);
+        Reference trained = saveReference(network, "trained.nnw");
+        
+        for (PipelineSchedule schedule : { PipelineSchedule::GPipe, PipelineSchedule::OneForwardOneBackward })
+        {
+            for (int numStages : { 1, 3 })
+            {
+                for (int numMicroBatches : { 1, 5 })
+                {
+                    std::string name = (schedule == PipelineSchedule::GPipe ? "gpipe, " : "1f1b, ") + std::to_string(numStages) + " stages, " + std::to_string(numMicroBatches) + " micro-batches: ";
+                    
+                    network.loadWeights(initialPath);
+                    network.trainPipelined(numStages, numMicroBatches, 1, kMiniBatchSize, kLearnRate, 0.0f, 0.0f, schedule);
+                    Reference pipelined = saveReference(network, "pipelined.nnw");
+                    
+                    for (int layer = 0; layer < 3; layer++)
+                    {
+                        size_t count = (size_t) trained.model.layerSizes[layer] * trained.model.layerSizes[layer + 1] + trained.model.layerSizes[layer + 1];
+                        std::vector<double> expected(trained.model.layerParameters(layer), trained.model.layerParameters(layer) + count);
+                        expectClose(pipelined.model.layerParameters(layer), expected.data(), nullptr, count, 1e-3, name + "layer " + std::to_string(layer));
+                    }
+                }
+            }
+        }
+    }
+    
+    // Ranks that drift apart make trainMultiProcess throw, so finishing at all means they stayed identical
+    void checkDataParallel()
+    {
+        for (TransportType transportType : { TransportType::SharedMemory, TransportType::Tcp })
+        {
+            std::string name = transportType == TransportType::Tcp ? "tcp: " : "shared memory: ";
+            
+            Network network({kNumInputs, kNumHidden, kNumClasses}, ActivationType::Sigmoid, CostType::CrossEntropy);
+            network.setNumThreads(2);
+            network.initRandomWeights();
+            network.loadData(files().trainCsv, kNumInputs, kNumTrainSamples);
+            network.trainMultiProcess(2, 2, kMiniBatchSize, kLearnRate, 0.0f, kMomentum, transportType);
+            
+            network.clearData();
+            network.loadData(files().testCsv, kNumInputs, kNumTestSamples);
+            float accuracy = testAccuracy(network);
+            expect(accuracy >= kMinAccuracy, name + "data parallel training reached only " + std::to_string(accuracy));
+        }
+        
+        // The whole-dataset batch train() defaults to, which once overflowed when rounded up to a multiple of the ranks
+        Network network({kNumInputs, kNumHidden, kNumClasses}, ActivationType::Sigmoid, CostType::CrossEntropy);
+        network.initRandomWeights();
+        network.loadData(files().trainCsv, kNumInputs, kNumTrainSamples);
+        network.trainMultiProcess(2, 1, std::numeric_limits<int>::max(), kLearnRate, 0.0f, kMomentum);
+    }
+    
+    // Hogwild training keeps to its staleness bound, takes every step once and still learns the classes
+    void checkAsync()
+    {
+        constexpr int kEpochs = 2;
+        
+        for (int maxStaleness : { 4, 0 })
+        {
+            std::string name = "staleness bound " + std::to_string(maxStaleness) + ": ";
+            
+            Network network({kNumInputs, kNumHidden, kNumClasses}, ActivationType::Sigmoid, CostType::CrossEntropy);
+            network.setNumThreads(4);
+            network.initRandomWeights();
+            network.loadData(files().trainCsv, kNumInputs, kNumTrainSamples);
+            
+            AsyncTrainingStats stats = network.trainAsync(kEpochs, kMiniBatchSize, kLearnRate, 0.0f, kMomentum, maxStaleness);
+            expect(stats.maxStaleness <= maxStaleness, name + "staleness " + std::to_string(stats.maxStaleness) + " exceeded the bound");
+            expect(stats.meanStaleness <= stats.maxStaleness, name + "mean staleness above the max");
+            expect(stats.numUpdates == kEpochs * kNumTrainSamples / kMiniBatchSize, name + std::to_string(stats.numUpdates) + " updates");
+            expect((int) stats.epochAccuracy.size() == kEpochs, name + std::to_string(stats.epochAccuracy.size()) + " epoch accuracies");
+            
+            network.clearData();
+            network.loadData(files().testCsv, kNumInputs, kNumTestSamples);
+            float accuracy = testAccuracy(network);
+            expect(accuracy >= kMinAccuracy, name + "asynchronous training reached only " + std::to_string(accuracy));
+        }
+    }
+    
+    // The whole-layer activations and derivatives against their float64 formulas. Softmax also far beyond the
+    // range where exp overflows a float, which the max shift has to absorb.
+    void checkActivations()
+    {
+        const ActivationType types[] = { ActivationType::Sigmoid, ActivationType::TanH, ActivationType::ReLU, ActivationType::SiLU, ActivationType::Softmax };
+        const char* names[] = { "sigmoid", "tanh", "relu", "silu", "softmax" };
+        
+        for (int t = 0; t < 5; t++)
+        {
+            for (float offset : { 0.0f, 500.0f })
+            {
+                if (offset != 0.0f && types[t] != ActivationType::Softmax)
+                {
+                    continue;
+                }
+                std::string name = std::string(names[t]) + (offset != 0.0f ? " of large inputs" : "");
+                
+                std::vector<float> inputs = randomValues(37, -8.0f, 8.0f, 7 + t);
+                inputs[5] = 0.0f;
+                for (float& x : inputs)
+                {
+                    x += offset;
+                }
+                
+                double maxInput = *std::max_element(inputs.begin(), inputs.end());
+                double expSum = 0;
+                for (float x : inputs)
+                {
+                    expSum += std::exp(x - maxInput);
+                }
+                
+                std::vector<double> expected(inputs.size()), expectedDerivatives(inputs.size()), scale(inputs.size());
+                for (size_t i = 0; i < inputs.size(); i++)
+                {
+                    double x = inputs[i];
+                    double sigmoid = 1.0 / (1.0 + std::exp(-x));
+                    scale[i] = 1.0 + std::abs(x);
+                    switch (types[t])
+                    {
+                        case ActivationType::Sigmoid: expected[i] = sigmoid; expectedDerivatives[i] = sigmoid * (1 - sigmoid); break;
+                        case ActivationType::TanH: expected[i] = std::tanh(x); expectedDerivatives[i] = 1 - std::tanh(x) * std::tanh(x); break;
+                        case ActivationType::ReLU: expected[i] = std::max(0.0, x); expectedDerivatives[i] = x > 0 ? 1 : 0; break;
+                        case ActivationType::SiLU: expected[i] = x * sigmoid; expectedDerivatives[i] = x * sigmoid * (1 - sigmoid) + sigmoid; break;
+                        case ActivationType::Softmax:
+                        {
+                            double softmax = std::exp(x - maxInput) / expSum;
+                            expected[i] = softmax;
+                            expectedDerivatives[i] = softmax * (1 - softmax);
+                            scale[i] = 1.0;
+                            break;
+                        }
+                    }
+                }
+                
+                std::vector<float> values = inputs;
+                Activation::activate(std::span<float>(values), types[t]);
+                expectClose(values.data(), expected.data(), scale.data(), values.size(), 1e-6, name);
+                
+                std::vector<float> derivatives(inputs.size());
+                Activation::derivative(std::span<const float>(inputs), std::span<float>(derivatives), types[t]);
+                expectClose(derivatives.data(), expectedDerivatives.data(), scale.data(), derivatives.size(), 1e-6, name + " derivative");
+            }
+        }
+    }
+    
+    // Every index of the range runs exactly once, in chunks of at most the grain, on the pool's workers
+    void checkThreadPool()
+    {
+        for (int numThreads : { 1, 2, 4, 7 })
+        {
+            ThreadPool pool(numThreads);
+            expect(pool.size() == numThreads, "a pool of " + std::to_string(numThreads) + " has " + std::to_string(pool.size()) + " workers");
+            
+            for (int count : { 0, 1, 5, 64, 10007 })
+            {
+                for (int grain : { 1, 7, 256 })
+                {
+                    std::string name = std::to_string(numThreads) + " threads, " + std::to_string(count) + " by " + std::to_string(grain);
+                    std::vector<std::atomic<int>> visits(count);
+                    std::atomic<bool> valid { true };
+                    
+                    pool.parallelFor(count, grain, [&](int begin, int end, int worker)
+                    {
+                        if (begin < 0 || end > count || begin >= end || end - begin > grain || worker < 0 || worker >= pool.size())
+                        {
+                            valid = false;
+                            return;
+                        }
+                        for (int i = begin; i < end; i++)
+                        {
+                            visits[i]++;
+                        }
+                    });
+                    
+                    expect(valid, name + " handed out a bad chunk");
+                    expect(std::all_of(visits.begin(), visits.end(), [](const std::atomic<int>& v) { return v == 1; }), name + " did not run every index once");
+                }
+            }
+            
+            // A nested call runs inline on the worker that makes it
+            std::atomic<int> nestedVisits { 0 };
+            std::atomic<bool> inline_ { true };
+            pool.parallelFor(16, 1, [&](int, int, int worker)
+            {
+                std::thread::id thread = std::this_thread::get_id();
+                pool.parallelFor(8, 2, [&](int begin, int end, int nestedWorker)
+                {
+                    inline_ = inline_ && nestedWorker == worker && std::this_thread::get_id() == thread;
+                    nestedVisits += end - begin;
+                });
+            });
+            expect(inline_ && nestedVisits == 16 * 8, std::to_string(numThreads) + " threads: a nested parallelFor did not run inline");
+        }
+        
+        ThreadPool single(1);
+        std::thread::id caller = std::this_thread::get_id();
+        bool onCaller = true;
+        single.parallelFor(100, 3, [&](int, int, int) { onCaller = onCaller && std::this_thread::get_id() == caller; });
+        expect(onCaller, "a pool of one did not run on the calling thread");
+    }
+    
+    // The pool only changes how a mini-batch is split into chunks and how their gradients are reduced, so any
+    // thread count trains to the same weights up to the order of the gradient sums, and evaluates to the same accuracy
+    void checkThreads()
+    {
+        const Samples& samples = files().testSamples;
+        std::vector<std::vector<float>> outputs;
+        
+        for (int numThreads : { 1, 3, 4 })
+        {
+            Network network({kNumInputs, kNumHidden, kNumClasses}, ActivationType::Sigmoid, CostType::CrossEntropy);
+            network.setNumThreads(numThreads);
+            network.initRandomWeights();
+            network.loadData(files().trainCsv, kNumInputs, kNumTrainSamples);
+            network.train(1, kMiniBatchSize, kLearnRate, 0.0f, kMomentum);
+            
+            outputs.emplace_back((size_t) samples.size() * kNumClasses);
+            network.forwardPass(samples.inputs.data(), samples.size(), outputs.back().data());
+            
+            network.clearData();
+            network.loadData(files().testCsv, kNumInputs, kNumTestSamples);
+            EvaluationResult result = network.test();
+            network.setNumThreads(numThreads == 1 ? 3 : 1);
+            EvaluationResult otherResult = network.test();
+            expect(otherResult.numCorrect == result.numCorrect && otherResult.confusionMatrix == result.confusionMatrix, "test() counts depend on the number of threads");
+            expect(std::abs(otherResult.loss - result.loss) <= 1e-6f * (1 + result.loss), "test() loss depends on the number of threads");
+        }
+        
+        // 2, 6 and 7 chunks to a mini-batch
+        std::vector<double> expected(outputs[0].begin(), outputs[0].end());
+        expectClose(outputs[1].data(), expected.data(), nullptr, expected.size(), 1e-4, "3 threads against 1");
+        expectClose(outputs[2].data(), expected.data(), nullptr, expected.size(), 1e-4, "4 threads against 1");
+    }
+    
+    const std::pair<const char*, void (*)()> kChecks[] = {
+        {"kernels", checkKernels},
+        {"layer_paths", checkLayerPaths},
+        {"network_inference", checkNetworkInference},
+        {"span_inference", checkSpanInference},
+        {"model_files", checkModelFiles},
+        {"quantized", checkQuantized},
+        {"pruning", checkPruning},
+        {"static_network", checkStaticNetwork},
+        {"datasets", checkDatasets},
+        {"batch_pipeline", checkBatchPipeline},
+        {"telemetry", checkTelemetry},
+        {"optimizers", checkOptimizers},
+        {"pipelined", checkPipelined},
+        {"data_parallel", checkDataParallel},
+        {"async", checkAsync},
+        {"activations", checkActivations},
+        {"cost", checkCost},
+        {"thread_pool", checkThreadPool},
+        {"threads", checkThreads},
+    };
+}
+
+int main(int argc, const char* argv[])
+{
+    std::vector<std::string> names(argv + 1, argv + argc);
+    
+    int numFailed = 0;
+    int numRun = 0;
+    for (const auto& [name, check] : kChecks)
+    {
+        if (!names.empty() && std::find(names.begin(), names.end(), name) == names.end())
+        {
+            continue;
+        }
+        numRun++;
+        
+        try
+        {
+            check();
+            std::cout << "[" << name << "] passed" << std::endl;
+        }
+        catch (const std::exception& error)
+        {
+            std::cerr << "[" << name << "] FAILED: " << error.what() << std::endl;
+            numFailed++;
+        }
+    }
+    
+    if (numRun < std::max((int) names.size(), 1))
+    {
+        std::cerr << "usage: nn_tests [check ...], checks are";
+        for (const auto& check : kChecks)
+        {
+            std::cerr << " " << check.first;
+        }
+        std::cerr << std::endl;
+        return 1;
+    }
+    
+    return numFailed == 0 ? 0 : 1;
+}